@@ -43,5 +43,9 @@ if(SDL2_MAIN_FOUND AND NOT TARGET SDL2main)
     target_link_libraries(SDL2main INTERFACE ${SDL2_MAIN_LIBRARY} ${SDL2_LIBRARY})
 endif()
 
-add_library(SDL2::SDL2 ALIAS SDL2)
-add_library(SDL2::SDL2main ALIAS SDL2main)
+if(TARGET SDL2 AND NOT TARGET SDL2::SDL2)
+    add_library(SDL2::SDL2 ALIAS SDL2)
+endif()
+if(TARGET SDL2main AND NOT TARGET SDL2::SDL2main)
+    add_library(SDL2::SDL2main ALIAS SDL2main)
+endif()
@@ -4,13 +4,13 @@
 #include "audio.h"
 
 #include <stdint.h>
-#include <cstdlib>
-#include <cstring>
-
-#include <SDL.h>
+#include <atomic>
+#include <cassert>
 
+#include "context.h"
 #include "cpu.h"
 #include "io.h"
+#include "video.h"
 
 static double cubic_interpolate(int8_t *history, double mu) {
     double A = history[3] - history[2] - history[0] + history[1];
@@ -26,88 +26,109 @@ static int16_t clamp_i16(int32_t x, int16_t min, int16_t max) {
     return x;
 }
 
-static void audio_callback(void *userdata, uint8_t *stream_u8, int len_u8) {
-    UNUSED(userdata);
-    int16_t *stream = (int16_t *) stream_u8;
-    int len = len_u8 / 2;
-
-    uint16_t a_timer = BIT(ioreg.soundcnt_h.w, 10);
-    uint16_t b_timer = BIT(ioreg.soundcnt_h.w, 14);
-    uint16_t a_control = ioreg.timer[a_timer].control.w;
-    uint16_t b_control = ioreg.timer[b_timer].control.w;
-    uint16_t a_reload = ioreg.timer[a_timer].reload.w;
-    uint16_t b_reload = ioreg.timer[b_timer].reload.w;
+// Runs on the emulation thread after each frame. Mixes the sound of one frame at the host rate,
+// stretched by the given factor (and lowered in pitch to match), and adds it to the ring. Only the
+// FIFO side of the machine is touched here, so the audio thread never sees the machine state.
+// Whatever would take the ring past max_buffered frames is dropped, which is what happens to most
+// of the sound when running faster than real time.
+void audio_mix(double stretch, size_t max_buffered) {
+    assert(max_buffered <= AUDIO_RING_SIZE);
+    uint16_t a_timer = BIT(gba->ioreg.soundcnt_h.w, 10);
+    uint16_t b_timer = BIT(gba->ioreg.soundcnt_h.w, 14);
+    uint16_t a_control = gba->ioreg.timer[a_timer].control.w;
+    uint16_t b_control = gba->ioreg.timer[b_timer].control.w;
+    uint16_t a_reload = gba->ioreg.timer[a_timer].reload.w;
+    uint16_t b_reload = gba->ioreg.timer[b_timer].reload.w;
     double a_source_rate = 16777216.0 / (65536 - a_reload);
     double b_source_rate = 16777216.0 / (65536 - b_reload);
-    double target_rate = 48000.0;
+    double target_rate = AUDIO_SAMPLE_RATE * stretch;
     double a_ratio = a_source_rate / target_rate;
     double b_ratio = b_source_rate / target_rate;
-    static double a_fraction = 0;
-    static double b_fraction = 0;
-    static int8_t a_history[4];
-    static int8_t b_history[4];
+    double *a_fraction = &gba->audio_a_fraction;
+    double *b_fraction = &gba->audio_b_fraction;
+    int8_t *a_history = gba->audio_a_history;
+    int8_t *b_history = gba->audio_b_history;
 
-    for (int i = 0; i < len; i += 2) {
+    gba->audio_samples_owed += target_rate * CYCLES_FRAME / 16777216;
+    int len = (int) gba->audio_samples_owed;
+    gba->audio_samples_owed -= len;
+
+    size_t write = gba->audio_ring_write.load(std::memory_order_relaxed);
+    size_t buffered = write - gba->audio_ring_read.load(std::memory_order_acquire);
+
+    for (int i = 0; i < len; i++) {
         a_history[0] = a_history[1];
         a_history[1] = a_history[2];
         a_history[2] = a_history[3];
-        a_history[3] = (BIT(a_control, 7) ? (int8_t) ioreg.fifo_a[ioreg.fifo_a_r] : 0);
-        double a = cubic_interpolate(a_history, a_fraction);
-        a_fraction += a_ratio;
-        if (a_fraction >= 1.0) {
-            a_fraction -= (int) a_fraction;  // % 1.0
-            if ((ioreg.fifo_a_r + 1) % FIFO_SIZE != ioreg.fifo_a_w) {
-                ioreg.fifo_a_r = (ioreg.fifo_a_r + 1) % FIFO_SIZE;
+        a_history[3] = (BIT(a_control, 7) ? (int8_t) gba->ioreg.fifo_a[gba->ioreg.fifo_a_r] : 0);
+        double a = cubic_interpolate(a_history, *a_fraction);
+        *a_fraction += a_ratio;
+        if (*a_fraction >= 1.0) {
+            *a_fraction -= (int) *a_fraction;  // % 1.0
+            if ((gba->ioreg.fifo_a_r + 1) % FIFO_SIZE != gba->ioreg.fifo_a_w) {
+                gba->ioreg.fifo_a_r = (gba->ioreg.fifo_a_r + 1) % FIFO_SIZE;
             }
         }
 
         b_history[0] = b_history[1];
         b_history[1] = b_history[2];
         b_history[2] = b_history[3];
-        b_history[3] = (BIT(b_control, 7) ? (int8_t) ioreg.fifo_b[ioreg.fifo_b_r] : 0);
-        double b = cubic_interpolate(b_history, a_fraction);
-        b_fraction += b_ratio;
-        if (b_fraction >= 1.0) {
-            b_fraction -= (int) b_fraction;  // % 1.0
-            if ((ioreg.fifo_b_r + 1) % FIFO_SIZE != ioreg.fifo_b_w) {
-                ioreg.fifo_b_r = (ioreg.fifo_b_r + 1) % FIFO_SIZE;
+        b_history[3] = (BIT(b_control, 7) ? (int8_t) gba->ioreg.fifo_b[gba->ioreg.fifo_b_r] : 0);
+        double b = cubic_interpolate(b_history, *a_fraction);
+        *b_fraction += b_ratio;
+        if (*b_fraction >= 1.0) {
+            *b_fraction -= (int) *b_fraction;  // % 1.0
+            if ((gba->ioreg.fifo_b_r + 1) % FIFO_SIZE != gba->ioreg.fifo_b_w) {
+                gba->ioreg.fifo_b_r = (gba->ioreg.fifo_b_r + 1) % FIFO_SIZE;
             }
         }
 
+        if (buffered == max_buffered) continue;
         int16_t left = 0;
         int16_t right = 0;
-        if (BIT(ioreg.soundcnt_h.w, 8)) right = clamp_i16(right + a, -512, 511);
-        if (BIT(ioreg.soundcnt_h.w, 9)) left = clamp_i16(left + a, -512, 511);
-        if (BIT(ioreg.soundcnt_h.w, 12)) right = clamp_i16(right + b, -512, 511);
-        if (BIT(ioreg.soundcnt_h.w, 13)) left = clamp_i16(left + b, -512, 511);
-        stream[i] = left << 7;
-        stream[i + 1] = right << 7;
+        if (BIT(gba->ioreg.soundcnt_h.w, 8)) right = clamp_i16(right + a, -512, 511);
+        if (BIT(gba->ioreg.soundcnt_h.w, 9)) left = clamp_i16(left + a, -512, 511);
+        if (BIT(gba->ioreg.soundcnt_h.w, 12)) right = clamp_i16(right + b, -512, 511);
+        if (BIT(gba->ioreg.soundcnt_h.w, 13)) left = clamp_i16(left + b, -512, 511);
+        gba->audio_ring[write % AUDIO_RING_SIZE][0] = left << 7;
+        gba->audio_ring[write % AUDIO_RING_SIZE][1] = right << 7;
+        write++;
+        buffered++;
     }
+
+    gba->audio_ring_write.store(write, std::memory_order_release);
 }
 
-void audio_fifo_a(uint32_t sample) {
-    *(uint32_t *) &ioreg.fifo_a[ioreg.fifo_a_w] = sample;
-    ioreg.fifo_a_w = (ioreg.fifo_a_w + 4) % FIFO_SIZE;
+// Runs on the host's audio thread. If the ring runs dry, the last frame is held rather than
+// dropping to zero, which would click.
+void audio_render(int16_t *stream, int len) {
+    size_t read = gba->audio_ring_read.load(std::memory_order_relaxed);
+    size_t available = gba->audio_ring_write.load(std::memory_order_acquire) - read;
+
+    for (int i = 0; i < len; i += 2) {
+        if (available != 0) {
+            gba->audio_last[0] = gba->audio_ring[read % AUDIO_RING_SIZE][0];
+            gba->audio_last[1] = gba->audio_ring[read % AUDIO_RING_SIZE][1];
+            read++;
+            available--;
+        }
+        stream[i] = gba->audio_last[0];
+        stream[i + 1] = gba->audio_last[1];
+    }
+
+    gba->audio_ring_read.store(read, std::memory_order_release);
 }
 
-void audio_fifo_b(uint32_t sample) {
-    *(uint32_t *) &ioreg.fifo_b[ioreg.fifo_b_w] = sample;
-    ioreg.fifo_b_w = (ioreg.fifo_b_w + 4) % FIFO_SIZE;
+size_t audio_buffered() {
+    return gba->audio_ring_write.load(std::memory_order_acquire) - gba->audio_ring_read.load(std::memory_order_acquire);
 }
 
-SDL_AudioDeviceID audio_init() {
-    SDL_AudioSpec want;
-    std::memset(&want, 0, sizeof(want));
-    want.freq = 48000;
-    want.format = AUDIO_S16;
-    want.channels = 2;
-    want.samples = FIFO_SIZE;
-    want.callback = audio_callback;
-    SDL_AudioDeviceID audio_device = SDL_OpenAudioDevice(nullptr, 0, &want, nullptr, 0);
-    if (audio_device == 0) {
-        SDL_Log("Failed to open audio device: %s", SDL_GetError());
-        std::exit(EXIT_FAILURE);
-    }
-    SDL_PauseAudioDevice(audio_device, 0);
-    return audio_device;
+void audio_fifo_a(uint32_t sample) {
+    *(uint32_t *) &gba->ioreg.fifo_a[gba->ioreg.fifo_a_w] = sample;
+    gba->ioreg.fifo_a_w = (gba->ioreg.fifo_a_w + 4) % FIFO_SIZE;
+}
+
+void audio_fifo_b(uint32_t sample) {
+    *(uint32_t *) &gba->ioreg.fifo_b[gba->ioreg.fifo_b_w] = sample;
+    gba->ioreg.fifo_b_w = (gba->ioreg.fifo_b_w + 4) % FIFO_SIZE;
 }
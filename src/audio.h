@@ -4,9 +4,13 @@
 #pragma once
 
 #include <stdint.h>
+#include <cstddef>
 
-#include <SDL.h>
+#define AUDIO_SAMPLE_RATE 48000
+#define AUDIO_RING_SIZE   8192  // Output frames between the emulation and the host, a power of two
 
+void audio_mix(double stretch, size_t max_buffered);  // Resamples one frame's worth of sound from the FIFOs into the ring
+void audio_render(int16_t *stream, int len);          // Copies len interleaved left/right samples out of the ring
+size_t audio_buffered();                              // Output frames waiting in the ring
 void audio_fifo_a(uint32_t sample);
 void audio_fifo_b(uint32_t sample);
-SDL_AudioDeviceID audio_init();
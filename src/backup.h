@@ -21,19 +21,6 @@
 #define DEVICE_MX29L512        0x1c  // 512 Kbit
 #define DEVICE_MX29L010        0x09  // 1 Mbit
 
-extern bool has_eeprom;
-extern bool has_flash;
-extern bool has_sram;
-
-extern uint8_t backup_eeprom[0x2000];
-extern uint8_t backup_flash[0x20000];
-extern uint8_t backup_sram[0x8000];
-
-extern uint32_t eeprom_width;
-
-extern uint8_t flash_manufacturer;
-extern uint8_t flash_device;
-
 void backup_erase();
 void backup_init();
 uint8_t backup_read_byte(uint32_t address);
@@ -0,0 +1,572 @@
+// Copyright (c) 2021 Ridge Shrubsall
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "bios.h"
+
+#include <stdint.h>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <numbers>
+#include <string>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "context.h"
+#include "cpu.h"
+#include "io.h"
+#include "memory.h"
+#include "system.h"
+
+#define BIOS_IRQ_FLAGS 0x03007ff8  // Interrupts acknowledged by the game's handler, checked by IntrWait
+
+// Approximate cycles spent by the real BIOS, on top of the memory accesses
+#define CYCLES_CALL   40   // SWI entry, dispatch and return
+#define CYCLES_DIV    200
+#define CYCLES_SQRT   250
+#define CYCLES_ARCTAN 100
+#define CYCLES_AFFINE 80   // Per matrix
+#define CYCLES_UNIT   4    // Per unit copied, filled or decompressed
+
+// Used in place of gba_bios.bin, with HLE forced on. Calls that aren't emulated are reported and
+// return at once, and the IRQ vector dispatches to the handler at 0x03007ffc like the real one.
+static const uint32_t bios_stub[] = {
+    0xeafffffe,  // 0x00: b 0x00
+    0xe1b0f00e,  // 0x04: movs pc, lr
+    0xe1b0f00e,  // 0x08: movs pc, lr
+    0xe25ef004,  // 0x0c: subs pc, lr, #4
+    0xe25ef004,  // 0x10: subs pc, lr, #4
+    0xeafffffe,  // 0x14: b 0x14
+    0xea000000,  // 0x18: b 0x20
+    0xe25ef004,  // 0x1c: subs pc, lr, #4
+    0xe92d500f,  // 0x20: stmfd sp!, {r0-r3, r12, lr}
+    0xe3a00301,  // 0x24: mov r0, #0x04000000
+    0xe28fe000,  // 0x28: add lr, pc, #0
+    0xe510f004,  // 0x2c: ldr pc, [r0, #-4]
+    0xe8bd500f,  // 0x30: ldmfd sp!, {r0-r3, r12, lr}
+    0xe25ef004,  // 0x34: subs pc, lr, #4
+};
+
+void bios_init() {
+    gba->bios_waiting = false;
+}
+
+void bios_install_stub() {
+    std::memset(gba->system_rom, 0, sizeof(gba->system_rom));
+    std::memcpy(gba->system_rom, bios_stub, sizeof(bios_stub));
+    gba->bios_hle_enabled = true;
+    gba->bios_stub_installed = true;
+}
+
+// The BIOS ignores any source address inside itself
+static bool bios_source_allowed(uint32_t address) {
+    return (address & 0x0e000000) != 0;
+}
+
+// Entry i of the BIOS sine table, in 1.14 fixed point
+static int32_t bios_sine(uint32_t i) {
+    return (int32_t) std::lround(std::sin((i & 0xff) * std::numbers::pi / 128) * 0x4000);
+}
+
+// Clears memory through the bus, so the caches derived from it see the change
+static void bios_clear(uint32_t start, uint32_t end) {
+    for (uint32_t address = start; address < end; address += 4) memory_poke_word(address, 0);
+    system_tick((end - start) / 4 * CYCLES_UNIT / 4);
+}
+
+static void bios_soft_reset() {
+    bool start_in_ewram = (memory_read_byte(0x03007ffa) != 0);
+    bios_clear(0x03007e00, 0x03008000);
+
+    // Each mode gets the stack it would have after boot, ending up in System mode and ARM state
+    gba->branch_taken = true;
+    write_cpsr(PSR_I | PSR_F | PSR_MODE_SVC);
+    gba->r[REG_SP] = 0x03007fe0;
+    gba->r[REG_LR] = 0;
+    write_spsr(0);
+    write_cpsr(PSR_I | PSR_F | PSR_MODE_IRQ);
+    gba->r[REG_SP] = 0x03007fa0;
+    gba->r[REG_LR] = 0;
+    write_spsr(0);
+    write_cpsr(PSR_MODE_SYS);
+    std::memset(gba->r, 0, sizeof(uint32_t) * 15);
+    gba->r[REG_SP] = 0x03007f00;
+    gba->r[REG_PC] = (start_in_ewram ? 0x02000000 : 0x08000000);
+}
+
+static void bios_register_ram_reset(uint32_t flags) {
+    io_write_halfword(REG_DISPCNT, 0x80);
+    if (flags & 0x01) bios_clear(0x02000000, 0x02040000);
+    if (flags & 0x02) bios_clear(0x03000000, 0x03007e00);  // The top 512 bytes hold the stacks and the IRQ handler address
+    if (flags & 0x04) bios_clear(0x05000000, 0x05000400);
+    if (flags & 0x08) bios_clear(0x06000000, 0x06018000);
+    if (flags & 0x10) bios_clear(0x07000000, 0x07000400);
+    if (flags & 0x20) {
+        for (uint32_t reg = REG_SIODATA32_L; reg <= REG_SIODATA8; reg += 2) io_write_halfword(reg, 0);
+        for (uint32_t reg = REG_JOYCNT; reg <= REG_JOYSTAT; reg += 2) io_write_halfword(reg, 0);
+        io_write_halfword(REG_RCNT, 0x8000);  // General purpose mode
+    }
+    if (flags & 0x40) {
+        for (uint32_t reg = REG_SOUND1CNT_L; reg <= REG_WAVE_RAM3_H; reg += 2) {
+            if (reg != REG_SOUNDBIAS) io_write_halfword(reg, 0);
+        }
+    }
+    if (flags & 0x80) {
+        for (uint32_t reg = REG_DISPSTAT; reg <= REG_BLDY; reg += 2) io_write_halfword(reg, 0);
+        for (uint32_t reg = REG_DMA0SAD_L; reg <= REG_TM3CNT_H; reg += 2) io_write_halfword(reg, 0);
+        io_write_halfword(REG_KEYCNT, 0);
+        io_write_halfword(REG_IE, 0);
+        io_write_halfword(REG_IF, 0xffff);  // Acknowledges whatever is pending
+        io_write_halfword(REG_WAITCNT, 0);
+        io_write_halfword(REG_IME, 0);
+    }
+}
+
+static void bios_intr_wait(bool discard, uint16_t flags) {
+    uint32_t address = get_pc();
+
+    gba->ioreg.ime.w = 1;
+    uint16_t acknowledged = memory_read_halfword(BIOS_IRQ_FLAGS);
+    if (discard && !gba->bios_waiting) {
+        acknowledged &= ~flags;
+        memory_write_halfword(BIOS_IRQ_FLAGS, acknowledged);
+    }
+    if (acknowledged & flags) {
+        memory_write_halfword(BIOS_IRQ_FLAGS, acknowledged & ~flags);
+        gba->bios_waiting = false;
+        return;
+    }
+
+    // Take the interrupt now if it can be, so the handler returns to the SWI
+    gba->bios_waiting = true;
+    if ((gba->ioreg.irq.w & gba->ioreg.ie.w) && !(gba->cpsr & PSR_I)) {
+        arm_hardware_interrupt();
+    } else {
+        gba->halted = true;
+        gba->r[REG_PC] = address;
+        gba->branch_taken = true;
+    }
+}
+
+static void bios_div(int32_t number, int32_t denom) {
+    if (denom == 0) {
+        // The real BIOS never returns
+        gba->r[0] = (number < 0 ? -1 : 1);
+        gba->r[1] = number;
+        gba->r[3] = 1;
+        return;
+    }
+    int64_t quotient = (int64_t) number / denom;
+    int64_t remainder = (int64_t) number % denom;
+    gba->r[0] = (uint32_t) quotient;
+    gba->r[1] = (uint32_t) remainder;
+    gba->r[3] = (uint32_t) (quotient < 0 ? -quotient : quotient);
+    system_tick(CYCLES_DIV);
+}
+
+// Same polynomial approximation as the BIOS, so results match bit for bit
+static int32_t bios_arctan(int32_t i, int32_t *a_out = nullptr, int32_t *b_out = nullptr) {
+    int32_t a = -((i * i) >> 14);
+    int32_t b = ((0xa9 * a) >> 14) + 0x390;
+    b = ((b * a) >> 14) + 0x91c;
+    b = ((b * a) >> 14) + 0xfb6;
+    b = ((b * a) >> 14) + 0x16aa;
+    b = ((b * a) >> 14) + 0x2081;
+    b = ((b * a) >> 14) + 0x3651;
+    b = ((b * a) >> 14) + 0xa2f9;
+    if (a_out != nullptr) *a_out = a;
+    if (b_out != nullptr) *b_out = b;
+    return (i * b) >> 16;
+}
+
+static uint16_t bios_arctan2(int32_t x, int32_t y) {
+    auto ratio = [](int32_t n, int32_t d) { return (int32_t) ((uint32_t) n << 14) / d; };
+    if (y == 0) return (x >= 0 ? 0 : 0x8000);
+    if (x == 0) return (y >= 0 ? 0x4000 : 0xc000);
+    if (y >= 0) {
+        if (x >= 0) {
+            if (x >= y) return bios_arctan(ratio(y, x));
+            return 0x4000 - bios_arctan(ratio(x, y));
+        }
+        if (-x >= y) return 0x8000 + bios_arctan(ratio(y, x));
+        return 0x4000 - bios_arctan(ratio(x, y));
+    }
+    if (x <= 0) {
+        if (-x > -y) return 0x8000 + bios_arctan(ratio(y, x));
+        return 0xc000 - bios_arctan(ratio(x, y));
+    }
+    if (x >= -y) return 0x10000 + bios_arctan(ratio(y, x));
+    return 0xc000 - bios_arctan(ratio(x, y));
+}
+
+static void bios_cpu_set() {
+    uint32_t src = gba->r[0];
+    uint32_t dst = gba->r[1];
+    uint32_t count = BITS(gba->r[2], 0, 20);
+    bool fill = BIT(gba->r[2], 24);
+    bool word = BIT(gba->r[2], 26);
+    if (!bios_source_allowed(src)) return;
+
+    if (word) {
+        src &= ~3;
+        dst &= ~3;
+        uint32_t value = memory_read_word(src);
+        for (uint32_t i = 0; i < count; i++) {
+            if (!fill && i != 0) value = memory_read_word(src + i * 4);
+            memory_write_word(dst + i * 4, value);
+        }
+    } else {
+        src &= ~1;
+        dst &= ~1;
+        uint16_t value = memory_read_halfword(src);
+        for (uint32_t i = 0; i < count; i++) {
+            if (!fill && i != 0) value = memory_read_halfword(src + i * 2);
+            memory_write_halfword(dst + i * 2, value);
+        }
+    }
+    system_tick(count * CYCLES_UNIT);
+}
+
+static void bios_cpu_fast_set() {
+    uint32_t src = gba->r[0] & ~3;
+    uint32_t dst = gba->r[1] & ~3;
+    uint32_t count = (BITS(gba->r[2], 0, 20) + 7) & ~7;  // Always whole blocks of eight words
+    bool fill = BIT(gba->r[2], 24);
+    if (!bios_source_allowed(src)) return;
+
+    uint32_t value = memory_read_word(src);
+    for (uint32_t i = 0; i < count; i++) {
+        if (!fill && i != 0) value = memory_read_word(src + i * 4);
+        memory_write_word(dst + i * 4, value);
+    }
+    system_tick(count * CYCLES_UNIT / 4);
+}
+
+static void bios_bg_affine_set() {
+    uint32_t src = gba->r[0];
+    uint32_t dst = gba->r[1];
+    for (uint32_t i = 0; i < gba->r[2]; i++) {
+        int32_t ox = (int32_t) memory_read_word(src);
+        int32_t oy = (int32_t) memory_read_word(src + 4);
+        int32_t cx = (int16_t) memory_read_halfword(src + 8);
+        int32_t cy = (int16_t) memory_read_halfword(src + 10);
+        int32_t sx = (int16_t) memory_read_halfword(src + 12);
+        int32_t sy = (int16_t) memory_read_halfword(src + 14);
+        uint32_t theta = memory_read_halfword(src + 16) >> 8;
+        src += 20;
+
+        int32_t sin = bios_sine(theta);
+        int32_t cos = bios_sine(theta + 64);
+        int16_t pa = (int16_t) ((sx * cos) >> 14);
+        int16_t pb = (int16_t) -((sx * sin) >> 14);
+        int16_t pc = (int16_t) ((sy * sin) >> 14);
+        int16_t pd = (int16_t) ((sy * cos) >> 14);
+        memory_write_halfword(dst, pa);
+        memory_write_halfword(dst + 2, pb);
+        memory_write_halfword(dst + 4, pc);
+        memory_write_halfword(dst + 6, pd);
+        memory_write_word(dst + 8, ox - (pa * cx + pb * cy));
+        memory_write_word(dst + 12, oy - (pc * cx + pd * cy));
+        dst += 16;
+        system_tick(CYCLES_AFFINE);
+    }
+}
+
+static void bios_obj_affine_set() {
+    uint32_t src = gba->r[0];
+    uint32_t dst = gba->r[1];
+    uint32_t stride = gba->r[3];
+    for (uint32_t i = 0; i < gba->r[2]; i++) {
+        int32_t sx = (int16_t) memory_read_halfword(src);
+        int32_t sy = (int16_t) memory_read_halfword(src + 2);
+        uint32_t theta = memory_read_halfword(src + 4) >> 8;
+        src += 8;
+
+        int32_t sin = bios_sine(theta);
+        int32_t cos = bios_sine(theta + 64);
+        memory_write_halfword(dst, (uint16_t) ((sx * cos) >> 14));
+        memory_write_halfword(dst + stride, (uint16_t) -((sx * sin) >> 14));
+        memory_write_halfword(dst + stride * 2, (uint16_t) ((sy * sin) >> 14));
+        memory_write_halfword(dst + stride * 3, (uint16_t) ((sy * cos) >> 14));
+        dst += stride * 4;
+        system_tick(CYCLES_AFFINE);
+    }
+}
+
+static void bios_bit_unpack() {
+    uint32_t src = gba->r[0];
+    uint32_t dst = gba->r[1] & ~3;
+    uint32_t info = gba->r[2];
+    if (!bios_source_allowed(src)) return;
+
+    uint32_t length = memory_read_halfword(info);
+    uint32_t src_width = memory_read_byte(info + 2);
+    uint32_t dst_width = memory_read_byte(info + 3);
+    uint32_t offset = memory_read_word(info + 4);
+    bool offset_zeros = BIT(offset, 31);
+    offset &= 0x7fffffff;
+    if (!std::has_single_bit(src_width) || src_width > 8 || !std::has_single_bit(dst_width) || dst_width > 32) return;
+
+    uint32_t out = 0;
+    uint32_t out_bits = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        uint8_t in = memory_read_byte(src + i);
+        for (uint32_t bit = 0; bit < 8; bit += src_width) {
+            uint32_t value = (in >> bit) & ((1 << src_width) - 1);
+            if (value != 0 || offset_zeros) value += offset;
+            out |= value << out_bits;
+            out_bits += dst_width;
+            if (out_bits == 32) {
+                memory_write_word(dst, out);
+                dst += 4;
+                out = 0;
+                out_bits = 0;
+            }
+        }
+    }
+    system_tick(length * CYCLES_UNIT);
+}
+
+// VRAM variants write halfwords, so a trailing odd byte is dropped
+static void bios_write_output(uint32_t dst, const std::vector<uint8_t> &data, bool vram) {
+    if (vram) {
+        for (size_t i = 0; i + 1 < data.size(); i += 2) {
+            memory_write_halfword(dst + i, data[i] | data[i + 1] << 8);
+        }
+    } else {
+        for (size_t i = 0; i < data.size(); i++) {
+            memory_write_byte(dst + i, data[i]);
+        }
+    }
+    system_tick(data.size() * CYCLES_UNIT);
+}
+
+static void bios_lz77_uncomp(bool vram) {
+    uint32_t src = gba->r[0];
+    uint32_t dst = gba->r[1];
+    if (!bios_source_allowed(src)) return;
+
+    uint32_t size = memory_read_word(src) >> 8;
+    src += 4;
+    std::vector<uint8_t> data;
+    data.reserve(size);
+    while (data.size() < size) {
+        uint8_t flags = memory_read_byte(src++);
+        for (int i = 0; i < 8 && data.size() < size; i++, flags <<= 1) {
+            if (flags & 0x80) {
+                uint8_t hi = memory_read_byte(src++);
+                uint8_t lo = memory_read_byte(src++);
+                uint32_t length = (hi >> 4) + 3;
+                uint32_t disp = ((hi & 0xf) << 8 | lo) + 1;
+                for (uint32_t j = 0; j < length && data.size() < size; j++) {
+                    // Going back past the start of the output reads what was already there
+                    if (disp <= data.size()) {
+                        data.push_back(data[data.size() - disp]);
+                    } else {
+                        data.push_back(memory_read_byte(dst + data.size() - disp));
+                    }
+                }
+            } else {
+                data.push_back(memory_read_byte(src++));
+            }
+        }
+    }
+    bios_write_output(dst, data, vram);
+}
+
+static void bios_huff_uncomp() {
+    uint32_t src = gba->r[0] & ~3;
+    uint32_t dst = gba->r[1] & ~3;
+    if (!bios_source_allowed(src)) return;
+
+    uint32_t header = memory_read_word(src);
+    uint32_t bits = BITS(header, 0, 3);
+    uint32_t size = header >> 8;
+    if (bits != 4 && bits != 8) return;
+
+    uint32_t tree = src + 4;
+    uint32_t root = tree + 1;
+    uint32_t stream = tree + (memory_read_byte(tree) + 1) * 2;
+    uint32_t node = root;
+    uint32_t value = 0;
+    uint32_t value_bits = 0;
+    uint32_t written = 0;
+    while (written < size) {
+        uint32_t input = memory_read_word(stream);
+        stream += 4;
+        for (int i = 31; i >= 0 && written < size; i--) {
+            uint8_t entry = memory_read_byte(node);
+            bool direction = BIT(input, i);
+            uint32_t child = (node & ~1) + BITS(entry, 0, 5) * 2 + 2 + direction;
+            if (!BIT(entry, 7 - direction)) {
+                node = child;
+                continue;
+            }
+            value |= (memory_read_byte(child) & ((1 << bits) - 1)) << value_bits;
+            value_bits += bits;
+            node = root;
+            if (value_bits == 32) {
+                memory_write_word(dst, value);
+                dst += 4;
+                written += 4;
+                value = 0;
+                value_bits = 0;
+            }
+        }
+    }
+    system_tick(size * CYCLES_UNIT);
+}
+
+static void bios_rl_uncomp(bool vram) {
+    uint32_t src = gba->r[0];
+    uint32_t dst = gba->r[1];
+    if (!bios_source_allowed(src)) return;
+
+    uint32_t size = memory_read_word(src) >> 8;
+    src += 4;
+    std::vector<uint8_t> data;
+    data.reserve(size);
+    while (data.size() < size) {
+        uint8_t flag = memory_read_byte(src++);
+        if (flag & 0x80) {
+            uint32_t length = (flag & 0x7f) + 3;
+            uint8_t value = memory_read_byte(src++);
+            for (uint32_t j = 0; j < length && data.size() < size; j++) {
+                data.push_back(value);
+            }
+        } else {
+            uint32_t length = (flag & 0x7f) + 1;
+            for (uint32_t j = 0; j < length && data.size() < size; j++) {
+                data.push_back(memory_read_byte(src++));
+            }
+        }
+    }
+    bios_write_output(dst, data, vram);
+}
+
+// Undoes delta encoding in units of one or two bytes
+static void bios_diff_unfilter(uint32_t unit, bool vram) {
+    uint32_t src = gba->r[0] & ~3;
+    uint32_t dst = gba->r[1];
+    if (!bios_source_allowed(src)) return;
+
+    uint32_t size = memory_read_word(src) >> 8;
+    src += 4;
+    std::vector<uint8_t> data;
+    data.reserve(size + 1);
+    uint16_t value = 0;
+    while (data.size() < size) {
+        if (unit == 1) {
+            value = (uint8_t) (value + memory_read_byte(src));
+            data.push_back((uint8_t) value);
+        } else {
+            value += memory_read_halfword(src);
+            data.push_back((uint8_t) value);
+            data.push_back((uint8_t) (value >> 8));
+        }
+        src += unit;
+    }
+    data.resize(size);
+    bios_write_output(dst, data, vram);
+}
+
+// Stands in for a call the stub can't make, reporting it the first time
+static void bios_report_missing(uint32_t function) {
+    if (!gba->bios_calls_reported.insert(function).second) return;
+    std::string name;
+    print_bios_function_name(name, (uint8_t) function);
+    fmt::print(stderr, "BIOS call {} isn't emulated without a BIOS image, skipping it\n", name);
+}
+
+// Performs a BIOS call natively, returning false if it has to run on the BIOS instead
+bool bios_hle_call(uint32_t function) {
+    switch (function) {
+        case BIOS_SOFT_RESET:
+            bios_soft_reset();
+            break;
+        case BIOS_REGISTER_RAM_RESET:
+            bios_register_ram_reset(gba->r[0]);
+            break;
+        case BIOS_HALT:
+            gba->halted = true;
+            break;
+        case BIOS_INTR_WAIT:
+            bios_intr_wait(gba->r[0] != 0, gba->r[1]);
+            break;
+        case BIOS_VBLANK_INTR_WAIT:
+            gba->r[0] = 1;
+            gba->r[1] = 1;
+            bios_intr_wait(true, INT_VBLANK);
+            break;
+        case BIOS_DIV:
+            bios_div(gba->r[0], gba->r[1]);
+            break;
+        case BIOS_DIV_ARM:
+            bios_div(gba->r[1], gba->r[0]);
+            break;
+        case BIOS_SQRT:
+            gba->r[0] = (uint32_t) std::sqrt((double) gba->r[0]);
+            system_tick(CYCLES_SQRT);
+            break;
+        case BIOS_ARC_TAN: {
+            int32_t a, b;
+            gba->r[0] = bios_arctan((int16_t) gba->r[0], &a, &b);
+            gba->r[1] = a;
+            gba->r[3] = b;
+            system_tick(CYCLES_ARCTAN);
+            break;
+        }
+        case BIOS_ARC_TAN2:
+            gba->r[0] = bios_arctan2((int16_t) gba->r[0], (int16_t) gba->r[1]);
+            system_tick(CYCLES_ARCTAN + CYCLES_DIV);
+            break;
+        case BIOS_CPU_SET:
+            bios_cpu_set();
+            break;
+        case BIOS_CPU_FAST_SET:
+            bios_cpu_fast_set();
+            break;
+        case BIOS_GET_BIOS_CHECKSUM:
+            gba->r[0] = 0xbaae187f;
+            break;
+        case BIOS_BG_AFFINE_SET:
+            bios_bg_affine_set();
+            break;
+        case BIOS_OBJ_AFFINE_SET:
+            bios_obj_affine_set();
+            break;
+        case BIOS_BIT_UNPACK:
+            bios_bit_unpack();
+            break;
+        case BIOS_LZ77_UNCOMP_WRAM:
+            bios_lz77_uncomp(false);
+            break;
+        case BIOS_LZ77_UNCOMP_VRAM:
+            bios_lz77_uncomp(true);
+            break;
+        case BIOS_HUFF_UNCOMP:
+            bios_huff_uncomp();
+            break;
+        case BIOS_RL_UNCOMP_WRAM:
+            bios_rl_uncomp(false);
+            break;
+        case BIOS_RL_UNCOMP_VRAM:
+            bios_rl_uncomp(true);
+            break;
+        case BIOS_DIFF8_UNFILTER_WRAM:
+            bios_diff_unfilter(1, false);
+            break;
+        case BIOS_DIFF8_UNFILTER_VRAM:
+            bios_diff_unfilter(1, true);
+            break;
+        case BIOS_DIFF16_UNFILTER:
+            bios_diff_unfilter(2, true);
+            break;
+        default:
+            if (gba->bios_stub_installed) bios_report_missing(function);
+            return false;
+    }
+    system_tick(CYCLES_CALL);
+    return true;
+}
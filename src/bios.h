@@ -0,0 +1,36 @@
+// Copyright (c) 2021 Ridge Shrubsall
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include <stdint.h>
+
+#define BIOS_SOFT_RESET          0x00
+#define BIOS_REGISTER_RAM_RESET  0x01
+#define BIOS_HALT                0x02
+#define BIOS_INTR_WAIT           0x04
+#define BIOS_VBLANK_INTR_WAIT    0x05
+#define BIOS_DIV                 0x06
+#define BIOS_DIV_ARM             0x07
+#define BIOS_SQRT                0x08
+#define BIOS_ARC_TAN             0x09
+#define BIOS_ARC_TAN2            0x0a
+#define BIOS_CPU_SET             0x0b
+#define BIOS_CPU_FAST_SET        0x0c
+#define BIOS_GET_BIOS_CHECKSUM   0x0d
+#define BIOS_BG_AFFINE_SET       0x0e
+#define BIOS_OBJ_AFFINE_SET      0x0f
+#define BIOS_BIT_UNPACK          0x10
+#define BIOS_LZ77_UNCOMP_WRAM    0x11
+#define BIOS_LZ77_UNCOMP_VRAM    0x12
+#define BIOS_HUFF_UNCOMP         0x13
+#define BIOS_RL_UNCOMP_WRAM      0x14
+#define BIOS_RL_UNCOMP_VRAM      0x15
+#define BIOS_DIFF8_UNFILTER_WRAM 0x16
+#define BIOS_DIFF8_UNFILTER_VRAM 0x17
+#define BIOS_DIFF16_UNFILTER     0x18
+
+
+void bios_init();
+void bios_install_stub();
+bool bios_hle_call(uint32_t function);
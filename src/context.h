@@ -0,0 +1,195 @@
+// Copyright (c) 2021 Ridge Shrubsall
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "audio.h"
+#include "cpu.h"
+#include "io.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "video.h"
+
+// Everything that belongs to one emulated GBA. Each thread runs the instance that gba points to,
+// so several can run side by side in one process.
+struct gba_context {
+    // Machine state, which is plain data from here up to game_rom and is what save states copy.
+    // Changing it means bumping STATE_VERSION in system.cpp.
+
+    // cpu.cpp
+    uint32_t r[16];  // Kept first, so the JIT reaches the registers with short displacements
+    uint32_t r8_usr, r9_usr, r10_usr, r11_usr, r12_usr, r13_usr, r14_usr;
+    uint32_t r8_fiq, r9_fiq, r10_fiq, r11_fiq, r12_fiq, r13_fiq, r14_fiq;
+    uint32_t r13_irq, r14_irq;
+    uint32_t r13_svc, r14_svc;
+    uint32_t r13_abt, r14_abt;
+    uint32_t r13_und, r14_und;
+    uint32_t cpsr;
+    uint32_t spsr_fiq, spsr_irq, spsr_svc, spsr_abt, spsr_und;
+    bool branch_taken;
+    uint32_t arm_op;
+    uint32_t arm_pipeline[2];
+    uint16_t thumb_op;
+    uint16_t thumb_pipeline[2];
+
+    // io.cpp
+    io_registers ioreg;
+    bool halted;
+    uint16_t key_irq_held_last;
+    uint16_t key_irq_mask_last;
+    bool key_irq_raised_last;
+    bool sound_powered;
+
+    // memory.cpp
+    uint32_t last_bios_access;
+    uint8_t cpu_ewram[0x40000];
+    uint8_t cpu_iwram[0x8000];
+    uint8_t palette_ram[0x400];
+    uint8_t video_ram[0x18000];
+    uint8_t object_ram[0x400];
+
+    // scheduler.cpp
+    uint64_t scheduler_cycles;
+    uint64_t scheduler_next_event;
+    uint64_t event_deadline[NUM_EVENTS];
+
+    // dma.cpp
+    int dma_channel_active;
+    int dma_channel_finished;
+    uint32_t dma_pc;
+
+    // backup.cpp
+    bool has_eeprom;
+    bool has_flash;
+    bool has_sram;
+    uint8_t backup_eeprom[0x2000];
+    uint8_t backup_flash[0x20000];
+    uint8_t backup_sram[0x8000];
+    uint32_t eeprom_addr;
+    uint64_t eeprom_rbits;
+    uint32_t eeprom_num_rbits;
+    uint64_t eeprom_wbits;
+    uint32_t eeprom_num_wbits;
+    uint32_t eeprom_state;
+    uint32_t eeprom_width;
+    uint32_t flash_bank;
+    uint32_t flash_state;
+    bool flash_id;
+    uint8_t flash_manufacturer;
+    uint8_t flash_device;
+
+    // gpio.cpp
+    bool has_rtc;
+    uint16_t gpio_data;
+    uint16_t gpio_direction;
+    uint16_t gpio_read_enable;
+    uint64_t rtc_rbits;
+    uint32_t rtc_num_rbits;
+    uint64_t rtc_wbits;
+    uint32_t rtc_num_wbits;
+    uint32_t rtc_state;
+
+    // video.cpp
+    bool video_frame_drawn;
+
+    // bios.cpp
+    bool bios_waiting;  // An IntrWait has discarded its old flags and is waiting to be executed again
+
+    // audio.cpp
+    double audio_a_fraction;  // Resampler position, so a restored state carries on the same waveform
+    double audio_b_fraction;
+    int8_t audio_a_history[4];
+    int8_t audio_b_history[4];
+
+    // Host state, which points into this process or is rebuilt from the machine state
+
+    // memory.cpp
+    uint8_t *game_rom;
+    uint32_t game_rom_size;
+    uint32_t game_rom_mask;
+    memory_page memory_pages[PAGE_COUNT];
+    uint8_t system_rom[0x4000];  // BIOS image, or the stub standing in for it
+
+    // audio.cpp
+    double audio_samples_owed;
+    int16_t audio_ring[AUDIO_RING_SIZE][2];  // Mixed output, written by the emulation thread and read by the audio thread
+    alignas(64) std::atomic<size_t> audio_ring_read;  // Frame counts since the start, which only ever go up
+    alignas(64) std::atomic<size_t> audio_ring_write;
+    int16_t audio_last[2];  // Played again whenever the ring runs dry
+
+    // bios.cpp
+    bool bios_hle_enabled;                   // Emulate BIOS calls instead of running the BIOS code
+    bool bios_stub_installed;                // No BIOS image, so calls are always emulated
+    std::set<uint32_t> bios_calls_reported;  // Calls the stub had to skip, each reported once
+
+    // cpu-jit.cpp
+    bool cpu_jit_enabled;
+
+    // cpu-cache.cpp
+    cpu_block block_cache[BLOCK_CACHE_SIZE];
+    cpu_block_instr *arm_cache_instr;
+    cpu_block_instr *arm_cache_end;
+    uint32_t arm_cache_pc;
+    cpu_block_instr *thumb_cache_instr;
+    cpu_block_instr *thumb_cache_end;
+    uint32_t thumb_cache_pc;
+    uint8_t cache_ewram_code[0x40000 >> CODE_LINE_SHIFT];
+    uint8_t cache_iwram_code[0x8000 >> CODE_LINE_SHIFT];
+    uint8_t cache_ewram_writes[0x40000 >> CODE_LINE_SHIFT];
+    uint8_t cache_iwram_writes[0x8000 >> CODE_LINE_SHIFT];
+    bool cache_hot_lines;
+
+    // timer.cpp
+    bool timer_counter_read;  // Counters change between events, so loops that read them aren't idle
+
+    // video.cpp
+    uint32_t screen_pixels[SCREEN_HEIGHT][SCREEN_WIDTH];
+    const uint32_t *color_lut;  // Screen pixel for each BGR555 colour, e.g. with colour correction applied (nullptr for plain conversion)
+    bool video_skip_render;  // Set for frames nobody will see: timing, IRQs and DMA carry on, but nothing is drawn
+    ScanlineInfo scanline;
+    bool active_compute_sprite_masks;
+    bool active_sprite_transparency;
+    bool active_sprite_mask;
+    WindowInfo win0, win1;
+    uint8_t tile_cache_4bpp[TILE_SLOTS][64];  // VRAM tiles decoded to a palette index per pixel
+    uint8_t tile_cache_8bpp[TILE_SLOTS][64];
+    bool tile_valid_4bpp[TILE_SLOTS];  // Cleared when VRAM under the tile is written
+    bool tile_valid_8bpp[TILE_SLOTS];
+    uint64_t tile_cache_hits;
+    uint64_t tile_cache_misses;
+
+    // rewind.cpp
+    int rewind_interval;  // 0 when rewinding is off
+    int rewind_frames;    // Frames captured since the newest snapshot
+    size_t rewind_budget;
+    size_t rewind_bytes;
+    bool rewind_has_snapshot;
+    std::vector<uint8_t> rewind_snapshot;
+    std::vector<uint8_t> rewind_scratch;
+    std::vector<uint8_t> rewind_encoded;
+    std::deque<std::vector<uint8_t>> rewind_deltas;  // Oldest first, each one leads back from the snapshot after it
+
+    // system.cpp
+    bool skip_bios;    // Start the game directly instead of running the boot logo
+    bool single_step;  // system_emulate_frame returns after one instruction
+    std::string save_path;
+    std::tuple<std::string, std::string, uint8_t> game_key;  // Header fields that identify the game: title, code and version
+    std::string idle_loop_path;
+    std::set<uint32_t> idle_loops;  // Confirmed idle loops, also saved for later runs
+    bool idle_loops_changed;        // Found some that aren't in the file yet
+    uint32_t idle_loop_head;
+    uint64_t idle_loop_cycles;
+    uint32_t idle_loop_passes;
+    std::vector<uint8_t> run_ahead_state;
+};
+
+extern thread_local constinit gba_context *gba;
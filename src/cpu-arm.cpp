@@ -9,6 +9,8 @@
 #include <cstdlib>
 #include <string>
 
+#include "bios.h"
+#include "context.h"
 #include "memory.h"
 
 static uint64_t arm_alu_op(uint32_t opc, uint64_t n, uint64_t m) {
@@ -200,22 +202,22 @@ void arm_data_processing_register(uint32_t op) {
         assert(Rn == 0);
     }
 
-    uint32_t s = (shreg ? (uint8_t) r[Rs] : shamt);  // Use least significant byte of Rs
-    uint32_t m = r[Rm];
+    uint32_t s = (shreg ? (uint8_t) gba->r[Rs] : shamt);  // Use least significant byte of Rs
+    uint32_t m = gba->r[Rm];
     if (Rm == REG_PC && shreg) m += SIZEOF_INSTR;  // PC ahead when shift register specified
     m = arm_shifter_op(m, s, shop, shreg, true);
-    uint32_t n = r[Rn];
+    uint32_t n = gba->r[Rn];
     if (Rn == REG_PC && shreg) n += SIZEOF_INSTR;  // PC ahead when shift register specified
     uint64_t result = arm_alu_op(opc, n, m);
     if (S) {
-        arm_shifter_flags(r[Rm], s, shop);
+        arm_shifter_flags(gba->r[Rm], s, shop);
         arm_alu_flags(opc, n, m, result);
     }
     if (!is_test_or_compare) {
-        r[Rd] = (uint32_t) result;
+        gba->r[Rd] = (uint32_t) result;
         if (Rd == REG_PC) {  // PC altered
-            r[Rd] &= ~1;
-            branch_taken = true;
+            gba->r[Rd] &= ~1;
+            gba->branch_taken = true;
             if (S) write_cpsr(read_spsr());
         }
     } else {
@@ -288,7 +290,7 @@ void arm_data_processing_immediate(uint32_t op) {
         assert(Rn == 0);
     }
 
-    uint32_t n = r[Rn];
+    uint32_t n = gba->r[Rn];
     if (Rn == REG_PC) n &= ~3;  // Align PC to word
     uint64_t result = arm_alu_op(opc, n, imm);
     if (S) {
@@ -298,10 +300,10 @@ void arm_data_processing_immediate(uint32_t op) {
         arm_alu_flags(opc, n, imm, result);
     }
     if (!is_test_or_compare) {
-        r[Rd] = (uint32_t) result;
+        gba->r[Rd] = (uint32_t) result;
         if (Rd == REG_PC) {  // PC altered
-            r[Rd] &= ~1;
-            branch_taken = true;
+            gba->r[Rd] &= ~1;
+            gba->branch_taken = true;
             if (S) write_cpsr(read_spsr());
         }
     }
@@ -366,19 +368,19 @@ void arm_load_store_word_or_byte_register(uint32_t op) {
         shamt = 32;  // LSR #0 -> LSR #32, ASR #0 -> ASR #32
     }
 
-    uint32_t m = arm_shifter_op(r[Rm], shamt, shop, false, false);
-    uint32_t n = r[Rn];
+    uint32_t m = arm_shifter_op(gba->r[Rm], shamt, shop, false, false);
+    uint32_t n = gba->r[Rn];
     if (Rn == REG_PC) n &= ~3;
     if (P) n += (U ? m : -m);
     if (L) {
         if (B) {
-            r[Rd] = memory_read_byte(n);
+            gba->r[Rd] = memory_read_byte(n);
         } else {
-            r[Rd] = align_word(n, memory_read_word(n));
+            gba->r[Rd] = align_word(n, memory_read_word(n));
         }
-        if (Rd == REG_PC) branch_taken = true;
+        if (Rd == REG_PC) gba->branch_taken = true;
     } else {
-        uint32_t d = r[Rd];
+        uint32_t d = gba->r[Rd];
         if (Rd == REG_PC) d += SIZEOF_INSTR;
         if (B) {
             memory_write_byte(n, (uint8_t) d);
@@ -387,7 +389,7 @@ void arm_load_store_word_or_byte_register(uint32_t op) {
         }
     }
     if (!P) n += (U ? m : -m);
-    if ((!P || W) && (!L || Rd != Rn)) r[Rn] = n;
+    if ((!P || W) && (!L || Rd != Rn)) gba->r[Rn] = n;
 }
 
 void arm_load_store_word_or_byte_immediate_disasm(uint32_t address, uint32_t op, std::string &s) {
@@ -433,18 +435,18 @@ void arm_load_store_word_or_byte_immediate(uint32_t op) {
     bool T = !P && W;
     assert(!T);
 
-    uint32_t n = r[Rn];
+    uint32_t n = gba->r[Rn];
     if (Rn == REG_PC) n &= ~3;
     if (P) n += (U ? imm : -imm);
     if (L) {
         if (B) {
-            r[Rd] = memory_read_byte(n);
+            gba->r[Rd] = memory_read_byte(n);
         } else {
-            r[Rd] = align_word(n, memory_read_word(n));
+            gba->r[Rd] = align_word(n, memory_read_word(n));
         }
-        if (Rd == REG_PC) branch_taken = true;
+        if (Rd == REG_PC) gba->branch_taken = true;
     } else {
-        uint32_t d = r[Rd];
+        uint32_t d = gba->r[Rd];
         if (Rd == REG_PC) d += SIZEOF_INSTR;
         if (B) {
             memory_write_byte(n, (uint8_t) d);
@@ -453,7 +455,7 @@ void arm_load_store_word_or_byte_immediate(uint32_t op) {
         }
     }
     if (!P) n += (U ? imm : -imm);
-    if ((!P || W) && (!L || Rd != Rn)) r[Rn] = n;
+    if ((!P || W) && (!L || Rd != Rn)) gba->r[Rn] = n;
 }
 
 void arm_load_store_multiple_disasm(uint32_t address, uint32_t op, std::string &s) {
@@ -502,25 +504,25 @@ void arm_load_store_multiple(uint32_t op) {
         count = 16;
     }
     assert(Rn != REG_PC);
-    uint32_t old_base = r[Rn];
+    uint32_t old_base = gba->r[Rn];
     uint32_t new_base = old_base + (U ? 4 : -4) * count;
     uint32_t address = old_base;
     if (!U) address -= 4 * count;
     if (U == P) address += 4;
-    if (S) mode_change(cpsr & PSR_MODE, PSR_MODE_USR);  // Switch to user register bank
+    if (S) mode_change(gba->cpsr & PSR_MODE, PSR_MODE_USR);  // Switch to user register bank
     for (uint32_t i = 0; i < 16; i++) {
         if (BIT(rlist, i)) {
             if (L) {
                 if (i == Rn) W = false;  // No writeback if Rn in rlist
-                r[i] = memory_read_word(address);
+                gba->r[i] = memory_read_word(address);
                 if (i == REG_PC) {  // PC altered
-                    r[i] &= ~1;
-                    branch_taken = true;
+                    gba->r[i] &= ~1;
+                    gba->branch_taken = true;
                     if (S) write_cpsr(read_spsr());
                 }
             } else {
                 if (i == REG_PC) {  // PC ahead when stored to memory
-                    memory_write_word(address, r[i] + SIZEOF_INSTR);
+                    memory_write_word(address, gba->r[i] + SIZEOF_INSTR);
                 } else if (i == Rn) {  // Store unmodified base if Rn is first in rlist
                     if (std::countr_zero(rlist) == (int) Rn) {
                         memory_write_word(address, old_base);
@@ -528,14 +530,14 @@ void arm_load_store_multiple(uint32_t op) {
                         memory_write_word(address, new_base);
                     }
                 } else {
-                    memory_write_word(address, r[i]);
+                    memory_write_word(address, gba->r[i]);
                 }
             }
             address += 4;
         }
     }
-    if (W) r[Rn] = new_base;
-    if (S) mode_change(PSR_MODE_USR, cpsr & PSR_MODE);  // Restore current register bank
+    if (W) gba->r[Rn] = new_base;
+    if (S) mode_change(PSR_MODE_USR, gba->cpsr & PSR_MODE);  // Restore current register bank
 }
 
 void arm_branch_disasm(uint32_t address, uint32_t op, std::string &s) {
@@ -554,9 +556,9 @@ void arm_branch(uint32_t op) {
     uint32_t imm = BITS(op, 0, 23);
     SIGN_EXTEND(imm, 23);
 
-    if (L) r[REG_LR] = r[REG_PC] - 4;
-    r[REG_PC] += imm << 2;
-    branch_taken = true;
+    if (L) gba->r[REG_LR] = gba->r[REG_PC] - 4;
+    gba->r[REG_PC] += imm << 2;
+    gba->branch_taken = true;
 }
 
 void arm_software_interrupt_disasm(uint32_t address, uint32_t op, std::string &s) {
@@ -571,21 +573,22 @@ void arm_software_interrupt_disasm(uint32_t address, uint32_t op, std::string &s
 }
 
 void arm_software_interrupt(uint32_t op) {
-    UNUSED(op);
-
-    r14_svc = r[REG_PC] - SIZEOF_INSTR;  // ARM: PC + 4, Thumb: PC + 2
-    spsr_svc = cpsr;
-    branch_taken = true;
-    write_cpsr((cpsr & ~(PSR_T | PSR_MODE)) | PSR_I | PSR_MODE_SVC);
-    r[REG_PC] = VEC_SWI;
+    uint32_t function = (FLAG_T() ? BITS(op, 0, 7) : BITS(op, 16, 23));
+    if ((gba->bios_hle_enabled || gba->bios_stub_installed) && bios_hle_call(function)) return;
+
+    gba->r14_svc = gba->r[REG_PC] - SIZEOF_INSTR;  // ARM: PC + 4, Thumb: PC + 2
+    gba->spsr_svc = gba->cpsr;
+    gba->branch_taken = true;
+    write_cpsr((gba->cpsr & ~(PSR_T | PSR_MODE)) | PSR_I | PSR_MODE_SVC);
+    gba->r[REG_PC] = VEC_SWI;
 }
 
 void arm_hardware_interrupt() {
-    r14_irq = r[REG_PC] - (FLAG_T() ? 0 : 4);  // ARM: PC + 4, Thumb: PC + 4
-    spsr_irq = cpsr;
-    branch_taken = true;
-    write_cpsr((cpsr & ~(PSR_T | PSR_MODE)) | PSR_I | PSR_MODE_IRQ);
-    r[REG_PC] = VEC_IRQ;
+    gba->r14_irq = gba->r[REG_PC] - (FLAG_T() ? 0 : 4);  // ARM: PC + 4, Thumb: PC + 4
+    gba->spsr_irq = gba->cpsr;
+    gba->branch_taken = true;
+    write_cpsr((gba->cpsr & ~(PSR_T | PSR_MODE)) | PSR_I | PSR_MODE_IRQ);
+    gba->r[REG_PC] = VEC_IRQ;
 }
 
 void arm_multiply_disasm(uint32_t address, uint32_t op, std::string &s) {
@@ -624,9 +627,9 @@ void arm_multiply(uint32_t op) {
     if (!A) assert(Rn == 0);
     assert(Rd != REG_PC && Rm != REG_PC && Rs != REG_PC);
 
-    uint32_t result = r[Rm] * r[Rs];
-    if (A) result += r[Rn];
-    r[Rd] = result;
+    uint32_t result = gba->r[Rm] * gba->r[Rs];
+    if (A) result += gba->r[Rn];
+    gba->r[Rd] = result;
 
     if (S) {
         ASSIGN_N(BIT(result, 31));
@@ -673,16 +676,16 @@ void arm_multiply_long(uint32_t op) {
 
     assert(RdHi != REG_PC && RdLo != REG_PC && Rm != REG_PC && Rs != REG_PC);
 
-    uint64_t m = r[Rm];
-    uint64_t s = r[Rs];
+    uint64_t m = gba->r[Rm];
+    uint64_t s = gba->r[Rs];
     if (U) {
         SIGN_EXTEND(m, 31);
         SIGN_EXTEND(s, 31);
     }
     uint64_t result = m * s;
-    if (A) result += (uint64_t) r[RdLo] | (uint64_t) r[RdHi] << 32;
-    r[RdLo] = (uint32_t) result;  // RdLo is written first
-    r[RdHi] = (uint32_t) (result >> 32);
+    if (A) result += (uint64_t) gba->r[RdLo] | (uint64_t) gba->r[RdHi] << 32;
+    gba->r[RdLo] = (uint32_t) result;  // RdLo is written first
+    gba->r[RdHi] = (uint32_t) (result >> 32);
 
     if (S) {
         ASSIGN_N(BIT(result, 63));
@@ -735,20 +738,20 @@ void arm_load_store_halfword_register(uint32_t op) {
     assert(sbz == 0);
     assert(opc == 0xb);
 
-    uint32_t m = r[Rm];
-    uint32_t n = r[Rn];
+    uint32_t m = gba->r[Rm];
+    uint32_t n = gba->r[Rn];
     if (Rn == REG_PC) n &= ~3;
     if (P) n += (U ? m : -m);
     if (L) {
-        r[Rd] = align_halfword(n, memory_read_halfword(n));
-        if (Rd == REG_PC) branch_taken = true;
+        gba->r[Rd] = align_halfword(n, memory_read_halfword(n));
+        if (Rd == REG_PC) gba->branch_taken = true;
     } else {
-        uint32_t d = r[Rd];
+        uint32_t d = gba->r[Rd];
         if (Rd == REG_PC) d += SIZEOF_INSTR;
         memory_write_halfword(n, (uint16_t) d);
     }
     if (!P) n += (U ? m : -m);
-    if ((!P || W) && (!L || Rd != Rn)) r[Rn] = n;
+    if ((!P || W) && (!L || Rd != Rn)) gba->r[Rn] = n;
 }
 
 void arm_load_store_halfword_immediate_disasm(uint32_t address, uint32_t op, std::string &s) {
@@ -793,19 +796,19 @@ void arm_load_store_halfword_immediate(uint32_t op) {
     assert(I);
     assert(opc == 0xb);
 
-    uint32_t n = r[Rn];
+    uint32_t n = gba->r[Rn];
     if (Rn == REG_PC) n &= ~3;
     if (P) n += (U ? imm : -imm);
     if (L) {
-        r[Rd] = align_halfword(n, memory_read_halfword(n));
-        if (Rd == REG_PC) branch_taken = true;
+        gba->r[Rd] = align_halfword(n, memory_read_halfword(n));
+        if (Rd == REG_PC) gba->branch_taken = true;
     } else {
-        uint32_t d = r[Rd];
+        uint32_t d = gba->r[Rd];
         if (Rd == REG_PC) d += SIZEOF_INSTR;
         memory_write_halfword(n, (uint16_t) d);
     }
     if (!P) n += (U ? imm : -imm);
-    if ((!P || W) && (!L || Rd != Rn)) r[Rn] = n;
+    if ((!P || W) && (!L || Rd != Rn)) gba->r[Rn] = n;
 }
 
 void arm_load_signed_halfword_or_signed_byte_register_disasm(uint32_t address, uint32_t op, std::string &s) {
@@ -858,28 +861,28 @@ void arm_load_signed_halfword_or_signed_byte_register(uint32_t op) {
     assert(sbz == 0);
     assert(opc == 0xd || opc == 0xf);
 
-    uint32_t m = r[Rm];
-    uint32_t n = r[Rn];
+    uint32_t m = gba->r[Rm];
+    uint32_t n = gba->r[Rn];
     if (Rn == REG_PC) n &= ~3;
     if (P) n += (U ? m : -m);
     if (opc == 0xd) {
-        r[Rd] = memory_read_byte(n);
-        SIGN_EXTEND(r[Rd], 7);
+        gba->r[Rd] = memory_read_byte(n);
+        SIGN_EXTEND(gba->r[Rd], 7);
     } else if (opc == 0xf) {
-        r[Rd] = align_halfword(n, memory_read_halfword(n));
+        gba->r[Rd] = align_halfword(n, memory_read_halfword(n));
         if (n & 1) {
-            r[Rd] &= 0xff;
-            SIGN_EXTEND(r[Rd], 7);
+            gba->r[Rd] &= 0xff;
+            SIGN_EXTEND(gba->r[Rd], 7);
         } else {
-            r[Rd] &= 0xffff;
-            SIGN_EXTEND(r[Rd], 15);
+            gba->r[Rd] &= 0xffff;
+            SIGN_EXTEND(gba->r[Rd], 15);
         }
     } else {
         assert(false);
     }
-    if (Rd == REG_PC) branch_taken = true;
+    if (Rd == REG_PC) gba->branch_taken = true;
     if (!P) n += (U ? m : -m);
-    if ((!P || W) && (!L || Rd != Rn)) r[Rn] = n;
+    if ((!P || W) && (!L || Rd != Rn)) gba->r[Rn] = n;
 }
 
 void arm_load_signed_halfword_or_signed_byte_immediate_disasm(uint32_t address, uint32_t op, std::string &s) {
@@ -929,27 +932,27 @@ void arm_load_signed_halfword_or_signed_byte_immediate(uint32_t op) {
     assert(L);
     assert(opc == 0xd || opc == 0xf);
 
-    uint32_t n = r[Rn];
+    uint32_t n = gba->r[Rn];
     if (Rn == REG_PC) n &= ~3;
     if (P) n += (U ? imm : -imm);
     if (opc == 0xd) {
-        r[Rd] = memory_read_byte(n);
-        SIGN_EXTEND(r[Rd], 7);
+        gba->r[Rd] = memory_read_byte(n);
+        SIGN_EXTEND(gba->r[Rd], 7);
     } else if (opc == 0xf) {
-        r[Rd] = align_halfword(n, memory_read_halfword(n));
+        gba->r[Rd] = align_halfword(n, memory_read_halfword(n));
         if (n & 1) {
-            r[Rd] &= 0xff;
-            SIGN_EXTEND(r[Rd], 7);
+            gba->r[Rd] &= 0xff;
+            SIGN_EXTEND(gba->r[Rd], 7);
         } else {
-            r[Rd] &= 0xffff;
-            SIGN_EXTEND(r[Rd], 15);
+            gba->r[Rd] &= 0xffff;
+            SIGN_EXTEND(gba->r[Rd], 15);
         }
     } else {
         assert(false);
     }
-    if (Rd == REG_PC) branch_taken = true;
+    if (Rd == REG_PC) gba->branch_taken = true;
     if (!P) n += (U ? imm : -imm);
-    if ((!P || W) && (!L || Rd != Rn)) r[Rn] = n;
+    if ((!P || W) && (!L || Rd != Rn)) gba->r[Rn] = n;
 }
 
 void arm_special_data_processing_register_disasm(uint32_t address, uint32_t op, std::string &s) {
@@ -1002,15 +1005,15 @@ void arm_special_data_processing_register(uint32_t op) {
         if (mask_type & 8) mask |= 0xf0000000;
         if (mask_type & 1) mask |= 0x000000ff;
         if (R) {
-            write_spsr((read_spsr() & ~mask) | (r[Rm] & mask));
+            write_spsr((read_spsr() & ~mask) | (gba->r[Rm] & mask));
         } else {
-            write_cpsr((cpsr & ~mask) | (r[Rm] & mask));
+            write_cpsr((gba->cpsr & ~mask) | (gba->r[Rm] & mask));
         }
     } else {
         if (R) {
-            r[Rd] = read_spsr();
+            gba->r[Rd] = read_spsr();
         } else {
-            r[Rd] = cpsr;
+            gba->r[Rd] = gba->cpsr;
         }
         assert(Rd != REG_PC);
     }
@@ -1053,7 +1056,7 @@ void arm_special_data_processing_immediate(uint32_t op) {
     if (R) {
         write_spsr((read_spsr() & ~mask) | (imm & mask));
     } else {
-        write_cpsr((cpsr & ~mask) | (imm & mask));
+        write_cpsr((gba->cpsr & ~mask) | (imm & mask));
     }
 }
 
@@ -1087,13 +1090,13 @@ void arm_swap(uint32_t op) {
     assert(sbz == 0);
 
     if (B) {
-        uint8_t temp = memory_read_byte(r[Rn]);
-        memory_write_byte(r[Rn], r[Rm]);
-        r[Rd] = temp;
+        uint8_t temp = memory_read_byte(gba->r[Rn]);
+        memory_write_byte(gba->r[Rn], gba->r[Rm]);
+        gba->r[Rd] = temp;
     } else {
-        uint32_t temp = align_word(r[Rn], memory_read_word(r[Rn]));
-        memory_write_word(r[Rn], r[Rm]);
-        r[Rd] = temp;
+        uint32_t temp = align_word(gba->r[Rn], memory_read_word(gba->r[Rn]));
+        memory_write_word(gba->r[Rn], gba->r[Rm]);
+        gba->r[Rd] = temp;
     }
     assert(Rd != REG_PC);
 }
@@ -1115,13 +1118,13 @@ void arm_branch_and_exchange(uint32_t op) {
 
     assert(sbo == 0xfff);
 
-    ASSIGN_T(BIT(r[Rm], 0));
+    ASSIGN_T(BIT(gba->r[Rm], 0));
     if (FLAG_T()) {
-        r[REG_PC] = r[Rm] & ~1;
+        gba->r[REG_PC] = gba->r[Rm] & ~1;
     } else {
-        r[REG_PC] = r[Rm] & ~3;
+        gba->r[REG_PC] = gba->r[Rm] & ~3;
     }
-    branch_taken = true;
+    gba->branch_taken = true;
 }
 
 void arm_coprocessor_load_store_disasm(uint32_t address, uint32_t op, std::string &s) {
@@ -1172,9 +1175,9 @@ void arm_undefined_instruction(uint32_t op) {
 
     assert(false);
 
-    r14_und = r[REG_PC] - SIZEOF_INSTR;  // ARM: PC + 4, Thumb: PC + 2
-    spsr_und = cpsr;
-    branch_taken = true;
-    write_cpsr((cpsr & ~(PSR_T | PSR_MODE)) | PSR_I | PSR_MODE_UND);
-    r[REG_PC] = VEC_UNDEF;
+    gba->r14_und = gba->r[REG_PC] - SIZEOF_INSTR;  // ARM: PC + 4, Thumb: PC + 2
+    gba->spsr_und = gba->cpsr;
+    gba->branch_taken = true;
+    write_cpsr((gba->cpsr & ~(PSR_T | PSR_MODE)) | PSR_I | PSR_MODE_UND);
+    gba->r[REG_PC] = VEC_UNDEF;
 }
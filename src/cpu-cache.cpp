@@ -0,0 +1,423 @@
+// Copyright (c) 2021 Ridge Shrubsall
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "cpu.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#include "context.h"
+#include "memory.h"
+
+#define BLOCK_INVALID   1   // Never a valid tag, since address 0 is not cacheable
+#define BLOCK_MAX_BYTES (BLOCK_MAX_INSTRS * 4 + 8)
+#define CODE_LINE_HOT   16  // Invalidations per frame before a line is left to the interpreter
+#define LOOP_MAX_INSTRS 16  // Longest loop body considered for idle loop detection
+
+// Returns the end of the cacheable range that contains address, or 0 if code
+// there must always be fetched through the bus
+static uint32_t block_region_end(uint32_t address) {
+    switch (address >> 24) {
+        case 2: return (address < 0x02040000 ? 0x02040000 : 0);
+        case 3: return (address < 0x03008000 ? 0x03008000 : 0);
+        case 8:
+        case 9:
+        case 0xa:
+        case 0xb:
+        case 0xc:
+            // Skip the header, since GPIO registers are mapped at 0x080000c4
+            if ((address & 0x1ffffff) < 0x100) return 0;
+            return (address & 0xff000000) + 0x1000000;
+        default:
+            return 0;
+    }
+}
+
+static void block_mark_code(uint32_t start, uint32_t end) {
+    for (uint32_t address = start & ~CODE_LINE_MASK; address < end; address += CODE_LINE_MASK + 1) {
+        if (address >> 24 == 2) {
+            gba->cache_ewram_code[(address & 0x3ffff) >> CODE_LINE_SHIFT] = 1;
+        } else if (address >> 24 == 3) {
+            gba->cache_iwram_code[(address & 0x7fff) >> CODE_LINE_SHIFT] = 1;
+        }
+    }
+}
+
+static bool block_line_hot(uint32_t address) {
+    if (address >> 24 == 2) return gba->cache_ewram_writes[(address & 0x3ffff) >> CODE_LINE_SHIFT] >= CODE_LINE_HOT;
+    if (address >> 24 == 3) return gba->cache_iwram_writes[(address & 0x7fff) >> CODE_LINE_SHIFT] >= CODE_LINE_HOT;
+    return false;
+}
+
+static bool block_ends_with(const cpu_block_instr &instr, bool thumb) {
+    if (thumb) {
+        void (*f)(uint16_t) = instr.handler.thumb;
+        return f == thumb_unconditional_branch || f == thumb_branch_and_exchange || f == thumb_branch_with_link_suffix ||
+               f == thumb_software_interrupt || f == thumb_undefined_instruction;
+    } else {
+        void (*f)(uint32_t) = instr.handler.arm;
+        if (BITS(instr.op, 28, 31) != COND_AL) return false;
+        return f == arm_branch || f == arm_branch_and_exchange || f == arm_software_interrupt || f == arm_undefined_instruction;
+    }
+}
+
+// Condition flags are tracked alongside the registers when looking for idle loops
+#define LOOP_N    (1 << 16)
+#define LOOP_Z    (1 << 17)
+#define LOOP_C    (1 << 18)
+#define LOOP_V    (1 << 19)
+#define LOOP_NZ   (LOOP_N | LOOP_Z)
+#define LOOP_NZCV (LOOP_N | LOOP_Z | LOOP_C | LOOP_V)
+
+struct loop_instr {
+    uint32_t reads;
+    uint32_t writes;     // Registers and flags the instruction may change
+    uint32_t certain;    // Those it always changes
+    uint32_t target;     // Branch target, if any
+    bool branch;
+    bool conditional;
+};
+
+static uint32_t loop_condition_flags(uint32_t cond) {
+    switch (cond) {
+        case COND_EQ: case COND_NE: return LOOP_Z;
+        case COND_CS: case COND_CC: return LOOP_C;
+        case COND_MI: case COND_PL: return LOOP_N;
+        case COND_VS: case COND_VC: return LOOP_V;
+        case COND_HI: case COND_LS: return LOOP_C | LOOP_Z;
+        case COND_GE: case COND_LT: return LOOP_N | LOOP_V;
+        case COND_GT: case COND_LE: return LOOP_N | LOOP_Z | LOOP_V;
+        default: return 0;
+    }
+}
+
+// Returns false for anything with side effects, or that depends on more than registers and memory
+static bool arm_loop_instr(uint32_t address, const cpu_block_instr &instr, loop_instr &li) {
+    void (*f)(uint32_t) = instr.handler.arm;
+    uint32_t op = instr.op;
+    uint32_t cond = BITS(op, 28, 31);
+    uint32_t Rn = BITS(op, 16, 19);
+    uint32_t Rd = BITS(op, 12, 15);
+    uint32_t Rs = BITS(op, 8, 11);
+    uint32_t Rm = BITS(op, 0, 3);
+
+    if (f == arm_branch) {
+        if (BIT(op, 24)) return false;
+        uint32_t imm = BITS(op, 0, 23);
+        SIGN_EXTEND(imm, 23);
+        li.branch = true;
+        li.target = address + 8 + (imm << 2);
+    } else if (f == arm_data_processing_register || f == arm_data_processing_immediate) {
+        uint32_t opcode = BITS(op, 21, 24);
+        bool S = BIT(op, 20);
+        bool logical = (opcode <= 1 || (opcode >= 8 && opcode <= 9) || opcode >= 0xc);
+        if (Rd == REG_PC) return false;
+        if (opcode != 0xd && opcode != 0xf) li.reads |= 1 << Rn;
+        if (opcode >= 5 && opcode <= 7) li.reads |= LOOP_C;
+        if (opcode < 8 || opcode > 0xb) li.writes |= li.certain |= 1 << Rd;
+        bool shifter_carry;
+        if (f == arm_data_processing_register) {
+            li.reads |= 1 << Rm;
+            if (BIT(op, 4)) li.reads |= 1 << Rs;
+            bool rrx = (!BIT(op, 4) && BITS(op, 5, 6) == 3 && BITS(op, 7, 11) == 0);
+            if (rrx) li.reads |= LOOP_C;
+            shifter_carry = (BIT(op, 4) || BITS(op, 5, 11) != 0);
+        } else {
+            shifter_carry = (BITS(op, 8, 11) != 0);
+        }
+        if (S) {
+            li.writes |= li.certain |= (logical ? LOOP_NZ : LOOP_NZCV);
+            if (logical && shifter_carry) {
+                li.writes |= LOOP_C;
+                // A shift by register may leave the carry alone
+                if (f == arm_data_processing_immediate || !BIT(op, 4)) li.certain |= LOOP_C;
+            }
+        }
+    } else if (f == arm_load_store_word_or_byte_register || f == arm_load_store_word_or_byte_immediate) {
+        bool P = BIT(op, 24);
+        bool W = BIT(op, 21);
+        bool L = BIT(op, 20);
+        if (!L || !P || W || Rd == REG_PC) return false;
+        li.reads |= 1 << Rn;
+        if (f == arm_load_store_word_or_byte_register) li.reads |= 1 << Rm;
+        li.writes |= li.certain |= 1 << Rd;
+    } else if (f == arm_load_store_halfword_register || f == arm_load_store_halfword_immediate ||
+               f == arm_load_signed_halfword_or_signed_byte_register || f == arm_load_signed_halfword_or_signed_byte_immediate) {
+        bool P = BIT(op, 24);
+        bool W = BIT(op, 21);
+        bool L = BIT(op, 20);
+        if (!L || !P || W || Rd == REG_PC) return false;
+        li.reads |= 1 << Rn;
+        if (!BIT(op, 22)) li.reads |= 1 << Rm;
+        li.writes |= li.certain |= 1 << Rd;
+    } else if (f == arm_load_store_multiple) {
+        uint32_t rlist = BITS(op, 0, 15);
+        bool S = BIT(op, 22);
+        bool W = BIT(op, 21);
+        bool L = BIT(op, 20);
+        if (!L || S || W || BIT(rlist, REG_PC) || rlist == 0) return false;
+        li.reads |= 1 << Rn;
+        li.writes |= li.certain |= rlist;
+    } else {
+        return false;
+    }
+
+    if (cond != COND_AL) {
+        if (cond == COND_NV) return false;
+        li.reads |= loop_condition_flags(cond);
+        li.certain = 0;
+        li.conditional = true;
+    }
+    return true;
+}
+
+static bool thumb_loop_instr(uint32_t address, const cpu_block_instr &instr, loop_instr &li) {
+    void (*f)(uint16_t) = instr.handler.thumb;
+    uint32_t op = instr.op;
+    uint32_t Rd = BITS(op, 0, 2);
+    uint32_t Rs = BITS(op, 3, 5);
+    uint32_t Rn = BITS(op, 6, 8);
+    uint32_t Rd8 = BITS(op, 8, 10);
+
+    if (f == thumb_conditional_branch) {
+        uint32_t cond = BITS(op, 8, 11);
+        uint32_t imm = BITS(op, 0, 7);
+        SIGN_EXTEND(imm, 7);
+        li.reads |= loop_condition_flags(cond);
+        li.branch = true;
+        li.conditional = true;
+        li.target = address + 4 + (imm << 1);
+    } else if (f == thumb_unconditional_branch) {
+        uint32_t imm = BITS(op, 0, 10);
+        SIGN_EXTEND(imm, 10);
+        li.branch = true;
+        li.target = address + 4 + (imm << 1);
+    } else if (f == thumb_shift_by_immediate) {
+        li.reads |= 1 << Rs;
+        li.writes |= li.certain |= 1 << Rd | LOOP_NZ;
+        if (BITS(op, 6, 12) != 0) li.writes |= li.certain |= LOOP_C;
+    } else if (f == thumb_add_or_subtract_register || f == thumb_add_or_subtract_immediate) {
+        li.reads |= 1 << Rs;
+        if (f == thumb_add_or_subtract_register) li.reads |= 1 << Rn;
+        li.writes |= li.certain |= 1 << Rd | LOOP_NZCV;
+    } else if (f == thumb_add_subtract_compare_or_move_immediate) {
+        uint32_t opcode = BITS(op, 11, 12);
+        if (opcode != 0) li.reads |= 1 << Rd8;
+        if (opcode != 1) li.writes |= li.certain |= 1 << Rd8;
+        li.writes |= li.certain |= (opcode == 0 ? LOOP_NZ : LOOP_NZCV);
+    } else if (f == thumb_data_processing_register) {
+        uint32_t opcode = BITS(op, 6, 9);
+        li.reads |= 1 << Rs;
+        if (opcode != 9 && opcode != 0xf) li.reads |= 1 << Rd;
+        if (opcode == 5 || opcode == 6) li.reads |= LOOP_C;
+        if (opcode != 8 && opcode != 0xa && opcode != 0xb) li.writes |= li.certain |= 1 << Rd;
+        switch (opcode) {
+            case 2: case 3: case 4: case 7: case 0xd:
+                // Shifts by register and multiplies may or may not change the carry
+                li.writes |= li.certain |= LOOP_NZ;
+                li.writes |= LOOP_C;
+                break;
+            case 5: case 6: case 9: case 0xa: case 0xb:
+                li.writes |= li.certain |= LOOP_NZCV;
+                break;
+            default:
+                li.writes |= li.certain |= LOOP_NZ;
+                break;
+        }
+    } else if (f == thumb_special_data_processing) {
+        uint32_t opcode = BITS(op, 8, 9);
+        uint32_t Rh = BIT(op, 7) << 3 | Rd;
+        uint32_t Rm = BITS(op, 3, 6);
+        li.reads |= 1 << Rm;
+        if (opcode == 1) {
+            li.reads |= 1 << Rh;
+            li.writes |= li.certain |= LOOP_NZCV;
+        } else {
+            if (Rh == REG_PC) return false;
+            if (opcode == 0) li.reads |= 1 << Rh;
+            li.writes |= li.certain |= 1 << Rh;
+        }
+    } else if (f == thumb_load_from_literal_pool) {
+        li.writes |= li.certain |= 1 << Rd8;
+    } else if (f == thumb_load_store_register) {
+        if (BITS(op, 9, 11) < 3) return false;
+        li.reads |= 1 << Rs | 1 << Rn;
+        li.writes |= li.certain |= 1 << Rd;
+    } else if (f == thumb_load_store_word_or_byte_immediate || f == thumb_load_store_halfword_immediate) {
+        if (!BIT(op, 11)) return false;
+        li.reads |= 1 << Rs;
+        li.writes |= li.certain |= 1 << Rd;
+    } else if (f == thumb_load_store_to_or_from_stack) {
+        if (!BIT(op, 11)) return false;
+        li.reads |= 1 << REG_SP;
+        li.writes |= li.certain |= 1 << Rd8;
+    } else if (f == thumb_add_to_sp_or_pc) {
+        if (BIT(op, 11)) li.reads |= 1 << REG_SP;
+        li.writes |= li.certain |= 1 << Rd8;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Whether the block starts with a short loop whose only effect is to wait for memory or I/O to change:
+// no stores, and nothing carried over from one pass to the next except registers the loop never writes
+static bool block_idle_loop(const cpu_block *block, bool thumb) {
+    uint32_t start = block->tag & ~1;
+    uint32_t live_in = 0;
+    uint32_t written = 0;
+    uint32_t certain = 0;
+    uint32_t exit_min = UINT32_MAX;
+
+    for (uint32_t i = 0; i < block->length && i < LOOP_MAX_INSTRS; i++) {
+        uint32_t address = start + i * block->size;
+        loop_instr li{};
+        bool ok = (thumb ? thumb_loop_instr(address, block->instrs[i], li) : arm_loop_instr(address, block->instrs[i], li));
+        if (!ok) return false;
+
+        // The value of PC only depends on where the instruction is
+        live_in |= li.reads & ~certain & ~(1 << REG_PC);
+        written |= li.writes;
+        certain |= li.certain;
+
+        if (li.branch) {
+            if (li.target == start) {
+                return !(live_in & written) && exit_min > address;
+            }
+            // Anything else must leave the loop
+            if (!li.conditional || li.target < start) return false;
+            exit_min = std::min(exit_min, li.target);
+        }
+    }
+    return false;
+}
+
+static cpu_block *block_compile(cpu_block *block, uint32_t address, bool thumb) {
+    uint32_t size = (thumb ? 2 : 4);
+    uint32_t region_end = block_region_end(address);
+    if (region_end == 0) return nullptr;
+
+    block->tag = address | (thumb ? 1 : 0);
+    block->size = size;
+    block->length = 0;
+    block->code = nullptr;
+    block->uses = 0;
+    block->idle = false;
+    while (block->length < BLOCK_MAX_INSTRS) {
+        uint32_t pc = address + block->length * size;
+        uint32_t fetch_address = pc + 3 * size;
+        if (fetch_address + size > region_end) break;
+        if (block_line_hot(pc) || block_line_hot(fetch_address + size - 1)) break;
+
+        cpu_block_instr &instr = block->instrs[block->length++];
+        if (thumb) {
+            instr.op = memory_peek_halfword(pc);
+            instr.handler.thumb = thumb_lookup[BITS(instr.op, 8, 15)];
+            instr.fetch = memory_peek_halfword(fetch_address);
+            instr.fetch_cycles = cycles_byte_or_halfword(fetch_address >> 24);
+        } else {
+            instr.op = memory_peek_word(pc);
+            instr.handler.arm = arm_lookup[BITS(instr.op, 20, 27) << 4 | BITS(instr.op, 4, 7)];
+            instr.fetch = memory_peek_word(fetch_address);
+            instr.fetch_cycles = cycles_word(fetch_address >> 24);
+        }
+        assert(instr.handler.arm != nullptr);
+        if (block_ends_with(instr, thumb)) break;
+    }
+    // An empty block stays in the table, so the interpreter doesn't retry every step
+    if (block->length == 0) return nullptr;
+
+    if (thumb) {
+        block->pipeline[0] = memory_peek_halfword(address + 2);
+        block->pipeline[1] = memory_peek_halfword(address + 4);
+    } else {
+        block->pipeline[0] = memory_peek_word(address + 4);
+        block->pipeline[1] = memory_peek_word(address + 8);
+    }
+    block->idle = block_idle_loop(block, thumb);
+    block_mark_code(address, address + (block->length + 3) * size);
+    return block;
+}
+
+cpu_block *cpu_cache_lookup(bool thumb) {
+    uint32_t address = get_pc();
+    cpu_block *block = &gba->block_cache[block_cache_index(address)];
+    if (block->tag == (address | (thumb ? 1 : 0))) return (block->length != 0 ? block : nullptr);
+    return block_compile(block, address, thumb);
+}
+
+cpu_block_instr *arm_cache_lookup() {
+    cpu_block *block = cpu_cache_lookup(false);
+    if (block == nullptr) return nullptr;
+    gba->arm_cache_instr = &block->instrs[0];
+    gba->arm_cache_end = &block->instrs[block->length];
+    gba->arm_cache_pc = gba->r[REG_PC];
+    return gba->arm_cache_instr;
+}
+
+cpu_block_instr *thumb_cache_lookup() {
+    cpu_block *block = cpu_cache_lookup(true);
+    if (block == nullptr) return nullptr;
+    gba->thumb_cache_instr = &block->instrs[0];
+    gba->thumb_cache_end = &block->instrs[block->length];
+    gba->thumb_cache_pc = gba->r[REG_PC];
+    return gba->thumb_cache_instr;
+}
+
+void cpu_cache_flush() {
+    for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+        gba->block_cache[i].tag = BLOCK_INVALID;
+    }
+    std::memset(gba->cache_ewram_code, 0, sizeof(gba->cache_ewram_code));
+    std::memset(gba->cache_iwram_code, 0, sizeof(gba->cache_iwram_code));
+    std::memset(gba->cache_ewram_writes, 0, sizeof(gba->cache_ewram_writes));
+    std::memset(gba->cache_iwram_writes, 0, sizeof(gba->cache_iwram_writes));
+    gba->cache_hot_lines = false;
+    gba->arm_cache_instr = nullptr;
+    gba->thumb_cache_instr = nullptr;
+}
+
+void cpu_cache_invalidate(uint32_t address) {
+    uint32_t line_start;
+    uint8_t *writes;
+    if (address >> 24 == 2) {
+        line_start = 0x02000000 | (address & 0x3ffff & ~CODE_LINE_MASK);
+        gba->cache_ewram_code[(address & 0x3ffff) >> CODE_LINE_SHIFT] = 0;
+        writes = &gba->cache_ewram_writes[(address & 0x3ffff) >> CODE_LINE_SHIFT];
+    } else {
+        assert(address >> 24 == 3);
+        line_start = 0x03000000 | (address & 0x7fff & ~CODE_LINE_MASK);
+        gba->cache_iwram_code[(address & 0x7fff) >> CODE_LINE_SHIFT] = 0;
+        writes = &gba->cache_iwram_writes[(address & 0x7fff) >> CODE_LINE_SHIFT];
+    }
+    if (*writes < CODE_LINE_HOT && ++*writes == CODE_LINE_HOT) gba->cache_hot_lines = true;
+    uint32_t line_end = line_start + CODE_LINE_MASK + 1;
+
+    // Any block that overlaps the line must start less than one block span before it
+    uint32_t first = (line_start & 0xffffff) >= BLOCK_MAX_BYTES ? line_start - BLOCK_MAX_BYTES : line_start & 0xff000000;
+    for (uint32_t start = first; start < line_end; start += 2) {
+        cpu_block *block = &gba->block_cache[block_cache_index(start)];
+        if ((block->tag & ~1) != start) continue;
+        uint32_t end = start + (block->length + 3) * block->size;
+        if (end <= line_start) continue;
+        block->tag = BLOCK_INVALID;
+
+        // Drop the cursors, in case they point into this block
+        gba->arm_cache_instr = nullptr;
+        gba->thumb_cache_instr = nullptr;
+    }
+}
+
+// Self-modifying code that was left to the interpreter gets another chance each frame
+void cpu_cache_end_frame() {
+    if (gba->cache_hot_lines) {
+        for (int i = 0; i < BLOCK_CACHE_SIZE; i++) {
+            if (gba->block_cache[i].length == 0) gba->block_cache[i].tag = BLOCK_INVALID;
+        }
+        gba->cache_hot_lines = false;
+    }
+    std::memset(gba->cache_ewram_writes, 0, sizeof(gba->cache_ewram_writes));
+    std::memset(gba->cache_iwram_writes, 0, sizeof(gba->cache_iwram_writes));
+}
@@ -0,0 +1,1909 @@
+// Copyright (c) 2021 Ridge Shrubsall
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "cpu.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+#include <fmt/core.h>
+
+#include "context.h"
+#include "io.h"
+#include "memory.h"
+#include "system.h"
+#include "video.h"
+
+#if !defined(__x86_64__) && !defined(_M_X64)
+
+bool cpu_jit_supported() {
+    return false;
+}
+
+bool arm_jit_step() {
+    return false;
+}
+
+bool thumb_jit_step() {
+    return false;
+}
+
+void cpu_jit_release() {}
+
+#else
+
+#define JIT_BUFFER_SIZE 0x800000
+#define JIT_BLOCK_SPACE 0x10000  // Free space required before compiling a block, more than the largest one needs
+#define JIT_PAGE_SIZE   0x1000
+#define JIT_REACH       0x60000000  // Furthest the buffer may be placed from the executable
+#define JIT_BLOCK_USES  8        // Times a block runs in the interpreter first, so code that keeps changing isn't compiled
+
+// Guest registers live in memory; the translated code keeps a few things pinned in host registers:
+//   rbx      &r[0]
+//   rbp      cycles left until the next scheduled event
+//   r12d     nonzero once a slow path has run, so the frame loop must get control back
+//   r13-r15  temporaries that survive calls to the memory thunks
+// The memory thunks take the address in eax and the value in edx, and return the value in eax.
+// They may clobber rax, rcx, rdx and r8-r11, but never rsi or rdi.
+
+#define X64_RAX 0
+#define X64_RCX 1
+#define X64_RDX 2
+#define X64_RBX 3
+#define X64_RSP 4
+#define X64_RBP 5
+#define X64_RSI 6
+#define X64_RDI 7
+#define X64_R8  8
+#define X64_R12 12
+#define X64_R13 13
+#define X64_R14 14
+#define X64_R15 15
+
+#ifdef _WIN32
+#define X64_ARG0   X64_RCX
+#define X64_ARG1   X64_RDX
+#define X64_ARG2   X64_R8
+#define X64_SHADOW 32
+#else
+#define X64_ARG0   X64_RDI
+#define X64_ARG1   X64_RSI
+#define X64_ARG2   X64_RDX
+#define X64_SHADOW 0
+#endif
+
+#define X64_FRAME (8 + X64_SHADOW)  // Keeps the stack 16-byte aligned at calls into C
+
+#define X64_ADD 0
+#define X64_OR  1
+#define X64_ADC 2
+#define X64_SBB 3
+#define X64_AND 4
+#define X64_SUB 5
+#define X64_XOR 6
+#define X64_CMP 7
+
+#define X64_ROR 1
+#define X64_SHL 4
+#define X64_SHR 5
+#define X64_SAR 7
+
+#define X64_CC_O  0
+#define X64_CC_B  2
+#define X64_CC_E  4
+#define X64_CC_NE 5
+#define X64_CC_BE 6
+#define X64_CC_A  7
+
+#define JIT_NEXT  0  // Falls through to the next instruction
+#define JIT_CHECK 1  // Falls through, but may have run a slow path that needs the frame loop
+#define JIT_END   2  // Always leaves the block
+
+struct x64_mem {
+    int base;  // -1 for RIP-relative
+    int index;
+    int scale;
+    int32_t disp;
+    const void *target;
+};
+
+static uint8_t *jit_buffer;
+static uint8_t *jit_ptr;
+static uint8_t *jit_code_start;
+static bool jit_ready;
+static bool jit_failed;
+
+static std::atomic<gba_context *> jit_context;  // The instance using the buffer; the others keep to the interpreter
+
+static void (*jit_enter)(const uint8_t *code, gba_context *context);
+static const uint8_t *jit_exit;
+static const uint8_t *jit_read[3];  // Indexed by log2 of the access size
+static const uint8_t *jit_write[3];
+static const uint8_t *jit_branch_arm;
+static const uint8_t *jit_branch_thumb;
+static uint8_t jit_fill_cycles_arm[16];
+static uint8_t jit_fill_cycles_thumb[16];
+
+static std::vector<uint8_t *> jit_exit_patches[BLOCK_MAX_INSTRS + 1];
+static std::vector<std::pair<uint8_t *, uint32_t>> jit_tick_patches;
+
+template <typename T>
+static const void *jit_function(T *f) {
+    return reinterpret_cast<const void *>(f);
+}
+
+static void jit_tick(uint32_t cycles) {
+    system_tick(cycles);
+}
+
+static void emit8(uint32_t value) {
+    *jit_ptr++ = (uint8_t) value;
+}
+
+static void emit16(uint32_t value) {
+    emit8(value);
+    emit8(value >> 8);
+}
+
+static void emit32(uint32_t value) {
+    emit16(value);
+    emit16(value >> 16);
+}
+
+static int32_t rel32(const void *target, const uint8_t *next) {
+    ptrdiff_t disp = (const uint8_t *) target - next;
+    assert(disp == (int32_t) disp);
+    return (int32_t) disp;
+}
+
+static x64_mem mem_base(int base, int32_t disp = 0) {
+    return {base, -1, 1, disp, nullptr};
+}
+
+static x64_mem mem_index(int base, int index, int scale = 1, int32_t disp = 0) {
+    return {base, index, scale, disp, nullptr};
+}
+
+static x64_mem mem_abs(const void *target) {
+    return {-1, -1, 1, 0, target};
+}
+
+// Instance state is addressed relative to rbx, which holds the context, so the code
+// doesn't depend on where the context was allocated
+static x64_mem mem_context(const void *target) {
+    return mem_base(X64_RBX, (int32_t) ((const uint8_t *) target - (const uint8_t *) gba));
+}
+
+static x64_mem guest(uint32_t i) {
+    return mem_context(&gba->r[i]);
+}
+
+// Opcodes are written most significant byte first, so 0x0fb6 is movzx
+static void x64_opcode(uint32_t opcode) {
+    if (opcode > 0xff) emit8(opcode >> 8);
+    emit8(opcode);
+}
+
+static void x64_rex(bool w, int reg, int index, int base, bool force) {
+    uint8_t rex = 0x40 | (w ? 8 : 0) | (reg & 8 ? 4 : 0) | (index > 0 && (index & 8) ? 2 : 0) | (base > 0 && (base & 8) ? 1 : 0);
+    if (rex != 0x40 || force) emit8(rex);
+}
+
+static bool x64_byte_reg_needs_rex(int reg) {
+    return reg >= X64_RSP && reg <= X64_RDI;  // spl..dil rather than ah..bh
+}
+
+// Register direct operand; byte_rm is set when rm names a byte register
+static void x64_rr(int prefix, bool w, uint32_t opcode, int reg, int rm, bool byte_rm = false, bool byte_reg = false) {
+    if (prefix) emit8(prefix);
+    x64_rex(w, reg, -1, rm, (byte_rm && x64_byte_reg_needs_rex(rm)) || (byte_reg && x64_byte_reg_needs_rex(reg)));
+    x64_opcode(opcode);
+    emit8(0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// Memory operand; imm_size is the size of any immediate that follows, for RIP-relative addressing
+static void x64_rm(int prefix, bool w, uint32_t opcode, int reg, const x64_mem &m, int imm_size = 0, bool byte_reg = false) {
+    if (prefix) emit8(prefix);
+    x64_rex(w, reg, m.index, m.base, byte_reg && x64_byte_reg_needs_rex(reg));
+    x64_opcode(opcode);
+    if (m.base < 0) {
+        emit8((reg & 7) << 3 | 5);
+        emit32(rel32(m.target, jit_ptr + 4 + imm_size));
+        return;
+    }
+    int base = m.base & 7;
+    bool sib = (m.index >= 0 || base == X64_RSP);
+    int mod = (m.disp == 0 && base != X64_RBP ? 0 : (m.disp == (int8_t) m.disp ? 1 : 2));
+    emit8(mod << 6 | (reg & 7) << 3 | (sib ? 4 : base));
+    if (sib) {
+        int scale = (m.scale == 8 ? 3 : m.scale == 4 ? 2 : m.scale == 2 ? 1 : 0);
+        emit8(scale << 6 | (m.index >= 0 ? m.index & 7 : 4) << 3 | base);
+    }
+    if (mod == 1) emit8(m.disp);
+    if (mod == 2) emit32(m.disp);
+}
+
+static void mov_rr(int dst, int src, bool w = false) {
+    x64_rr(0, w, 0x89, src, dst);
+}
+
+static void mov_rm(int dst, const x64_mem &m, bool w = false) {
+    x64_rm(0, w, 0x8b, dst, m);
+}
+
+static void mov_mr(const x64_mem &m, int src, bool w = false) {
+    x64_rm(0, w, 0x89, src, m);
+}
+
+static void mov_mr16(const x64_mem &m, int src) {
+    x64_rm(0x66, false, 0x89, src, m);
+}
+
+static void mov_mr8(const x64_mem &m, int src) {
+    x64_rm(0, false, 0x88, src, m, 0, true);
+}
+
+static void mov_ri(int dst, uint32_t imm) {
+    x64_rex(false, 0, -1, dst, false);
+    emit8(0xb8 | (dst & 7));
+    emit32(imm);
+}
+
+static void mov_mi(const x64_mem &m, uint32_t imm) {
+    x64_rm(0, false, 0xc7, 0, m, 4);
+    emit32(imm);
+}
+
+static void mov_mi16(const x64_mem &m, uint32_t imm) {
+    x64_rm(0x66, false, 0xc7, 0, m, 2);
+    emit16(imm);
+}
+
+static void mov_mi8(const x64_mem &m, uint32_t imm) {
+    x64_rm(0, false, 0xc6, 0, m, 1);
+    emit8(imm);
+}
+
+static void movzx_rr8(int dst, int src) {
+    x64_rr(0, false, 0x0fb6, dst, src, true);
+}
+
+static void movzx_rr16(int dst, int src) {
+    x64_rr(0, false, 0x0fb7, dst, src);
+}
+
+static void movsx_rr8(int dst, int src) {
+    x64_rr(0, false, 0x0fbe, dst, src, true);
+}
+
+static void movsx_rr16(int dst, int src) {
+    x64_rr(0, false, 0x0fbf, dst, src);
+}
+
+static void movsxd_rm(int dst, const x64_mem &m) {
+    x64_rm(0, true, 0x63, dst, m);
+}
+
+static void movzx_rm8(int dst, const x64_mem &m) {
+    x64_rm(0, false, 0x0fb6, dst, m);
+}
+
+static void movzx_rm16(int dst, const x64_mem &m) {
+    x64_rm(0, false, 0x0fb7, dst, m);
+}
+
+static void lea(int dst, const x64_mem &m, bool w = true) {
+    x64_rm(0, w, 0x8d, dst, m);
+}
+
+static void alu_rr(int op, int dst, int src, bool w = false) {
+    x64_rr(0, w, op << 3 | 1, src, dst);
+}
+
+static void alu_rm(int op, int dst, const x64_mem &m, bool w = false) {
+    x64_rm(0, w, op << 3 | 3, dst, m);
+}
+
+static void alu_ri(int op, int dst, uint32_t imm, bool w = false) {
+    if ((int32_t) imm == (int8_t) imm) {
+        x64_rr(0, w, 0x83, op, dst);
+        emit8(imm);
+    } else {
+        x64_rr(0, w, 0x81, op, dst);
+        emit32(imm);
+    }
+}
+
+static void alu_mi(int op, const x64_mem &m, uint32_t imm) {
+    if ((int32_t) imm == (int8_t) imm) {
+        x64_rm(0, false, 0x83, op, m, 1);
+        emit8(imm);
+    } else {
+        x64_rm(0, false, 0x81, op, m, 4);
+        emit32(imm);
+    }
+}
+
+static void shift_ri(int op, int dst, uint32_t n, bool w = false) {
+    x64_rr(0, w, 0xc1, op, dst);
+    emit8(n);
+}
+
+static void shift_rcl(int op, int dst) {
+    x64_rr(0, false, 0xd3, op, dst);
+}
+
+static void test_rr(int a, int b, bool w = false) {
+    x64_rr(0, w, 0x85, b, a);
+}
+
+static void test_rm(int a, const x64_mem &m) {
+    x64_rm(0, false, 0x85, a, m);
+}
+
+static void test_ri8(int a, uint32_t imm) {
+    x64_rr(0, false, 0xf6, 0, a, true);
+    emit8(imm);
+}
+
+static void test_mi(const x64_mem &m, uint32_t imm) {
+    x64_rm(0, false, 0xf7, 0, m, 4);
+    emit32(imm);
+}
+
+static void cmp_mi8(const x64_mem &m, uint32_t imm) {
+    x64_rm(0, false, 0x80, X64_CMP, m, 1);
+    emit8(imm);
+}
+
+static void not_r(int dst) {
+    x64_rr(0, false, 0xf7, 2, dst);
+}
+
+static void imul_rm(int dst, const x64_mem &m) {
+    x64_rm(0, false, 0x0faf, dst, m);
+}
+
+static void imul_rr(int dst, int src, bool w = false) {
+    x64_rr(0, w, 0x0faf, dst, src);
+}
+
+static void imul_rri(int dst, int src, uint32_t imm) {
+    x64_rr(0, false, 0x69, dst, src);
+    emit32(imm);
+}
+
+static void bt_ri(int a, uint32_t bit) {
+    x64_rr(0, false, 0x0fba, 4, a);
+    emit8(bit);
+}
+
+static void bt_mi(const x64_mem &m, uint32_t bit) {
+    x64_rm(0, false, 0x0fba, 4, m, 1);
+    emit8(bit);
+}
+
+static void setcc(int cc, int dst) {
+    x64_rr(0, false, 0x0f90 | cc, 0, dst, true);
+}
+
+static void push(int reg) {
+    x64_rex(false, 0, -1, reg, false);
+    emit8(0x50 | (reg & 7));
+}
+
+static void pop(int reg) {
+    x64_rex(false, 0, -1, reg, false);
+    emit8(0x58 | (reg & 7));
+}
+
+static void call(const void *target) {
+    emit8(0xe8);
+    emit32(rel32(target, jit_ptr + 4));
+}
+
+static void jmp(const void *target) {
+    emit8(0xe9);
+    emit32(rel32(target, jit_ptr + 4));
+}
+
+static void jmp_r(int reg) {
+    x64_rr(0, false, 0xff, 4, reg);
+}
+
+static void jcc(int cc, const void *target) {
+    emit8(0x0f);
+    emit8(0x80 | cc);
+    emit32(rel32(target, jit_ptr + 4));
+}
+
+// Forward jumps return the location of their displacement, to be filled in by bind()
+static uint8_t *jmp_forward() {
+    emit8(0xe9);
+    emit32(0);
+    return jit_ptr - 4;
+}
+
+static uint8_t *jcc_forward(int cc) {
+    emit8(0x0f);
+    emit8(0x80 | cc);
+    emit32(0);
+    return jit_ptr - 4;
+}
+
+static void bind(uint8_t *patch) {
+    int32_t disp = rel32(jit_ptr, patch + 4);
+    for (int i = 0; i < 4; i++) {
+        patch[i] = (uint8_t) (disp >> 8 * i);
+    }
+}
+
+static void ret() {
+    emit8(0xc3);
+}
+
+static void jit_store_cycles() {
+    mov_rm(X64_RAX, mem_context(&gba->scheduler_next_event), true);
+    alu_rr(X64_SUB, X64_RAX, X64_RBP, true);
+    mov_mr(mem_context(&gba->scheduler_cycles), X64_RAX, true);
+}
+
+static void jit_load_cycles() {
+    mov_rm(X64_RBP, mem_context(&gba->scheduler_next_event), true);
+    alu_rm(X64_SUB, X64_RBP, mem_context(&gba->scheduler_cycles), true);
+}
+
+// Calls into C from a thunk, which was itself called from translated code
+static void jit_thunk_call(const void *f) {
+    alu_ri(X64_SUB, X64_RSP, X64_FRAME, true);
+    jit_store_cycles();
+    call(f);
+    mov_ri(X64_R12, 1);
+    jit_load_cycles();
+    alu_ri(X64_ADD, X64_RSP, X64_FRAME, true);
+}
+
+static void jit_emit_enter_and_exit() {
+    jit_enter = reinterpret_cast<void (*)(const uint8_t *, gba_context *)>(jit_ptr);
+    push(X64_RBX);
+    push(X64_RBP);
+    push(X64_R12);
+    push(X64_R13);
+    push(X64_R14);
+    push(X64_R15);
+    alu_ri(X64_SUB, X64_RSP, X64_FRAME, true);
+    mov_rr(X64_RBX, X64_ARG1, true);
+    jit_load_cycles();
+    alu_rr(X64_XOR, X64_R12, X64_R12);
+    jmp_r(X64_ARG0);
+
+    jit_exit = jit_ptr;
+    jit_store_cycles();
+    alu_ri(X64_ADD, X64_RSP, X64_FRAME, true);
+    pop(X64_R15);
+    pop(X64_R14);
+    pop(X64_R13);
+    pop(X64_R12);
+    pop(X64_RBP);
+    pop(X64_RBX);
+    ret();
+}
+
+// Consumes the cycles for an access, or jumps to the slow path if that would reach the next event
+static void jit_emit_access_cycles(uint32_t cycles, std::vector<uint8_t *> &slow) {
+    alu_ri(X64_CMP, X64_RBP, cycles, true);
+    slow.push_back(jcc_forward(X64_CC_BE));
+    alu_ri(X64_SUB, X64_RBP, cycles, true);
+}
+
+static void jit_emit_load(uint32_t size, const x64_mem &m) {
+    switch (size) {
+        case 1: movzx_rm8(X64_RAX, m); break;
+        case 2: movzx_rm16(X64_RAX, m); break;
+        case 4: mov_rm(X64_RAX, m); break;
+        default: assert(false); break;
+    }
+}
+
+static void jit_emit_store(uint32_t size, const x64_mem &m) {
+    switch (size) {
+        case 1: mov_mr8(m, X64_RDX); break;
+        case 2: mov_mr16(m, X64_RDX); break;
+        case 4: mov_mr(m, X64_RDX); break;
+        default: assert(false); break;
+    }
+}
+
+static const uint8_t *jit_emit_read_thunk(uint32_t size) {
+    const uint8_t *start = jit_ptr;
+    uint32_t align = ~(size - 1);
+    std::vector<uint8_t *> slow;
+
+    mov_rr(X64_RCX, X64_RAX);
+    shift_ri(X64_SHR, X64_RCX, 24);
+
+    const struct {
+        uint32_t region;
+        uint32_t mask;
+        const uint8_t *base;
+    } ram[] = {{3, 0x7fff, gba->cpu_iwram}, {2, 0x3ffff, gba->cpu_ewram}};
+    for (const auto &it : ram) {
+        alu_ri(X64_CMP, X64_RCX, it.region);
+        uint8_t *next = jcc_forward(X64_CC_NE);
+        jit_emit_access_cycles(size == 4 ? cycles_word(it.region) : cycles_byte_or_halfword(it.region), slow);
+        alu_ri(X64_AND, X64_RAX, it.mask & align);
+        lea(X64_RCX, mem_context(it.base));
+        jit_emit_load(size, mem_index(X64_RCX, X64_RAX));
+        ret();
+        bind(next);
+    }
+
+    // Game ROM, apart from the header and anything past the end of the image
+    alu_ri(X64_SUB, X64_RCX, 8);
+    alu_ri(X64_CMP, X64_RCX, 0xc - 8);
+    slow.push_back(jcc_forward(X64_CC_A));
+    mov_rr(X64_RCX, X64_RAX);
+    alu_ri(X64_AND, X64_RCX, 0x1ffffff & align);
+    alu_ri(X64_CMP, X64_RCX, 0x100);
+    slow.push_back(jcc_forward(X64_CC_B));
+    alu_rm(X64_CMP, X64_RCX, mem_context(&gba->game_rom_mask));
+    slow.push_back(jcc_forward(X64_CC_A));
+    jit_emit_access_cycles(size == 4 ? cycles_word(8) : cycles_byte_or_halfword(8), slow);
+    mov_rm(X64_RAX, mem_context(&gba->game_rom), true);
+    jit_emit_load(size, mem_index(X64_RAX, X64_RCX));
+    ret();
+
+    for (uint8_t *patch : slow) bind(patch);
+    mov_rr(X64_ARG0, X64_RAX);
+    alu_rr(X64_XOR, X64_ARG1, X64_ARG1);
+    switch (size) {
+        case 1: jit_thunk_call(jit_function<uint8_t(uint32_t, bool)>(memory_read_byte)); movzx_rr8(X64_RAX, X64_RAX); break;
+        case 2: jit_thunk_call(jit_function<uint16_t(uint32_t, bool)>(memory_read_halfword)); movzx_rr16(X64_RAX, X64_RAX); break;
+        case 4: jit_thunk_call(jit_function<uint32_t(uint32_t, bool)>(memory_read_word)); break;
+        default: assert(false); break;
+    }
+    ret();
+    return start;
+}
+
+static const uint8_t *jit_emit_write_thunk(uint32_t size) {
+    const uint8_t *start = jit_ptr;
+    uint32_t align = ~(size - 1);
+    std::vector<uint8_t *> slow;
+
+    mov_rr(X64_RCX, X64_RAX);
+    shift_ri(X64_SHR, X64_RCX, 24);
+
+    // Writes to lines holding cached code go through the bus, which invalidates them
+    const struct {
+        uint32_t region;
+        uint32_t mask;
+        uint8_t *base;
+        const uint8_t *code;
+    } ram[] = {{3, 0x7fff, gba->cpu_iwram, gba->cache_iwram_code}, {2, 0x3ffff, gba->cpu_ewram, gba->cache_ewram_code}};
+    for (const auto &it : ram) {
+        alu_ri(X64_CMP, X64_RCX, it.region);
+        uint8_t *next = jcc_forward(X64_CC_NE);
+        mov_rr(X64_RCX, X64_RAX);
+        alu_ri(X64_AND, X64_RCX, it.mask);
+        shift_ri(X64_SHR, X64_RCX, CODE_LINE_SHIFT);
+        lea(X64_R8, mem_context(it.code));
+        cmp_mi8(mem_index(X64_R8, X64_RCX), 0);
+        slow.push_back(jcc_forward(X64_CC_NE));
+        jit_emit_access_cycles(size == 4 ? cycles_word(it.region) : cycles_byte_or_halfword(it.region), slow);
+        alu_ri(X64_AND, X64_RAX, it.mask & align);
+        lea(X64_RCX, mem_context(it.base));
+        jit_emit_store(size, mem_index(X64_RCX, X64_RAX));
+        ret();
+        bind(next);
+    }
+
+    for (uint8_t *patch : slow) bind(patch);
+    switch (size) {
+        case 1: movzx_rr8(X64_ARG1, X64_RDX); break;
+        case 2: movzx_rr16(X64_ARG1, X64_RDX); break;
+        case 4: mov_rr(X64_ARG1, X64_RDX); break;
+        default: assert(false); break;
+    }
+    mov_rr(X64_ARG0, X64_RAX);
+    alu_rr(X64_XOR, X64_ARG2, X64_ARG2);
+    switch (size) {
+        case 1: jit_thunk_call(jit_function<void(uint32_t, uint8_t, bool)>(memory_write_byte)); break;
+        case 2: jit_thunk_call(jit_function<void(uint32_t, uint16_t, bool)>(memory_write_halfword)); break;
+        case 4: jit_thunk_call(jit_function<void(uint32_t, uint32_t, bool)>(memory_write_word)); break;
+        default: assert(false); break;
+    }
+    ret();
+    return start;
+}
+
+// Jumped to with the target address in eax; carries on in the target block if it is compiled and
+// nothing needs the frame loop first, otherwise leaves with the branch pending
+static const uint8_t *jit_emit_branch_thunk(const uint8_t *fill_cycles, uint32_t tag_bit) {
+    const uint8_t *start = jit_ptr;
+    std::vector<uint8_t *> exit;
+
+    test_rr(X64_R12, X64_R12);
+    exit.push_back(jcc_forward(X64_CC_NE));
+    test_ri8(X64_RAX, tag_bit ? 1 : 3);
+    exit.push_back(jcc_forward(X64_CC_NE));
+
+    // Same hash as block_cache_index
+    mov_rr(X64_RCX, X64_RAX);
+    shift_ri(X64_SHR, X64_RCX, 1);
+    mov_rr(X64_RDX, X64_RAX);
+    shift_ri(X64_SHR, X64_RDX, 17);
+    alu_rr(X64_XOR, X64_RCX, X64_RDX);
+    alu_ri(X64_AND, X64_RCX, BLOCK_CACHE_SIZE - 1);
+    imul_rri(X64_RCX, X64_RCX, sizeof(cpu_block));
+    lea(X64_RDX, mem_context(gba->block_cache));
+    alu_rr(X64_ADD, X64_RDX, X64_RCX, true);
+    lea(X64_RCX, mem_base(X64_RAX, tag_bit), false);
+    alu_rm(X64_CMP, X64_RCX, mem_base(X64_RDX, offsetof(cpu_block, tag)));
+    exit.push_back(jcc_forward(X64_CC_NE));
+    // Let the frame loop see the start of an idle loop
+    cmp_mi8(mem_base(X64_RDX, offsetof(cpu_block, idle)), 0);
+    exit.push_back(jcc_forward(X64_CC_NE));
+    mov_rm(X64_RCX, mem_base(X64_RDX, offsetof(cpu_block, code)), true);
+    test_rr(X64_RCX, X64_RCX, true);
+    exit.push_back(jcc_forward(X64_CC_E));
+
+    // Refilling the pipeline must not reach the next event either
+    mov_rr(X64_RDX, X64_RAX);
+    shift_ri(X64_SHR, X64_RDX, 24);
+    alu_ri(X64_AND, X64_RDX, 15);
+    lea(X64_R8, mem_abs(fill_cycles));
+    movzx_rm8(X64_RDX, mem_index(X64_R8, X64_RDX));
+    alu_rr(X64_CMP, X64_RBP, X64_RDX, true);
+    exit.push_back(jcc_forward(X64_CC_BE));
+    alu_rr(X64_SUB, X64_RBP, X64_RDX, true);
+    jmp_r(X64_RCX);
+
+    for (uint8_t *patch : exit) bind(patch);
+    mov_mr(guest(REG_PC), X64_RAX);
+    mov_mi8(mem_context(&gba->branch_taken), 1);
+    jmp(jit_exit);
+    return start;
+}
+
+// Emitted code calls helpers and reads tables with 32-bit displacements, so the buffer must lie within 2 GB of the executable
+static uint8_t *jit_alloc_buffer() {
+    uintptr_t anchor = (uintptr_t) &jit_buffer & ~(uintptr_t) 0xffff;
+    for (uintptr_t offset = 0x4000000; offset < JIT_REACH; offset += 0x4000000) {
+        for (int side = 0; side < 2; side++) {
+            if (side == 0 && anchor < offset) continue;
+            uintptr_t hint = (side == 0 ? anchor - offset : anchor + offset);
+#ifdef _WIN32
+            void *p = VirtualAlloc((void *) hint, JIT_BUFFER_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+            if (p == nullptr) continue;
+#else
+            int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_JIT
+            flags |= MAP_JIT;
+#endif
+            void *p = mmap((void *) hint, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+            if (p == MAP_FAILED) continue;
+#endif
+            uintptr_t start = (uintptr_t) p;
+            uintptr_t distance = (start > anchor ? start + JIT_BUFFER_SIZE - anchor : anchor - start);
+            if (distance < JIT_REACH) return (uint8_t *) p;
+#ifdef _WIN32
+            VirtualFree(p, 0, MEM_RELEASE);
+#else
+            munmap(p, JIT_BUFFER_SIZE);
+#endif
+        }
+    }
+    return nullptr;
+}
+
+// Makes the pages covering a range either writable or executable, never both at once
+static bool jit_protect(uint8_t *start, size_t size, bool writable) {
+    uintptr_t first = (uintptr_t) start & ~(uintptr_t) (JIT_PAGE_SIZE - 1);
+    uintptr_t last = ((uintptr_t) start + size + JIT_PAGE_SIZE - 1) & ~(uintptr_t) (JIT_PAGE_SIZE - 1);
+    last = std::min(last, (uintptr_t) jit_buffer + JIT_BUFFER_SIZE);
+    if (last <= first) return true;
+#ifdef _WIN32
+    DWORD old_protect;
+    return VirtualProtect((void *) first, last - first, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old_protect);
+#else
+    return (mprotect((void *) first, last - first, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0);
+#endif
+}
+
+// Turns the JIT off for good; reported once, since jit_init won't try again
+static void jit_fail(const char *reason) {
+    fmt::print(stderr, "JIT disabled: {}\n", reason);
+    jit_failed = true;
+    jit_ready = false;
+    gba->cpu_jit_enabled = false;
+}
+
+static bool jit_init() {
+    gba_context *owner = jit_context.load(std::memory_order_acquire);
+    if (owner != gba && (owner != nullptr || !jit_context.compare_exchange_strong(owner, gba))) return false;
+    if (jit_ready) return true;
+    if (jit_failed) return false;
+
+    jit_buffer = jit_alloc_buffer();
+    if (jit_buffer == nullptr) {
+        jit_fail("no memory near the executable for the code buffer");
+        return false;
+    }
+
+    for (uint32_t region = 0; region < 16; region++) {
+        jit_fill_cycles_arm[region] = (uint8_t) (3 * cycles_word(region));
+        jit_fill_cycles_thumb[region] = (uint8_t) (3 * cycles_byte_or_halfword(region));
+    }
+
+    jit_ptr = jit_buffer;
+    jit_emit_enter_and_exit();
+    for (uint32_t i = 0; i < 3; i++) {
+        jit_read[i] = jit_emit_read_thunk(1 << i);
+        jit_write[i] = jit_emit_write_thunk(1 << i);
+    }
+    jit_branch_arm = jit_emit_branch_thunk(jit_fill_cycles_arm, 0);
+    jit_branch_thumb = jit_emit_branch_thunk(jit_fill_cycles_thumb, 1);
+    jit_code_start = jit_ptr;
+    if (!jit_protect(jit_buffer, JIT_BUFFER_SIZE, false)) {
+        jit_fail("the code buffer can't be made executable");
+        return false;
+    }
+    jit_ready = true;
+    return true;
+}
+
+// Copies the host flags selected by mask into the CPSR; the result must already be stored, since this clobbers eax
+static void jit_store_flags(uint32_t mask, bool inverted_carry) {
+    if (inverted_carry) emit8(0xf5);  // cmc: ARM carry is the inverse of the x86 borrow
+    emit8(0x9f);                      // lahf
+    if (mask & PSR_V) setcc(X64_CC_O, X64_RAX);
+    // SF (bit 15), ZF (bit 14), CF (bit 8) and OF (bit 0) are moved to bits 31-28 with a single multiply
+    alu_ri(X64_AND, X64_RAX, 0xc101);
+    imul_rri(X64_RAX, X64_RAX, 0x10210000);
+    alu_ri(X64_AND, X64_RAX, mask);
+    alu_mi(X64_AND, mem_context(&gba->cpsr), ~mask);
+    alu_rm(X64_OR, X64_RAX, mem_context(&gba->cpsr));
+    mov_mr(mem_context(&gba->cpsr), X64_RAX);
+}
+
+// Jumps when the condition holds
+static uint8_t *jit_jump_if(uint32_t cond) {
+    switch (cond) {
+        case COND_EQ: test_mi(mem_context(&gba->cpsr), PSR_Z); return jcc_forward(X64_CC_NE);
+        case COND_NE: test_mi(mem_context(&gba->cpsr), PSR_Z); return jcc_forward(X64_CC_E);
+        case COND_CS: test_mi(mem_context(&gba->cpsr), PSR_C); return jcc_forward(X64_CC_NE);
+        case COND_CC: test_mi(mem_context(&gba->cpsr), PSR_C); return jcc_forward(X64_CC_E);
+        case COND_MI: test_mi(mem_context(&gba->cpsr), PSR_N); return jcc_forward(X64_CC_NE);
+        case COND_PL: test_mi(mem_context(&gba->cpsr), PSR_N); return jcc_forward(X64_CC_E);
+        case COND_VS: test_mi(mem_context(&gba->cpsr), PSR_V); return jcc_forward(X64_CC_NE);
+        case COND_VC: test_mi(mem_context(&gba->cpsr), PSR_V); return jcc_forward(X64_CC_E);
+        default:
+            mov_rm(X64_RAX, mem_context(&gba->cpsr));
+            shift_ri(X64_SHR, X64_RAX, 28);
+            lea(X64_RCX, mem_abs(cond_lookup));
+            movzx_rm16(X64_RAX, mem_index(X64_RCX, X64_RAX, 2));
+            bt_ri(X64_RAX, cond);
+            return jcc_forward(X64_CC_B);
+    }
+}
+
+// Instruction at index j of the block, as it was when the block was decoded
+static uint32_t block_fetch(const cpu_block *block, uint32_t j) {
+    if (j < block->length) return block->instrs[j].op;
+    if (j >= 3) return block->instrs[j - 3].fetch;
+    return block->pipeline[j - 1];
+}
+
+// Makes the program counter and prefetched opcode visible to slow memory accesses made by instruction k
+static void thumb_jit_sync(const cpu_block *block, uint32_t k) {
+    uint32_t address = (block->tag & ~1) + 2 * k;
+    mov_mi(guest(REG_PC), address + 4);
+    mov_mi16(mem_context(&gba->thumb_pipeline[1]), block_fetch(block, k + 2));
+}
+
+// Calls a handler that only touches registers
+static void thumb_jit_call(const cpu_block *block, uint32_t k) {
+    const cpu_block_instr &instr = block->instrs[k];
+    mov_mi(guest(REG_PC), (block->tag & ~1) + 2 * k + 4);
+    mov_ri(X64_ARG0, instr.op);
+    call(jit_function(instr.handler.thumb));
+}
+
+// Runs instruction k through the interpreter with the full CPU state in place
+static void thumb_jit_fallback(const cpu_block *block, uint32_t k) {
+    const cpu_block_instr &instr = block->instrs[k];
+    thumb_jit_sync(block, k);
+    mov_mi16(mem_context(&gba->thumb_op), instr.op);
+    mov_mi16(mem_context(&gba->thumb_pipeline[0]), block_fetch(block, k + 1));
+    jit_store_cycles();
+    mov_ri(X64_ARG0, instr.op);
+    call(jit_function(instr.handler.thumb));
+    jit_load_cycles();
+    mov_ri(X64_R12, 1);
+    cmp_mi8(mem_context(&gba->branch_taken), 0);
+    jcc(X64_CC_NE, jit_exit);
+}
+
+static void jit_load_operand(int reg, uint32_t i, uint32_t pc) {
+    if (i == REG_PC) {
+        mov_ri(reg, pc);
+    } else {
+        mov_rm(reg, guest(i));
+    }
+}
+
+// Branches to the address in eax, which is already aligned
+static void thumb_jit_branch() {
+    jmp(jit_branch_thumb);
+}
+
+#define LOAD_WORD          0
+#define LOAD_WORD_ALIGNED  1
+#define LOAD_HALFWORD      2
+#define LOAD_SIGNED_HALF   3
+#define LOAD_BYTE          4
+#define LOAD_SIGNED_BYTE   5
+
+// Loads r[Rd] from the address in eax, with the rotation and sign extension of the interpreter;
+// a value for the PC is left in eax for the branch
+static void jit_load(uint32_t kind, uint32_t Rd) {
+    switch (kind) {
+        case LOAD_WORD:
+            mov_rr(X64_R13, X64_RAX);
+            call(jit_read[2]);
+            mov_rr(X64_RCX, X64_R13);
+            alu_ri(X64_AND, X64_RCX, 3);
+            shift_ri(X64_SHL, X64_RCX, 3);
+            shift_rcl(X64_ROR, X64_RAX);
+            break;
+        case LOAD_WORD_ALIGNED:
+            call(jit_read[2]);
+            break;
+        case LOAD_HALFWORD:
+            mov_rr(X64_R13, X64_RAX);
+            call(jit_read[1]);
+            mov_rr(X64_RCX, X64_R13);
+            alu_ri(X64_AND, X64_RCX, 1);
+            shift_ri(X64_SHL, X64_RCX, 3);
+            shift_rcl(X64_ROR, X64_RAX);
+            break;
+        case LOAD_SIGNED_HALF:
+            // An odd address loads the sign-extended high byte
+            mov_rr(X64_R13, X64_RAX);
+            call(jit_read[1]);
+            mov_rr(X64_RCX, X64_R13);
+            alu_ri(X64_AND, X64_RCX, 1);
+            shift_ri(X64_SHL, X64_RCX, 3);
+            movsx_rr16(X64_RAX, X64_RAX);
+            shift_rcl(X64_SAR, X64_RAX);
+            break;
+        case LOAD_BYTE:
+            call(jit_read[0]);
+            break;
+        case LOAD_SIGNED_BYTE:
+            call(jit_read[0]);
+            movsx_rr8(X64_RAX, X64_RAX);
+            break;
+        default:
+            assert(false);
+            break;
+    }
+    if (Rd != REG_PC) mov_mr(guest(Rd), X64_RAX);
+}
+
+// Stores r[Rd] to the address in eax
+static void thumb_jit_store(uint32_t size, uint32_t Rd) {
+    mov_rm(X64_RDX, guest(Rd));
+    call(jit_write[size == 4 ? 2 : size == 2 ? 1 : 0]);
+}
+
+static int thumb_jit_data_processing_register(uint16_t op) {
+    uint32_t opc = BITS(op, 6, 9);
+    uint32_t Rms = BITS(op, 3, 5);
+    uint32_t Rdn = BITS(op, 0, 2);
+
+    switch (opc) {
+        case THUMB_AND:
+        case THUMB_EOR:
+        case THUMB_ORR:
+            mov_rm(X64_RAX, guest(Rdn));
+            alu_rm(opc == THUMB_AND ? X64_AND : opc == THUMB_EOR ? X64_XOR : X64_OR, X64_RAX, guest(Rms));
+            mov_mr(guest(Rdn), X64_RAX);
+            jit_store_flags(PSR_N | PSR_Z, false);
+            break;
+        case THUMB_BIC:
+            mov_rm(X64_RAX, guest(Rms));
+            not_r(X64_RAX);
+            alu_rm(X64_AND, X64_RAX, guest(Rdn));
+            mov_mr(guest(Rdn), X64_RAX);
+            jit_store_flags(PSR_N | PSR_Z, false);
+            break;
+        case THUMB_MVN:
+            mov_rm(X64_RAX, guest(Rms));
+            not_r(X64_RAX);
+            mov_mr(guest(Rdn), X64_RAX);
+            test_rr(X64_RAX, X64_RAX);
+            jit_store_flags(PSR_N | PSR_Z, false);
+            break;
+        case THUMB_TST:
+            mov_rm(X64_RAX, guest(Rdn));
+            test_rm(X64_RAX, guest(Rms));
+            jit_store_flags(PSR_N | PSR_Z, false);
+            break;
+        case THUMB_ADC:
+            mov_rm(X64_RAX, guest(Rdn));
+            bt_mi(mem_context(&gba->cpsr), 29);
+            alu_rm(X64_ADC, X64_RAX, guest(Rms));
+            mov_mr(guest(Rdn), X64_RAX);
+            jit_store_flags(PSR_N | PSR_Z | PSR_C | PSR_V, false);
+            break;
+        case THUMB_SBC:
+            mov_rm(X64_RAX, guest(Rdn));
+            bt_mi(mem_context(&gba->cpsr), 29);
+            emit8(0xf5);  // cmc
+            alu_rm(X64_SBB, X64_RAX, guest(Rms));
+            mov_mr(guest(Rdn), X64_RAX);
+            jit_store_flags(PSR_N | PSR_Z | PSR_C | PSR_V, true);
+            break;
+        case THUMB_NEG:
+            alu_rr(X64_XOR, X64_RAX, X64_RAX);
+            alu_rm(X64_SUB, X64_RAX, guest(Rms));
+            mov_mr(guest(Rdn), X64_RAX);
+            jit_store_flags(PSR_N | PSR_Z | PSR_C | PSR_V, true);
+            break;
+        case THUMB_CMP:
+            mov_rm(X64_RAX, guest(Rdn));
+            alu_rm(X64_CMP, X64_RAX, guest(Rms));
+            jit_store_flags(PSR_N | PSR_Z | PSR_C | PSR_V, true);
+            break;
+        case THUMB_CMN:
+            mov_rm(X64_RAX, guest(Rdn));
+            alu_rm(X64_ADD, X64_RAX, guest(Rms));
+            jit_store_flags(PSR_N | PSR_Z | PSR_C | PSR_V, false);
+            break;
+        case THUMB_MUL:
+            mov_rm(X64_RAX, guest(Rdn));
+            imul_rm(X64_RAX, guest(Rms));
+            mov_mr(guest(Rdn), X64_RAX);
+            test_rr(X64_RAX, X64_RAX);
+            jit_store_flags(PSR_N | PSR_Z, false);
+            break;
+        default:
+            return -1;  // Shifts by register
+    }
+    return JIT_NEXT;
+}
+
+// Returns how control leaves the code for instruction k
+static int thumb_jit_instr(const cpu_block *block, uint32_t k) {
+    const cpu_block_instr &instr = block->instrs[k];
+    void (*f)(uint16_t) = instr.handler.thumb;
+    uint16_t op = (uint16_t) instr.op;
+    uint32_t address = (block->tag & ~1) + 2 * k;
+    uint32_t pc = address + 4;
+
+    if (f == thumb_shift_by_immediate) {
+        uint32_t opc = BITS(op, 11, 12);
+        uint32_t imm = BITS(op, 6, 10);
+        uint32_t Rm = BITS(op, 3, 5);
+        uint32_t Rd = BITS(op, 0, 2);
+
+        if (opc == SHIFT_LSL && imm == 0) {
+            mov_rm(X64_RAX, guest(Rm));
+            mov_mr(guest(Rd), X64_RAX);
+            test_rr(X64_RAX, X64_RAX);
+            jit_store_flags(PSR_N | PSR_Z, false);
+        } else if (imm == 0) {
+            thumb_jit_call(block, k);  // LSR #32 and ASR #32
+        } else {
+            mov_rm(X64_RAX, guest(Rm));
+            shift_ri(opc == SHIFT_LSL ? X64_SHL : opc == SHIFT_LSR ? X64_SHR : X64_SAR, X64_RAX, imm);
+            mov_mr(guest(Rd), X64_RAX);
+            jit_store_flags(PSR_N | PSR_Z | PSR_C, false);
+        }
+        return JIT_NEXT;
+    }
+
+    if (f == thumb_add_or_subtract_register || f == thumb_add_or_subtract_immediate) {
+        bool sub = BIT(op, 9);
+        uint32_t Rm = BITS(op, 6, 8);
+        uint32_t Rn = BITS(op, 3, 5);
+        uint32_t Rd = BITS(op, 0, 2);
+
+        mov_rm(X64_RAX, guest(Rn));
+        if (f == thumb_add_or_subtract_register) {
+            alu_rm(sub ? X64_SUB : X64_ADD, X64_RAX, guest(Rm));
+        } else {
+            alu_ri(sub ? X64_SUB : X64_ADD, X64_RAX, Rm);
+        }
+        mov_mr(guest(Rd), X64_RAX);
+        jit_store_flags(PSR_N | PSR_Z | PSR_C | PSR_V, sub);
+        return JIT_NEXT;
+    }
+
+    if (f == thumb_add_subtract_compare_or_move_immediate) {
+        uint32_t opc = BITS(op, 11, 12);
+        uint32_t Rdn = BITS(op, 8, 10);
+        uint32_t imm = BITS(op, 0, 7);
+
+        switch (opc) {
+            case 0:
+                mov_mi(guest(Rdn), imm);
+                alu_mi(X64_AND, mem_context(&gba->cpsr), ~(PSR_N | PSR_Z));
+                if (imm == 0) alu_mi(X64_OR, mem_context(&gba->cpsr), PSR_Z);
+                break;
+            case 1:
+                alu_mi(X64_CMP, guest(Rdn), imm);
+                jit_store_flags(PSR_N | PSR_Z | PSR_C | PSR_V, true);
+                break;
+            case 2:
+                alu_mi(X64_ADD, guest(Rdn), imm);
+                jit_store_flags(PSR_N | PSR_Z | PSR_C | PSR_V, false);
+                break;
+            case 3:
+                alu_mi(X64_SUB, guest(Rdn), imm);
+                jit_store_flags(PSR_N | PSR_Z | PSR_C | PSR_V, true);
+                break;
+            default:
+                assert(false);
+                break;
+        }
+        return JIT_NEXT;
+    }
+
+    if (f == thumb_data_processing_register) {
+        if (thumb_jit_data_processing_register(op) < 0) thumb_jit_call(block, k);
+        return JIT_NEXT;
+    }
+
+    if (f == thumb_special_data_processing) {
+        uint32_t opc = BITS(op, 8, 9);
+        uint32_t Rm = BITS(op, 3, 6);
+        uint32_t Rdn = BIT(op, 7) << 3 | BITS(op, 0, 2);
+
+        if (Rm < 8 && Rdn < 8) {
+            thumb_jit_fallback(block, k);
+            return JIT_CHECK;
+        }
+        switch (opc) {
+            case 0:
+                jit_load_operand(X64_RAX, Rdn, pc);
+                if (Rm == REG_PC) {
+                    alu_ri(X64_ADD, X64_RAX, pc);
+                } else {
+                    alu_rm(X64_ADD, X64_RAX, guest(Rm));
+                }
+                break;
+            case 1:
+                jit_load_operand(X64_RAX, Rdn, pc);
+                if (Rm == REG_PC) {
+                    alu_ri(X64_CMP, X64_RAX, pc);
+                } else {
+                    alu_rm(X64_CMP, X64_RAX, guest(Rm));
+                }
+                jit_store_flags(PSR_N | PSR_Z | PSR_C | PSR_V, true);
+                return JIT_NEXT;
+            case 2:
+                jit_load_operand(X64_RAX, Rm, pc);
+                break;
+            default:
+                assert(false);
+                break;
+        }
+        if (Rdn == REG_PC) {
+            alu_ri(X64_AND, X64_RAX, ~1);
+            thumb_jit_branch();
+            return JIT_END;
+        }
+        mov_mr(guest(Rdn), X64_RAX);
+        return JIT_NEXT;
+    }
+
+    if (f == thumb_branch_and_exchange) {
+        uint32_t Rm = BITS(op, 3, 6);
+
+        if (BIT(op, 7) || BITS(op, 0, 2) != 0) {
+            thumb_jit_fallback(block, k);
+            return JIT_CHECK;
+        }
+        jit_load_operand(X64_RAX, Rm, pc);
+        test_ri8(X64_RAX, 1);
+        uint8_t *arm = jcc_forward(X64_CC_E);
+        alu_ri(X64_AND, X64_RAX, ~1);
+        thumb_jit_branch();
+        bind(arm);
+        alu_mi(X64_AND, mem_context(&gba->cpsr), ~PSR_T);
+        alu_ri(X64_AND, X64_RAX, ~3);
+        jmp(jit_branch_arm);
+        return JIT_END;
+    }
+
+    if (f == thumb_load_from_literal_pool) {
+        uint32_t Rd = BITS(op, 8, 10);
+        uint32_t imm = BITS(op, 0, 7);
+
+        thumb_jit_sync(block, k);
+        mov_ri(X64_RAX, (pc & ~3) + (imm << 2));
+        jit_load(LOAD_WORD_ALIGNED, Rd);
+        return JIT_CHECK;
+    }
+
+    if (f == thumb_load_store_register) {
+        uint32_t opc = BITS(op, 9, 11);
+        uint32_t Rm = BITS(op, 6, 8);
+        uint32_t Rn = BITS(op, 3, 5);
+        uint32_t Rd = BITS(op, 0, 2);
+
+        thumb_jit_sync(block, k);
+        mov_rm(X64_RAX, guest(Rn));
+        alu_rm(X64_ADD, X64_RAX, guest(Rm));
+        switch (opc) {
+            case 0: thumb_jit_store(4, Rd); break;
+            case 1: thumb_jit_store(2, Rd); break;
+            case 2: thumb_jit_store(1, Rd); break;
+            case 3: jit_load(LOAD_SIGNED_BYTE, Rd); break;
+            case 4: jit_load(LOAD_WORD, Rd); break;
+            case 5: jit_load(LOAD_HALFWORD, Rd); break;
+            case 6: jit_load(LOAD_BYTE, Rd); break;
+            case 7: jit_load(LOAD_SIGNED_HALF, Rd); break;
+            default: assert(false); break;
+        }
+        return JIT_CHECK;
+    }
+
+    if (f == thumb_load_store_word_or_byte_immediate || f == thumb_load_store_halfword_immediate) {
+        bool L = BIT(op, 11);
+        uint32_t imm = BITS(op, 6, 10);
+        uint32_t Rn = BITS(op, 3, 5);
+        uint32_t Rd = BITS(op, 0, 2);
+        uint32_t size = (f == thumb_load_store_halfword_immediate ? 2 : BIT(op, 12) ? 1 : 4);
+
+        thumb_jit_sync(block, k);
+        mov_rm(X64_RAX, guest(Rn));
+        if (imm != 0) alu_ri(X64_ADD, X64_RAX, imm * size);
+        if (L) {
+            jit_load(size == 4 ? LOAD_WORD : size == 2 ? LOAD_HALFWORD : LOAD_BYTE, Rd);
+        } else {
+            thumb_jit_store(size, Rd);
+        }
+        return JIT_CHECK;
+    }
+
+    if (f == thumb_load_store_to_or_from_stack) {
+        bool L = BIT(op, 11);
+        uint32_t Rd = BITS(op, 8, 10);
+        uint32_t imm = BITS(op, 0, 7);
+
+        thumb_jit_sync(block, k);
+        mov_rm(X64_RAX, guest(REG_SP));
+        if (imm != 0) alu_ri(X64_ADD, X64_RAX, imm << 2);
+        if (L) {
+            jit_load(LOAD_WORD, Rd);
+        } else {
+            thumb_jit_store(4, Rd);
+        }
+        return JIT_CHECK;
+    }
+
+    if (f == thumb_add_to_sp_or_pc) {
+        bool SP = BIT(op, 11);
+        uint32_t Rd = BITS(op, 8, 10);
+        uint32_t imm = BITS(op, 0, 7);
+
+        if (SP) {
+            mov_rm(X64_RAX, guest(REG_SP));
+            if (imm != 0) alu_ri(X64_ADD, X64_RAX, imm << 2);
+            mov_mr(guest(Rd), X64_RAX);
+        } else {
+            mov_mi(guest(Rd), (pc & ~3) + (imm << 2));
+        }
+        return JIT_NEXT;
+    }
+
+    if (f == thumb_adjust_stack_pointer) {
+        uint32_t imm = BITS(op, 0, 6);
+
+        if ((BITS(op, 8, 11) & 0xb) != 0) {
+            thumb_jit_fallback(block, k);
+            return JIT_CHECK;
+        }
+        alu_mi(BIT(op, 7) ? X64_SUB : X64_ADD, guest(REG_SP), imm << 2);
+        return JIT_NEXT;
+    }
+
+    if (f == thumb_push_or_pop_register_list || f == thumb_load_store_multiple) {
+        bool L = BIT(op, 11);
+        uint32_t rlist = BITS(op, 0, 7);
+        uint32_t Rn = BITS(op, 8, 10);
+        bool decrement = false;
+
+        if (f == thumb_push_or_pop_register_list) {
+            if (BIT(op, 9)) {
+                thumb_jit_fallback(block, k);
+                return JIT_CHECK;
+            }
+            if (BIT(op, 8)) rlist |= 1 << (L ? REG_PC : REG_LR);
+            Rn = REG_SP;
+            decrement = !L;
+        }
+        if (rlist == 0) {
+            thumb_jit_fallback(block, k);
+            return JIT_CHECK;
+        }
+
+        uint32_t bytes = 4 * std::popcount(rlist);
+        thumb_jit_sync(block, k);
+        mov_rm(X64_R14, guest(Rn));
+        mov_rr(X64_R13, X64_R14);
+        if (decrement) alu_ri(X64_SUB, X64_R13, bytes);
+        for (uint32_t i = 0; i < 16; i++) {
+            if (!BIT(rlist, i)) continue;
+            mov_rr(X64_RAX, X64_R13);
+            if (L) {
+                call(jit_read[2]);
+                if (i == REG_PC) {
+                    alu_ri(X64_AND, X64_RAX, ~1);
+                    mov_rr(X64_R15, X64_RAX);
+                } else {
+                    mov_mr(guest(i), X64_RAX);
+                }
+            } else {
+                if (i == Rn && std::countr_zero(rlist) != (int) Rn) {
+                    lea(X64_RDX, mem_base(X64_R14, bytes), false);  // Base stored after writeback
+                } else {
+                    mov_rm(X64_RDX, guest(i));
+                }
+                call(jit_write[2]);
+            }
+            alu_ri(X64_ADD, X64_R13, 4);
+        }
+        if (!L || !BIT(rlist, Rn)) {
+            alu_mi(decrement ? X64_SUB : X64_ADD, guest(Rn), bytes);
+        }
+        if (BIT(rlist, REG_PC)) {
+            mov_rr(X64_RAX, X64_R15);
+            thumb_jit_branch();
+            return JIT_END;
+        }
+        return JIT_CHECK;
+    }
+
+    if (f == thumb_conditional_branch) {
+        uint32_t cond = BITS(op, 8, 11);
+        uint32_t imm = BITS(op, 0, 7);
+        SIGN_EXTEND(imm, 7);
+
+        uint8_t *skip = (cond != COND_AL ? jit_jump_if(cond ^ 1) : nullptr);
+        mov_ri(X64_RAX, pc + (imm << 1));
+        thumb_jit_branch();
+        if (skip == nullptr) return JIT_END;
+        bind(skip);
+        return JIT_NEXT;
+    }
+
+    if (f == thumb_unconditional_branch) {
+        uint32_t imm = BITS(op, 0, 10);
+        SIGN_EXTEND(imm, 10);
+
+        mov_ri(X64_RAX, pc + (imm << 1));
+        thumb_jit_branch();
+        return JIT_END;
+    }
+
+    if (f == thumb_branch_with_link_prefix) {
+        uint32_t imm = BITS(op, 0, 10);
+        SIGN_EXTEND(imm, 10);
+
+        mov_mi(guest(REG_LR), pc + (imm << 12));
+        return JIT_NEXT;
+    }
+
+    if (f == thumb_branch_with_link_suffix) {
+        uint32_t imm = BITS(op, 0, 10);
+
+        mov_rm(X64_RAX, guest(REG_LR));
+        alu_ri(X64_ADD, X64_RAX, imm << 1);
+        mov_mi(guest(REG_LR), (pc - 2) | 1);
+        thumb_jit_branch();
+        return JIT_END;
+    }
+
+    // Software interrupts and undefined instructions
+    thumb_jit_fallback(block, k);
+    return JIT_CHECK;
+}
+
+// Makes the program counter and prefetched opcode visible to slow memory accesses made by instruction k
+static void arm_jit_sync(const cpu_block *block, uint32_t k) {
+    uint32_t address = block->tag + 4 * k;
+    mov_mi(guest(REG_PC), address + 8);
+    mov_mi(mem_context(&gba->arm_pipeline[1]), block_fetch(block, k + 2));
+}
+
+// Calls a handler that only touches registers
+static void arm_jit_call(const cpu_block *block, uint32_t k) {
+    const cpu_block_instr &instr = block->instrs[k];
+    mov_mi(guest(REG_PC), block->tag + 4 * k + 8);
+    mov_ri(X64_ARG0, instr.op);
+    call(jit_function(instr.handler.arm));
+}
+
+// Runs instruction k through the interpreter with the full CPU state in place
+static void arm_jit_fallback(const cpu_block *block, uint32_t k) {
+    const cpu_block_instr &instr = block->instrs[k];
+    arm_jit_sync(block, k);
+    mov_mi(mem_context(&gba->arm_op), instr.op);
+    mov_mi(mem_context(&gba->arm_pipeline[0]), block_fetch(block, k + 1));
+    jit_store_cycles();
+    mov_ri(X64_ARG0, instr.op);
+    call(jit_function(instr.handler.arm));
+    jit_load_cycles();
+    mov_ri(X64_R12, 1);
+    cmp_mi8(mem_context(&gba->branch_taken), 0);
+    jcc(X64_CC_NE, jit_exit);
+}
+
+// Applies op to dst with r[Rn] as the second operand
+static void arm_jit_alu_operand(int op, int dst, uint32_t Rn, uint32_t pc) {
+    if (Rn == REG_PC) {
+        alu_ri(op, dst, pc);
+    } else {
+        alu_rm(op, dst, guest(Rn));
+    }
+}
+
+// Puts r[Rm] shifted by an immediate in ecx, copying the shifter carry out to the CPSR if asked;
+// returns false for LSR #32, ASR #32 and RRX, which are left to the handler
+static bool arm_jit_shift_by_immediate(uint32_t Rm, uint32_t shop, uint32_t shamt, uint32_t pc, bool carry) {
+    if (shamt == 0 && shop != SHIFT_LSL) return false;
+    jit_load_operand(X64_RCX, Rm, pc);
+    if (shamt != 0) {
+        const int ops[] = {X64_SHL, X64_SHR, X64_SAR, X64_ROR};
+        shift_ri(ops[shop], X64_RCX, shamt);
+        if (carry) jit_store_flags(PSR_C, false);
+    }
+    return true;
+}
+
+static int arm_jit_data_processing(const cpu_block *block, uint32_t k) {
+    const cpu_block_instr &instr = block->instrs[k];
+    uint32_t op = instr.op;
+    uint32_t opc = BITS(op, 21, 24);
+    bool S = BIT(op, 20);
+    uint32_t Rn = BITS(op, 16, 19);
+    uint32_t Rd = BITS(op, 12, 15);
+    uint32_t pc = block->tag + 4 * k + 8;
+
+    bool is_test_or_compare = (opc == ARM_TST || opc == ARM_TEQ || opc == ARM_CMP || opc == ARM_CMN);
+    bool is_logical = (opc == ARM_AND || opc == ARM_EOR || opc == ARM_TST || opc == ARM_TEQ || opc == ARM_ORR || opc == ARM_MOV ||
+                       opc == ARM_BIC || opc == ARM_MVN);
+
+    // Writing the PC with S set restores the CPSR
+    if (Rd == REG_PC && S) {
+        arm_jit_fallback(block, k);
+        return JIT_CHECK;
+    }
+
+    if (instr.handler.arm == arm_data_processing_immediate) {
+        uint32_t rot = BITS(op, 8, 11);
+        uint32_t imm = ROR(BITS(op, 0, 7), 2 * rot);
+
+        mov_ri(X64_RCX, imm);
+        if (S && is_logical && rot > 0) {
+            if (BIT(imm, 31)) {
+                alu_mi(X64_OR, mem_context(&gba->cpsr), PSR_C);
+            } else {
+                alu_mi(X64_AND, mem_context(&gba->cpsr), ~PSR_C);
+            }
+        }
+    } else if (BIT(op, 4) || !arm_jit_shift_by_immediate(BITS(op, 0, 3), BITS(op, 5, 6), BITS(op, 7, 11), pc, S && is_logical)) {
+        // Shifts by register, and the shifts that take the carry in
+        if (Rd == REG_PC) {
+            arm_jit_fallback(block, k);
+            return JIT_CHECK;
+        }
+        arm_jit_call(block, k);
+        return JIT_NEXT;
+    }
+
+    bool inverted_carry = false;
+    switch (opc) {
+        case ARM_AND:
+        case ARM_TST:
+            jit_load_operand(X64_RAX, Rn, pc);
+            alu_rr(X64_AND, X64_RAX, X64_RCX);
+            break;
+        case ARM_EOR:
+        case ARM_TEQ:
+            jit_load_operand(X64_RAX, Rn, pc);
+            alu_rr(X64_XOR, X64_RAX, X64_RCX);
+            break;
+        case ARM_ORR:
+            jit_load_operand(X64_RAX, Rn, pc);
+            alu_rr(X64_OR, X64_RAX, X64_RCX);
+            break;
+        case ARM_BIC:
+            not_r(X64_RCX);
+            jit_load_operand(X64_RAX, Rn, pc);
+            alu_rr(X64_AND, X64_RAX, X64_RCX);
+            break;
+        case ARM_MOV:
+            mov_rr(X64_RAX, X64_RCX);
+            if (S) test_rr(X64_RAX, X64_RAX);
+            break;
+        case ARM_MVN:
+            mov_rr(X64_RAX, X64_RCX);
+            not_r(X64_RAX);
+            if (S) test_rr(X64_RAX, X64_RAX);
+            break;
+        case ARM_ADD:
+        case ARM_CMN:
+            jit_load_operand(X64_RAX, Rn, pc);
+            alu_rr(X64_ADD, X64_RAX, X64_RCX);
+            break;
+        case ARM_ADC:
+            jit_load_operand(X64_RAX, Rn, pc);
+            bt_mi(mem_context(&gba->cpsr), 29);
+            alu_rr(X64_ADC, X64_RAX, X64_RCX);
+            break;
+        case ARM_SUB:
+        case ARM_CMP:
+            jit_load_operand(X64_RAX, Rn, pc);
+            alu_rr(X64_SUB, X64_RAX, X64_RCX);
+            inverted_carry = true;
+            break;
+        case ARM_SBC:
+            jit_load_operand(X64_RAX, Rn, pc);
+            bt_mi(mem_context(&gba->cpsr), 29);
+            emit8(0xf5);  // cmc
+            alu_rr(X64_SBB, X64_RAX, X64_RCX);
+            inverted_carry = true;
+            break;
+        case ARM_RSB:
+            mov_rr(X64_RAX, X64_RCX);
+            arm_jit_alu_operand(X64_SUB, X64_RAX, Rn, pc);
+            inverted_carry = true;
+            break;
+        case ARM_RSC:
+            mov_rr(X64_RAX, X64_RCX);
+            bt_mi(mem_context(&gba->cpsr), 29);
+            emit8(0xf5);  // cmc
+            arm_jit_alu_operand(X64_SBB, X64_RAX, Rn, pc);
+            inverted_carry = true;
+            break;
+        default:
+            assert(false);
+            break;
+    }
+
+    if (!is_test_or_compare) {
+        if (Rd == REG_PC) {
+            alu_ri(X64_AND, X64_RAX, ~1);
+            jmp(jit_branch_arm);
+            return JIT_END;
+        }
+        mov_mr(guest(Rd), X64_RAX);
+    }
+    if (S) jit_store_flags(is_logical ? PSR_N | PSR_Z : PSR_N | PSR_Z | PSR_C | PSR_V, inverted_carry);
+    return JIT_NEXT;
+}
+
+// Word, byte, halfword and signed loads and stores with a single register
+static int arm_jit_load_store(const cpu_block *block, uint32_t k) {
+    const cpu_block_instr &instr = block->instrs[k];
+    void (*f)(uint32_t) = instr.handler.arm;
+    uint32_t op = instr.op;
+    bool P = BIT(op, 24);
+    bool U = BIT(op, 23);
+    bool W = BIT(op, 21);
+    bool L = BIT(op, 20);
+    uint32_t Rn = BITS(op, 16, 19);
+    uint32_t Rd = BITS(op, 12, 15);
+    uint32_t Rm = BITS(op, 0, 3);
+    uint32_t pc = block->tag + 4 * k + 8;
+    bool writeback = (!P || W) && (!L || Rd != Rn);
+
+    bool word_or_byte = (f == arm_load_store_word_or_byte_immediate || f == arm_load_store_word_or_byte_register);
+    bool offset_register = (f == arm_load_store_word_or_byte_register || f == arm_load_store_halfword_register ||
+                            f == arm_load_signed_halfword_or_signed_byte_register);
+    uint32_t offset = (word_or_byte ? BITS(op, 0, 11) : BITS(op, 8, 11) << 4 | BITS(op, 0, 3));
+    uint32_t shamt = BITS(op, 7, 11);
+    uint32_t shop = BITS(op, 5, 6);
+
+    uint32_t size = 4;
+    uint32_t kind = LOAD_WORD;
+    if (word_or_byte) {
+        if (BIT(op, 22)) {
+            size = 1;
+            kind = LOAD_BYTE;
+        }
+    } else if (f == arm_load_store_halfword_immediate || f == arm_load_store_halfword_register) {
+        size = 2;
+        kind = LOAD_HALFWORD;
+    } else {
+        kind = (BIT(op, 5) ? LOAD_SIGNED_HALF : LOAD_SIGNED_BYTE);
+    }
+
+    // User mode transfers, writeback to the PC, and offsets that need the carry
+    bool shifted_carry = (f == arm_load_store_word_or_byte_register && shamt == 0 && shop != SHIFT_LSL);
+    if ((!P && W) || (Rn == REG_PC && writeback) || shifted_carry) {
+        arm_jit_fallback(block, k);
+        return JIT_CHECK;
+    }
+
+    arm_jit_sync(block, k);
+    // The stored value is read before the writeback, which happens ahead of the access
+    if (!L) jit_load_operand(X64_RDX, Rd, pc + 4);
+    if (f == arm_load_store_word_or_byte_register) {
+        arm_jit_shift_by_immediate(Rm, shop, shamt, pc, false);
+    } else if (offset_register) {
+        jit_load_operand(X64_RCX, Rm, pc);
+    }
+    jit_load_operand(X64_RAX, Rn, pc);
+
+    int add = (U ? X64_ADD : X64_SUB);
+    int target = (P ? X64_RAX : X64_R8);
+    if (!P && writeback) mov_rr(X64_R8, X64_RAX);
+    if (P || writeback) {
+        if (offset_register) {
+            alu_rr(add, target, X64_RCX);
+        } else if (offset != 0) {
+            alu_ri(add, target, offset);
+        }
+    }
+    if (writeback) mov_mr(guest(Rn), target);
+
+    if (L) {
+        jit_load(kind, Rd);
+        if (Rd == REG_PC) {
+            jmp(jit_branch_arm);
+            return JIT_END;
+        }
+    } else {
+        call(jit_write[size == 4 ? 2 : size == 2 ? 1 : 0]);
+    }
+    return JIT_CHECK;
+}
+
+static int arm_jit_load_store_multiple(const cpu_block *block, uint32_t k) {
+    uint32_t op = block->instrs[k].op;
+    bool P = BIT(op, 24);
+    bool U = BIT(op, 23);
+    bool S = BIT(op, 22);
+    bool W = BIT(op, 21);
+    bool L = BIT(op, 20);
+    uint32_t Rn = BITS(op, 16, 19);
+    uint32_t rlist = BITS(op, 0, 15);
+    uint32_t pc = block->tag + 4 * k + 8;
+
+    // User bank transfers and empty lists
+    if (S || Rn == REG_PC || rlist == 0) {
+        arm_jit_fallback(block, k);
+        return JIT_CHECK;
+    }
+
+    uint32_t bytes = 4 * std::popcount(rlist);
+    arm_jit_sync(block, k);
+    mov_rm(X64_R14, guest(Rn));
+    mov_rr(X64_R13, X64_R14);
+    if (!U) alu_ri(X64_SUB, X64_R13, bytes);
+    if (U == P) alu_ri(X64_ADD, X64_R13, 4);
+    for (uint32_t i = 0; i < 16; i++) {
+        if (!BIT(rlist, i)) continue;
+        mov_rr(X64_RAX, X64_R13);
+        if (L) {
+            call(jit_read[2]);
+            if (i == REG_PC) {
+                alu_ri(X64_AND, X64_RAX, ~1);
+                mov_rr(X64_R15, X64_RAX);
+            } else {
+                mov_mr(guest(i), X64_RAX);
+            }
+        } else {
+            if (i == REG_PC) {
+                mov_ri(X64_RDX, pc + 4);
+            } else if (i == Rn && std::countr_zero(rlist) != (int) Rn) {
+                lea(X64_RDX, mem_base(X64_R14, U ? bytes : -bytes), false);  // Base stored after writeback
+            } else {
+                mov_rm(X64_RDX, guest(i));
+            }
+            call(jit_write[2]);
+        }
+        alu_ri(X64_ADD, X64_R13, 4);
+    }
+    if (W && (!L || !BIT(rlist, Rn))) {
+        alu_mi(U ? X64_ADD : X64_SUB, guest(Rn), bytes);
+    }
+    if (L && BIT(rlist, REG_PC)) {
+        mov_rr(X64_RAX, X64_R15);
+        jmp(jit_branch_arm);
+        return JIT_END;
+    }
+    return JIT_CHECK;
+}
+
+static int arm_jit_multiply(const cpu_block *block, uint32_t k) {
+    const cpu_block_instr &instr = block->instrs[k];
+    uint32_t op = instr.op;
+    bool A = BIT(op, 21);
+    bool S = BIT(op, 20);
+    uint32_t Rd = BITS(op, 16, 19);
+    uint32_t Rn = BITS(op, 12, 15);
+    uint32_t Rs = BITS(op, 8, 11);
+    uint32_t Rm = BITS(op, 0, 3);
+
+    if (Rd == REG_PC || Rn == REG_PC || Rs == REG_PC || Rm == REG_PC) {
+        arm_jit_call(block, k);
+        return JIT_NEXT;
+    }
+
+    if (instr.handler.arm == arm_multiply) {
+        mov_rm(X64_RAX, guest(Rm));
+        imul_rm(X64_RAX, guest(Rs));
+        if (A) alu_rm(X64_ADD, X64_RAX, guest(Rn));
+        mov_mr(guest(Rd), X64_RAX);
+    } else {
+        // The low 64 bits of the product are the same for signed and unsigned 64-bit multiplies
+        if (BIT(op, 22)) {
+            movsxd_rm(X64_RAX, guest(Rm));
+            movsxd_rm(X64_RCX, guest(Rs));
+        } else {
+            mov_rm(X64_RAX, guest(Rm));
+            mov_rm(X64_RCX, guest(Rs));
+        }
+        imul_rr(X64_RAX, X64_RCX, true);
+        if (A) {
+            mov_rm(X64_RCX, guest(Rd));
+            shift_ri(X64_SHL, X64_RCX, 32, true);
+            mov_rm(X64_RDX, guest(Rn));
+            alu_rr(X64_OR, X64_RCX, X64_RDX, true);
+            alu_rr(X64_ADD, X64_RAX, X64_RCX, true);
+        }
+        mov_rr(X64_RCX, X64_RAX, true);
+        mov_mr(guest(Rn), X64_RCX);  // RdLo is written first
+        shift_ri(X64_SHR, X64_RCX, 32, true);
+        mov_mr(guest(Rd), X64_RCX);
+    }
+    if (S) {
+        test_rr(X64_RAX, X64_RAX, instr.handler.arm == arm_multiply_long);
+        jit_store_flags(PSR_N | PSR_Z, false);
+    }
+    return JIT_NEXT;
+}
+
+static int arm_jit_branch_and_exchange(const cpu_block *block, uint32_t k) {
+    uint32_t op = block->instrs[k].op;
+    uint32_t Rm = BITS(op, 0, 3);
+    uint32_t pc = block->tag + 4 * k + 8;
+
+    if (BITS(op, 8, 19) != 0xfff) {
+        arm_jit_fallback(block, k);
+        return JIT_CHECK;
+    }
+    jit_load_operand(X64_RAX, Rm, pc);
+    test_ri8(X64_RAX, 1);
+    uint8_t *arm = jcc_forward(X64_CC_E);
+    alu_mi(X64_OR, mem_context(&gba->cpsr), PSR_T);
+    alu_ri(X64_AND, X64_RAX, ~1);
+    jmp(jit_branch_thumb);
+    bind(arm);
+    alu_ri(X64_AND, X64_RAX, ~3);
+    jmp(jit_branch_arm);
+    return JIT_END;
+}
+
+// Returns how control leaves the code for instruction k, which runs unconditionally
+static int arm_jit_unconditional(const cpu_block *block, uint32_t k) {
+    const cpu_block_instr &instr = block->instrs[k];
+    void (*f)(uint32_t) = instr.handler.arm;
+    uint32_t op = instr.op;
+    uint32_t pc = block->tag + 4 * k + 8;
+
+    if (f == arm_data_processing_register || f == arm_data_processing_immediate) {
+        return arm_jit_data_processing(block, k);
+    }
+
+    if (f == arm_load_store_word_or_byte_immediate || f == arm_load_store_word_or_byte_register || f == arm_load_store_halfword_immediate ||
+        f == arm_load_store_halfword_register || f == arm_load_signed_halfword_or_signed_byte_immediate ||
+        f == arm_load_signed_halfword_or_signed_byte_register) {
+        return arm_jit_load_store(block, k);
+    }
+
+    if (f == arm_load_store_multiple) {
+        return arm_jit_load_store_multiple(block, k);
+    }
+
+    if (f == arm_multiply || f == arm_multiply_long) {
+        return arm_jit_multiply(block, k);
+    }
+
+    if (f == arm_branch) {
+        uint32_t imm = BITS(op, 0, 23);
+        SIGN_EXTEND(imm, 23);
+
+        if (BIT(op, 24)) mov_mi(guest(REG_LR), pc - 4);
+        mov_ri(X64_RAX, pc + (imm << 2));
+        jmp(jit_branch_arm);
+        return JIT_END;
+    }
+
+    if (f == arm_branch_and_exchange) {
+        return arm_jit_branch_and_exchange(block, k);
+    }
+
+    // PSR transfers, swaps, software interrupts, coprocessor and undefined instructions
+    arm_jit_fallback(block, k);
+    return JIT_CHECK;
+}
+
+// Conditions are tested against the CPSR, and a failed one skips over the instruction
+static int arm_jit_instr(const cpu_block *block, uint32_t k) {
+    uint32_t cond = BITS(block->instrs[k].op, 28, 31);
+    if (cond == COND_NV) return JIT_NEXT;
+    if (cond == COND_AL) return arm_jit_unconditional(block, k);
+
+    uint8_t *skip = jit_jump_if(cond ^ 1);
+    int result = arm_jit_unconditional(block, k);
+    bind(skip);
+    return (result == JIT_END ? JIT_NEXT : result);
+}
+
+// Sets the program counter and pipeline as the interpreter has them before instruction j, with the last
+// pipeline stage holding the instruction after it, as it does until the fetch
+static void jit_store_pipeline(const cpu_block *block, uint32_t j) {
+    uint32_t op = block_fetch(block, j);
+    uint32_t next = block_fetch(block, j + 1);
+    mov_mi(guest(REG_PC), (block->tag & ~1) + block->size * (j + 2));
+    if (block->tag & 1) {
+        mov_mi16(mem_context(&gba->thumb_op), op);
+        mov_mi16(mem_context(&gba->thumb_pipeline[0]), next);
+        mov_mi16(mem_context(&gba->thumb_pipeline[1]), next);
+    } else {
+        mov_mi(mem_context(&gba->arm_op), op);
+        mov_mi(mem_context(&gba->arm_pipeline[0]), next);
+        mov_mi(mem_context(&gba->arm_pipeline[1]), next);
+    }
+}
+
+static const uint8_t *jit_compile(const cpu_block *block) {
+    if (jit_buffer + JIT_BUFFER_SIZE - jit_ptr < JIT_BLOCK_SPACE) {
+        // Start over once the buffer fills up; the blocks are compiled again as they are reached
+        cpu_cache_flush();
+        jit_ptr = jit_code_start;
+        return nullptr;
+    }
+    // Only the pages being emitted into are writable, and only until the block is finished
+    if (!jit_protect(jit_ptr, JIT_BLOCK_SPACE, true)) {
+        jit_fail("the code buffer can't be made writable");
+        return nullptr;
+    }
+
+    const uint8_t *code = jit_ptr;
+    bool thumb = (block->tag & 1);
+    for (auto &patches : jit_exit_patches) patches.clear();
+    jit_tick_patches.clear();
+
+    uint32_t k = 0;
+    int result = JIT_NEXT;
+    for (; k < block->length; k++) {
+        result = (thumb ? thumb_jit_instr(block, k) : arm_jit_instr(block, k));
+        if (result == JIT_END) break;
+
+        alu_ri(X64_SUB, X64_RBP, block->instrs[k].fetch_cycles, true);
+        jit_tick_patches.emplace_back(jcc_forward(X64_CC_BE), k);
+        if (result == JIT_CHECK) {
+            test_rr(X64_R12, X64_R12);
+            jit_exit_patches[k + 1].push_back(jcc_forward(X64_CC_NE));
+        }
+    }
+    if (result != JIT_END) jit_exit_patches[block->length].push_back(jmp_forward());
+
+    // The fetch that reaches the next event is left to the scheduler, with the pipeline as the interpreter has it
+    for (const auto &[patch, i] : jit_tick_patches) {
+        uint32_t cycles = block->instrs[i].fetch_cycles;
+        bind(patch);
+        alu_ri(X64_ADD, X64_RBP, cycles, true);
+        jit_store_pipeline(block, i + 1);
+        jit_store_cycles();
+        mov_ri(X64_ARG0, cycles);
+        call(jit_function(jit_tick));
+        jit_load_cycles();
+        jit_exit_patches[i + 1].push_back(jmp_forward());
+    }
+
+    // Leaving before the instruction at index j, whose last pipeline stage is refreshed by jit_run
+    for (uint32_t j = 0; j <= block->length; j++) {
+        if (jit_exit_patches[j].empty()) continue;
+        for (uint8_t *patch : jit_exit_patches[j]) bind(patch);
+        jit_store_pipeline(block, j);
+        jmp(jit_exit);
+    }
+
+    assert(jit_ptr - code < JIT_BLOCK_SPACE);
+    if (!jit_protect((uint8_t *) code, JIT_BLOCK_SPACE, false)) {
+        jit_fail("the code buffer can't be made executable");
+        return nullptr;
+    }
+    return code;
+}
+
+// Returns the compiled block for the current instruction, or nullptr if the interpreter should take this step
+static const cpu_block *jit_lookup(bool thumb) {
+    if (gba->single_step || !jit_init()) return nullptr;
+    // The frame loop gets control back after one instruction if the frame is done or an interrupt is pending
+    if (gba->video_frame_drawn) return nullptr;
+    if ((gba->ioreg.irq.w & gba->ioreg.ie.w) && !(gba->cpsr & PSR_I) && gba->ioreg.ime.w) return nullptr;
+
+    cpu_block *block = cpu_cache_lookup(thumb);
+    if (block == nullptr) return nullptr;
+    if (block->code == nullptr) {
+        if (++block->uses < JIT_BLOCK_USES) return nullptr;
+        block->code = jit_compile(block);
+        if (block->code == nullptr) return nullptr;
+    }
+    return block;
+}
+
+static void jit_run(const cpu_block *block) {
+    jit_enter(block->code, gba);
+    // Blocks are chained across BX, so this may have left in the other state
+    if (gba->branch_taken) return;
+    if (FLAG_T()) {
+        gba->thumb_pipeline[1] = memory_peek_halfword(gba->r[REG_PC]);
+    } else {
+        gba->arm_pipeline[1] = memory_peek_word(gba->r[REG_PC]);
+    }
+}
+
+bool cpu_jit_supported() {
+    return jit_init();
+}
+
+// Hands the buffer over to the next instance that asks for it, dropping this one's compiled blocks
+void cpu_jit_release() {
+    if (jit_context.load(std::memory_order_acquire) != gba) return;
+    if (jit_ready) {
+        cpu_cache_flush();
+        jit_ptr = jit_code_start;
+    }
+    jit_context.store(nullptr, std::memory_order_release);
+}
+
+bool arm_jit_step() {
+    const cpu_block *block = jit_lookup(false);
+    if (block == nullptr) return false;
+    if (gba->arm_op != block->instrs[0].op || gba->arm_pipeline[0] != block->pipeline[0] || gba->arm_pipeline[1] != block->pipeline[1]) {
+        return false;
+    }
+    jit_run(block);
+    return true;
+}
+
+bool thumb_jit_step() {
+    const cpu_block *block = jit_lookup(true);
+    if (block == nullptr) return false;
+    if (gba->thumb_op != block->instrs[0].op || gba->thumb_pipeline[0] != block->pipeline[0] || gba->thumb_pipeline[1] != block->pipeline[1]) {
+        return false;
+    }
+    jit_run(block);
+    return true;
+}
+
+#endif
@@ -10,6 +10,7 @@
 
 #include <fmt/core.h>
 
+#include "context.h"
 #include "memory.h"
 
 void thumb_shift_by_immediate_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -40,14 +41,14 @@ void thumb_shift_by_immediate(uint16_t op) {
     uint32_t Rm = BITS(op, 3, 5);
     uint32_t Rd = BITS(op, 0, 2);
 
-    arm_op = COND_AL << 28 | ARM_MOV << 21 | 0x01 << 20 | Rd << 12 | imm << 7 | Rm;
+    gba->arm_op = COND_AL << 28 | ARM_MOV << 21 | 0x01 << 20 | Rd << 12 | imm << 7 | Rm;
     switch (opc) {
-        case SHIFT_LSL: arm_op |= SHIFT_LSL << 5; break;
-        case SHIFT_LSR: arm_op |= SHIFT_LSR << 5; break;
-        case SHIFT_ASR: arm_op |= SHIFT_ASR << 5; break;
+        case SHIFT_LSL: gba->arm_op |= SHIFT_LSL << 5; break;
+        case SHIFT_LSR: gba->arm_op |= SHIFT_LSR << 5; break;
+        case SHIFT_ASR: gba->arm_op |= SHIFT_ASR << 5; break;
         default: std::abort();
     }
-    arm_data_processing_register(arm_op);
+    arm_data_processing_register(gba->arm_op);
 }
 
 void thumb_add_or_subtract_register_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -77,13 +78,13 @@ void thumb_add_or_subtract_register(uint16_t op) {
     uint32_t Rn = BITS(op, 3, 5);
     uint32_t Rd = BITS(op, 0, 2);
 
-    arm_op = COND_AL << 28 | 0x01 << 20 | Rn << 16 | Rd << 12 | Rm;
+    gba->arm_op = COND_AL << 28 | 0x01 << 20 | Rn << 16 | Rd << 12 | Rm;
     switch (opc) {
-        case 0: arm_op |= ARM_ADD << 21; break;
-        case 1: arm_op |= ARM_SUB << 21; break;
+        case 0: gba->arm_op |= ARM_ADD << 21; break;
+        case 1: gba->arm_op |= ARM_SUB << 21; break;
         default: std::abort();
     }
-    arm_data_processing_register(arm_op);
+    arm_data_processing_register(gba->arm_op);
 }
 
 void thumb_add_or_subtract_immediate_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -113,13 +114,13 @@ void thumb_add_or_subtract_immediate(uint16_t op) {
     uint32_t Rn = BITS(op, 3, 5);
     uint32_t Rd = BITS(op, 0, 2);
 
-    arm_op = COND_AL << 28 | 0x21 << 20 | Rn << 16 | Rd << 12 | imm;
+    gba->arm_op = COND_AL << 28 | 0x21 << 20 | Rn << 16 | Rd << 12 | imm;
     switch (opc) {
-        case 0: arm_op |= ARM_ADD << 21; break;
-        case 1: arm_op |= ARM_SUB << 21; break;
+        case 0: gba->arm_op |= ARM_ADD << 21; break;
+        case 1: gba->arm_op |= ARM_SUB << 21; break;
         default: std::abort();
     }
-    arm_data_processing_immediate(arm_op);
+    arm_data_processing_immediate(gba->arm_op);
 }
 
 void thumb_add_subtract_compare_or_move_immediate_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -147,15 +148,15 @@ void thumb_add_subtract_compare_or_move_immediate(uint16_t op) {
     uint32_t Rdn = BITS(op, 8, 10);
     uint32_t imm = BITS(op, 0, 7);
 
-    arm_op = COND_AL << 28 | 0x21 << 20 | imm;
+    gba->arm_op = COND_AL << 28 | 0x21 << 20 | imm;
     switch (opc) {
-        case 0: arm_op |= ARM_MOV << 21 | Rdn << 12; break;
-        case 1: arm_op |= ARM_CMP << 21 | Rdn << 16; break;
-        case 2: arm_op |= ARM_ADD << 21 | Rdn << 16 | Rdn << 12; break;
-        case 3: arm_op |= ARM_SUB << 21 | Rdn << 16 | Rdn << 12; break;
+        case 0: gba->arm_op |= ARM_MOV << 21 | Rdn << 12; break;
+        case 1: gba->arm_op |= ARM_CMP << 21 | Rdn << 16; break;
+        case 2: gba->arm_op |= ARM_ADD << 21 | Rdn << 16 | Rdn << 12; break;
+        case 3: gba->arm_op |= ARM_SUB << 21 | Rdn << 16 | Rdn << 12; break;
         default: std::abort();
     }
-    arm_data_processing_immediate(arm_op);
+    arm_data_processing_immediate(gba->arm_op);
 }
 
 void thumb_data_processing_register_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -195,32 +196,32 @@ void thumb_data_processing_register(uint16_t op) {
     uint32_t Rms = BITS(op, 3, 5);
     uint32_t Rdn = BITS(op, 0, 2);
 
-    arm_op = COND_AL << 28 | 0x01 << 20;
+    gba->arm_op = COND_AL << 28 | 0x01 << 20;
     switch (opc) {
-        case THUMB_AND: arm_op |= ARM_AND << 21 | Rdn << 16 | Rdn << 12 | Rms; break;
-        case THUMB_EOR: arm_op |= ARM_EOR << 21 | Rdn << 16 | Rdn << 12 | Rms; break;
-        case THUMB_LSL: arm_op |= ARM_MOV << 21 | Rdn << 12 | Rms << 8 | SHIFT_LSL << 5 | 0x1 << 4 | Rdn; break;
-        case THUMB_LSR: arm_op |= ARM_MOV << 21 | Rdn << 12 | Rms << 8 | SHIFT_LSR << 5 | 0x1 << 4 | Rdn; break;
-        case THUMB_ASR: arm_op |= ARM_MOV << 21 | Rdn << 12 | Rms << 8 | SHIFT_ASR << 5 | 0x1 << 4 | Rdn; break;
-        case THUMB_ADC: arm_op |= ARM_ADC << 21 | Rdn << 16 | Rdn << 12 | Rms; break;
-        case THUMB_SBC: arm_op |= ARM_SBC << 21 | Rdn << 16 | Rdn << 12 | Rms; break;
-        case THUMB_ROR: arm_op |= ARM_MOV << 21 | Rdn << 12 | Rms << 8 | SHIFT_ROR << 5 | 0x1 << 4 | Rdn; break;
-        case THUMB_TST: arm_op |= ARM_TST << 21 | Rdn << 16 | Rms; break;
-        case THUMB_NEG: arm_op |= ARM_RSB << 21 | 0x20 << 20 | Rms << 16 | Rdn << 12; break;
-        case THUMB_CMP: arm_op |= ARM_CMP << 21 | Rdn << 16 | Rms; break;
-        case THUMB_CMN: arm_op |= ARM_CMN << 21 | Rdn << 16 | Rms; break;
-        case THUMB_ORR: arm_op |= ARM_ORR << 21 | Rdn << 16 | Rdn << 12 | Rms; break;
-        case THUMB_MUL: arm_op |= Rdn << 16 | Rdn << 8 | 0x9 << 4 | Rms; break;
-        case THUMB_BIC: arm_op |= ARM_BIC << 21 | Rdn << 16 | Rdn << 12 | Rms; break;
-        case THUMB_MVN: arm_op |= ARM_MVN << 21 | Rdn << 12 | Rms; break;
+        case THUMB_AND: gba->arm_op |= ARM_AND << 21 | Rdn << 16 | Rdn << 12 | Rms; break;
+        case THUMB_EOR: gba->arm_op |= ARM_EOR << 21 | Rdn << 16 | Rdn << 12 | Rms; break;
+        case THUMB_LSL: gba->arm_op |= ARM_MOV << 21 | Rdn << 12 | Rms << 8 | SHIFT_LSL << 5 | 0x1 << 4 | Rdn; break;
+        case THUMB_LSR: gba->arm_op |= ARM_MOV << 21 | Rdn << 12 | Rms << 8 | SHIFT_LSR << 5 | 0x1 << 4 | Rdn; break;
+        case THUMB_ASR: gba->arm_op |= ARM_MOV << 21 | Rdn << 12 | Rms << 8 | SHIFT_ASR << 5 | 0x1 << 4 | Rdn; break;
+        case THUMB_ADC: gba->arm_op |= ARM_ADC << 21 | Rdn << 16 | Rdn << 12 | Rms; break;
+        case THUMB_SBC: gba->arm_op |= ARM_SBC << 21 | Rdn << 16 | Rdn << 12 | Rms; break;
+        case THUMB_ROR: gba->arm_op |= ARM_MOV << 21 | Rdn << 12 | Rms << 8 | SHIFT_ROR << 5 | 0x1 << 4 | Rdn; break;
+        case THUMB_TST: gba->arm_op |= ARM_TST << 21 | Rdn << 16 | Rms; break;
+        case THUMB_NEG: gba->arm_op |= ARM_RSB << 21 | 0x20 << 20 | Rms << 16 | Rdn << 12; break;
+        case THUMB_CMP: gba->arm_op |= ARM_CMP << 21 | Rdn << 16 | Rms; break;
+        case THUMB_CMN: gba->arm_op |= ARM_CMN << 21 | Rdn << 16 | Rms; break;
+        case THUMB_ORR: gba->arm_op |= ARM_ORR << 21 | Rdn << 16 | Rdn << 12 | Rms; break;
+        case THUMB_MUL: gba->arm_op |= Rdn << 16 | Rdn << 8 | 0x9 << 4 | Rms; break;
+        case THUMB_BIC: gba->arm_op |= ARM_BIC << 21 | Rdn << 16 | Rdn << 12 | Rms; break;
+        case THUMB_MVN: gba->arm_op |= ARM_MVN << 21 | Rdn << 12 | Rms; break;
         default: std::abort();
     }
     if (opc == THUMB_MUL) {
-        arm_multiply(arm_op);
+        arm_multiply(gba->arm_op);
     } else if (opc == THUMB_NEG) {
-        arm_data_processing_immediate(arm_op);
+        arm_data_processing_immediate(gba->arm_op);
     } else {
-        arm_data_processing_register(arm_op);
+        arm_data_processing_register(gba->arm_op);
     }
 }
 
@@ -250,14 +251,14 @@ void thumb_special_data_processing(uint16_t op) {
 
     assert(!(Rm < 8 && Rdn < 8));  // unpredictable
 
-    arm_op = COND_AL << 28 | Rm;
+    gba->arm_op = COND_AL << 28 | Rm;
     switch (opc) {
-        case 0: arm_op |= ARM_ADD << 21 | Rdn << 16 | Rdn << 12; break;
-        case 1: arm_op |= ARM_CMP << 21 | 0x01 << 20 | Rdn << 16; break;
-        case 2: arm_op |= ARM_MOV << 21 | Rdn << 12; break;
+        case 0: gba->arm_op |= ARM_ADD << 21 | Rdn << 16 | Rdn << 12; break;
+        case 1: gba->arm_op |= ARM_CMP << 21 | 0x01 << 20 | Rdn << 16; break;
+        case 2: gba->arm_op |= ARM_MOV << 21 | Rdn << 12; break;
         default: std::abort();
     }
-    arm_data_processing_register(arm_op);
+    arm_data_processing_register(gba->arm_op);
 }
 
 void thumb_branch_and_exchange_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -279,8 +280,8 @@ void thumb_branch_and_exchange(uint16_t op) {
     assert(!L);        // unpredictable
     assert(sbz == 0);  // should be zero
 
-    arm_op = COND_AL << 28 | 0x12 << 20 | 0xfff << 8 | 0x1 << 4 | Rm;
-    arm_branch_and_exchange(arm_op);
+    gba->arm_op = COND_AL << 28 | 0x12 << 20 | 0xfff << 8 | 0x1 << 4 | Rm;
+    arm_branch_and_exchange(gba->arm_op);
 }
 
 void thumb_load_from_literal_pool_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -301,8 +302,8 @@ void thumb_load_from_literal_pool(uint16_t op) {
     uint32_t Rd = BITS(op, 8, 10);
     uint32_t imm = BITS(op, 0, 7);
 
-    arm_op = COND_AL << 28 | 0x59 << 20 | REG_PC << 16 | Rd << 12 | imm << 2;
-    arm_load_store_word_or_byte_immediate(arm_op);
+    gba->arm_op = COND_AL << 28 | 0x59 << 20 | REG_PC << 16 | Rd << 12 | imm << 2;
+    arm_load_store_word_or_byte_immediate(gba->arm_op);
 }
 
 void thumb_load_store_register_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -339,24 +340,24 @@ void thumb_load_store_register(uint16_t op) {
     uint32_t Rn = BITS(op, 3, 5);
     uint32_t Rd = BITS(op, 0, 2);
 
-    arm_op = COND_AL << 28 | Rn << 16 | Rd << 12 | Rm;
+    gba->arm_op = COND_AL << 28 | Rn << 16 | Rd << 12 | Rm;
     switch (opc) {
-        case 0: arm_op |= 0x78 << 20; break;
-        case 1: arm_op |= 0x18 << 20 | 0xb << 4; break;
-        case 2: arm_op |= 0x7c << 20; break;
-        case 3: arm_op |= 0x19 << 20 | 0xd << 4; break;
-        case 4: arm_op |= 0x79 << 20; break;
-        case 5: arm_op |= 0x19 << 20 | 0xb << 4; break;
-        case 6: arm_op |= 0x7d << 20; break;
-        case 7: arm_op |= 0x19 << 20 | 0xf << 4; break;
+        case 0: gba->arm_op |= 0x78 << 20; break;
+        case 1: gba->arm_op |= 0x18 << 20 | 0xb << 4; break;
+        case 2: gba->arm_op |= 0x7c << 20; break;
+        case 3: gba->arm_op |= 0x19 << 20 | 0xd << 4; break;
+        case 4: gba->arm_op |= 0x79 << 20; break;
+        case 5: gba->arm_op |= 0x19 << 20 | 0xb << 4; break;
+        case 6: gba->arm_op |= 0x7d << 20; break;
+        case 7: gba->arm_op |= 0x19 << 20 | 0xf << 4; break;
         default: std::abort();
     }
     if (opc == 1 || opc == 5) {
-        arm_load_store_halfword_register(arm_op);
+        arm_load_store_halfword_register(gba->arm_op);
     } else if (opc == 3 || opc == 7) {
-        arm_load_signed_halfword_or_signed_byte_register(arm_op);
+        arm_load_signed_halfword_or_signed_byte_register(gba->arm_op);
     } else {
-        arm_load_store_word_or_byte_register(arm_op);
+        arm_load_store_word_or_byte_register(gba->arm_op);
     }
 }
 
@@ -387,16 +388,16 @@ void thumb_load_store_word_or_byte_immediate(uint16_t op) {
     uint32_t Rn = BITS(op, 3, 5);
     uint32_t Rd = BITS(op, 0, 2);
 
-    arm_op = COND_AL << 28 | 0x58 << 20 | Rn << 16 | Rd << 12;
+    gba->arm_op = COND_AL << 28 | 0x58 << 20 | Rn << 16 | Rd << 12;
     if (B) {
-        arm_op |= 0x04 << 20 | imm;
+        gba->arm_op |= 0x04 << 20 | imm;
     } else {
-        arm_op |= imm << 2;
+        gba->arm_op |= imm << 2;
     }
     if (L) {
-        arm_op |= 0x01 << 20;
+        gba->arm_op |= 0x01 << 20;
     }
-    arm_load_store_word_or_byte_immediate(arm_op);
+    arm_load_store_word_or_byte_immediate(gba->arm_op);
 }
 
 void thumb_load_store_halfword_immediate_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -423,13 +424,13 @@ void thumb_load_store_halfword_immediate(uint16_t op) {
     uint32_t Rn = BITS(op, 3, 5);
     uint32_t Rd = BITS(op, 0, 2);
 
-    arm_op = COND_AL << 28 | Rn << 16 | Rd << 12 | BITS(imm, 3, 4) << 8 | 0xb << 4 | BITS(imm, 0, 2) << 1;
+    gba->arm_op = COND_AL << 28 | Rn << 16 | Rd << 12 | BITS(imm, 3, 4) << 8 | 0xb << 4 | BITS(imm, 0, 2) << 1;
     if (L) {
-        arm_op |= 0x1d << 20;
+        gba->arm_op |= 0x1d << 20;
     } else {
-        arm_op |= 0x1c << 20;
+        gba->arm_op |= 0x1c << 20;
     }
-    arm_load_store_halfword_immediate(arm_op);
+    arm_load_store_halfword_immediate(gba->arm_op);
 }
 
 void thumb_load_store_to_or_from_stack_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -454,13 +455,13 @@ void thumb_load_store_to_or_from_stack(uint16_t op) {
     uint32_t Rd = BITS(op, 8, 10);
     uint32_t imm = BITS(op, 0, 7);
 
-    arm_op = COND_AL << 28 | REG_SP << 16 | Rd << 12 | imm << 2;
+    gba->arm_op = COND_AL << 28 | REG_SP << 16 | Rd << 12 | imm << 2;
     if (L) {
-        arm_op |= 0x59 << 20;
+        gba->arm_op |= 0x59 << 20;
     } else {
-        arm_op |= 0x58 << 20;
+        gba->arm_op |= 0x58 << 20;
     }
-    arm_load_store_word_or_byte_immediate(arm_op);
+    arm_load_store_word_or_byte_immediate(gba->arm_op);
 }
 
 void thumb_add_to_sp_or_pc_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -484,13 +485,13 @@ void thumb_add_to_sp_or_pc(uint16_t op) {
     uint32_t Rd = BITS(op, 8, 10);
     uint32_t imm = BITS(op, 0, 7);
 
-    arm_op = COND_AL << 28 | ARM_ADD << 21 | 0x20 << 20 | Rd << 12 | 0xf << 8 | imm;
+    gba->arm_op = COND_AL << 28 | ARM_ADD << 21 | 0x20 << 20 | Rd << 12 | 0xf << 8 | imm;
     if (SP) {
-        arm_op |= REG_SP << 16;
+        gba->arm_op |= REG_SP << 16;
     } else {
-        arm_op |= REG_PC << 16;
+        gba->arm_op |= REG_PC << 16;
     }
-    arm_data_processing_immediate(arm_op);
+    arm_data_processing_immediate(gba->arm_op);
 }
 
 void thumb_adjust_stack_pointer_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -517,13 +518,13 @@ void thumb_adjust_stack_pointer(uint16_t op) {
 
     assert(sbz == 0);  // should be zero
 
-    arm_op = COND_AL << 28 | 0x20 << 20 | REG_SP << 16 | REG_SP << 12 | 0xf << 8 | imm;
+    gba->arm_op = COND_AL << 28 | 0x20 << 20 | REG_SP << 16 | REG_SP << 12 | 0xf << 8 | imm;
     if (opc == 1) {
-        arm_op |= ARM_SUB << 21;
+        gba->arm_op |= ARM_SUB << 21;
     } else {
-        arm_op |= ARM_ADD << 21;
+        gba->arm_op |= ARM_ADD << 21;
     }
-    arm_data_processing_immediate(arm_op);
+    arm_data_processing_immediate(gba->arm_op);
 }
 
 void thumb_push_or_pop_register_list_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -551,15 +552,15 @@ void thumb_push_or_pop_register_list(uint16_t op) {
 
     assert(sbz == 0);  // should be zero
 
-    arm_op = COND_AL << 28 | REG_SP << 16 | rlist;
+    gba->arm_op = COND_AL << 28 | REG_SP << 16 | rlist;
     if (L) {
-        arm_op |= 0x8b << 20;
-        if (R) arm_op |= 1 << REG_PC;
+        gba->arm_op |= 0x8b << 20;
+        if (R) gba->arm_op |= 1 << REG_PC;
     } else {
-        arm_op |= 0x92 << 20;
-        if (R) arm_op |= 1 << REG_LR;
+        gba->arm_op |= 0x92 << 20;
+        if (R) gba->arm_op |= 1 << REG_LR;
     }
-    arm_load_store_multiple(arm_op);
+    arm_load_store_multiple(gba->arm_op);
 }
 
 void thumb_load_store_multiple_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -582,13 +583,13 @@ void thumb_load_store_multiple(uint16_t op) {
     uint32_t Rn = BITS(op, 8, 10);
     uint32_t rlist = BITS(op, 0, 7);
 
-    arm_op = COND_AL << 28 | Rn << 16 | rlist;
+    gba->arm_op = COND_AL << 28 | Rn << 16 | rlist;
     if (L) {
-        arm_op |= 0x8b << 20;
+        gba->arm_op |= 0x8b << 20;
     } else {
-        arm_op |= 0x8a << 20;
+        gba->arm_op |= 0x8a << 20;
     }
-    arm_load_store_multiple(arm_op);
+    arm_load_store_multiple(gba->arm_op);
 }
 
 void thumb_conditional_branch_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -624,8 +625,8 @@ void thumb_conditional_branch(uint16_t op) {
     SIGN_EXTEND(imm, 7);
 
     if (condition_passed(cond)) {
-        r[REG_PC] += imm << 1;
-        branch_taken = true;
+        gba->r[REG_PC] += imm << 1;
+        gba->branch_taken = true;
     }
 }
 
@@ -642,8 +643,8 @@ void thumb_software_interrupt_disasm(uint32_t address, uint16_t op, std::string
 void thumb_software_interrupt(uint16_t op) {
     uint32_t imm = BITS(op, 0, 7);
 
-    arm_op = COND_AL << 28 | 0xf0 << 20 | imm;
-    arm_software_interrupt(arm_op);
+    gba->arm_op = COND_AL << 28 | 0xf0 << 20 | imm;
+    arm_software_interrupt(gba->arm_op);
 }
 
 void thumb_unconditional_branch_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -660,8 +661,8 @@ void thumb_unconditional_branch(uint16_t op) {
     uint32_t imm = BITS(op, 0, 10);
     SIGN_EXTEND(imm, 10);
 
-    r[REG_PC] += imm << 1;
-    branch_taken = true;
+    gba->r[REG_PC] += imm << 1;
+    gba->branch_taken = true;
 }
 
 void thumb_branch_with_link_prefix_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -675,7 +676,7 @@ void thumb_branch_with_link_prefix(uint16_t op) {
     uint32_t imm = BITS(op, 0, 10);
     SIGN_EXTEND(imm, 10);
 
-    r[REG_LR] = r[REG_PC] + (imm << 12);
+    gba->r[REG_LR] = gba->r[REG_PC] + (imm << 12);
 }
 
 void thumb_branch_with_link_suffix_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -696,11 +697,11 @@ void thumb_branch_with_link_suffix_disasm(uint32_t address, uint16_t op, std::st
 
 void thumb_branch_with_link_suffix(uint16_t op) {
     uint32_t imm = BITS(op, 0, 10);
-    uint32_t target_address = r[REG_LR] + (imm << 1);
+    uint32_t target_address = gba->r[REG_LR] + (imm << 1);
 
-    r[REG_LR] = (r[REG_PC] - 2) | 1;
-    r[REG_PC] = target_address;
-    branch_taken = true;
+    gba->r[REG_LR] = (gba->r[REG_PC] - 2) | 1;
+    gba->r[REG_PC] = target_address;
+    gba->branch_taken = true;
 }
 
 void thumb_undefined_instruction_disasm(uint32_t address, uint16_t op, std::string &s) {
@@ -714,6 +715,6 @@ void thumb_undefined_instruction(uint16_t op) {
     UNUSED(op);
 
     assert(false);
-    arm_op = COND_AL << 28 | 0x7f << 20 | 0xf << 4;  // Permanently undefined
-    arm_undefined_instruction(arm_op);
+    gba->arm_op = COND_AL << 28 | 0x7f << 20 | 0xf << 4;  // Permanently undefined
+    arm_undefined_instruction(gba->arm_op);
 }
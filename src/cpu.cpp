@@ -12,39 +12,26 @@
 
 #include <fmt/core.h>
 
+#include "context.h"
 #include "memory.h"
+#include "system.h"
 
-uint32_t r[16];
-uint32_t r8_usr, r9_usr, r10_usr, r11_usr, r12_usr, r13_usr, r14_usr;
-uint32_t r8_fiq, r9_fiq, r10_fiq, r11_fiq, r12_fiq, r13_fiq, r14_fiq;
-uint32_t r13_irq, r14_irq;
-uint32_t r13_svc, r14_svc;
-uint32_t r13_abt, r14_abt;
-uint32_t r13_und, r14_und;
-uint32_t cpsr;
-uint32_t spsr_fiq, spsr_irq, spsr_svc, spsr_abt, spsr_und;
-bool branch_taken;
-
-uint32_t arm_op;
-uint32_t arm_pipeline[2];
 void (*arm_lookup[4096])(uint32_t);
 void (*arm_lookup_disasm[4096])(uint32_t, uint32_t, std::string &);
 
-uint16_t thumb_op;
-uint16_t thumb_pipeline[2];
 void (*thumb_lookup[256])(uint16_t);
 void (*thumb_lookup_disasm[256])(uint32_t, uint16_t, std::string &);
 
 void arm_init_registers(bool skip_bios) {
     if (skip_bios) {
-        r[REG_SP] = 0x03007f00;
-        r13_irq = 0x03007fa0;
-        r13_svc = 0x03007fe0;
-        r[REG_PC] = 0x08000000;
-        cpsr = PSR_MODE_SYS;
+        gba->r[REG_SP] = 0x03007f00;
+        gba->r13_irq = 0x03007fa0;
+        gba->r13_svc = 0x03007fe0;
+        gba->r[REG_PC] = 0x08000000;
+        gba->cpsr = PSR_MODE_SYS;
     } else {
-        r[REG_PC] = VEC_RESET;
-        cpsr = PSR_I | PSR_F | PSR_MODE_SVC;
+        gba->r[REG_PC] = VEC_RESET;
+        gba->cpsr = PSR_I | PSR_F | PSR_MODE_SVC;
     }
 }
 
@@ -62,54 +49,54 @@ void mode_change(uint32_t old_mode, uint32_t new_mode) {
     if (old_mode == PSR_MODE_SYS && new_mode == PSR_MODE_USR) return;
 
     if (old_mode == PSR_MODE_FIQ) {
-        r8_fiq = r[8];
-        r9_fiq = r[9];
-        r10_fiq = r[10];
-        r11_fiq = r[11];
-        r12_fiq = r[12];
-        r[8] = r8_usr;
-        r[9] = r9_usr;
-        r[10] = r10_usr;
-        r[11] = r11_usr;
-        r[12] = r12_usr;
+        gba->r8_fiq = gba->r[8];
+        gba->r9_fiq = gba->r[9];
+        gba->r10_fiq = gba->r[10];
+        gba->r11_fiq = gba->r[11];
+        gba->r12_fiq = gba->r[12];
+        gba->r[8] = gba->r8_usr;
+        gba->r[9] = gba->r9_usr;
+        gba->r[10] = gba->r10_usr;
+        gba->r[11] = gba->r11_usr;
+        gba->r[12] = gba->r12_usr;
     }
     if (new_mode == PSR_MODE_FIQ) {
-        r8_usr = r[8];
-        r9_usr = r[9];
-        r10_usr = r[10];
-        r11_usr = r[11];
-        r12_usr = r[12];
-        r[8] = r8_fiq;
-        r[9] = r9_fiq;
-        r[10] = r10_fiq;
-        r[11] = r11_fiq;
-        r[12] = r12_fiq;
+        gba->r8_usr = gba->r[8];
+        gba->r9_usr = gba->r[9];
+        gba->r10_usr = gba->r[10];
+        gba->r11_usr = gba->r[11];
+        gba->r12_usr = gba->r[12];
+        gba->r[8] = gba->r8_fiq;
+        gba->r[9] = gba->r9_fiq;
+        gba->r[10] = gba->r10_fiq;
+        gba->r[11] = gba->r11_fiq;
+        gba->r[12] = gba->r12_fiq;
     }
     switch (old_mode) {
         case PSR_MODE_USR:
         case PSR_MODE_SYS:
-            r13_usr = r[13];
-            r14_usr = r[14];
+            gba->r13_usr = gba->r[13];
+            gba->r14_usr = gba->r[14];
             break;
         case PSR_MODE_FIQ:
-            r13_fiq = r[13];
-            r14_fiq = r[14];
+            gba->r13_fiq = gba->r[13];
+            gba->r14_fiq = gba->r[14];
             break;
         case PSR_MODE_IRQ:
-            r13_irq = r[13];
-            r14_irq = r[14];
+            gba->r13_irq = gba->r[13];
+            gba->r14_irq = gba->r[14];
             break;
         case PSR_MODE_SVC:
-            r13_svc = r[13];
-            r14_svc = r[14];
+            gba->r13_svc = gba->r[13];
+            gba->r14_svc = gba->r[14];
             break;
         case PSR_MODE_ABT:
-            r13_abt = r[13];
-            r14_abt = r[14];
+            gba->r13_abt = gba->r[13];
+            gba->r14_abt = gba->r[14];
             break;
         case PSR_MODE_UND:
-            r13_und = r[13];
-            r14_und = r[14];
+            gba->r13_und = gba->r[13];
+            gba->r14_und = gba->r[14];
             break;
         default:
             assert(false);
@@ -118,28 +105,28 @@ void mode_change(uint32_t old_mode, uint32_t new_mode) {
     switch (new_mode) {
         case PSR_MODE_USR:
         case PSR_MODE_SYS:
-            r[13] = r13_usr;
-            r[14] = r14_usr;
+            gba->r[13] = gba->r13_usr;
+            gba->r[14] = gba->r14_usr;
             break;
         case PSR_MODE_FIQ:
-            r[13] = r13_fiq;
-            r[14] = r14_fiq;
+            gba->r[13] = gba->r13_fiq;
+            gba->r[14] = gba->r14_fiq;
             break;
         case PSR_MODE_IRQ:
-            r[13] = r13_irq;
-            r[14] = r14_irq;
+            gba->r[13] = gba->r13_irq;
+            gba->r[14] = gba->r14_irq;
             break;
         case PSR_MODE_SVC:
-            r[13] = r13_svc;
-            r[14] = r14_svc;
+            gba->r[13] = gba->r13_svc;
+            gba->r[14] = gba->r14_svc;
             break;
         case PSR_MODE_ABT:
-            r[13] = r13_abt;
-            r[14] = r14_abt;
+            gba->r[13] = gba->r13_abt;
+            gba->r[14] = gba->r14_abt;
             break;
         case PSR_MODE_UND:
-            r[13] = r13_und;
-            r[14] = r14_und;
+            gba->r[13] = gba->r13_und;
+            gba->r[14] = gba->r14_und;
             break;
         default:
             assert(false);
@@ -167,54 +154,54 @@ const uint16_t cond_lookup[16] = {
 };
 
 bool condition_passed(uint32_t cond) {
-    return BIT(cond_lookup[BITS(cpsr, 28, 31)], cond);
+    return BIT(cond_lookup[BITS(gba->cpsr, 28, 31)], cond);
 }
 
 void write_cpsr(uint32_t psr) {
     // T bit should only be set by branches
-    assert(branch_taken || ((cpsr & PSR_T) == (psr & PSR_T)));
+    assert(gba->branch_taken || ((gba->cpsr & PSR_T) == (psr & PSR_T)));
 
     // In architecture versions without 26-bit backwards-compatibility support,
     // CPSR bit 4 (M[4]) always reads as 1, and all writes to it are ignored.
     psr |= 0x10;
 
-    uint32_t old_mode = cpsr & PSR_MODE;
-    cpsr = psr;
-    uint32_t new_mode = cpsr & PSR_MODE;
+    uint32_t old_mode = gba->cpsr & PSR_MODE;
+    gba->cpsr = psr;
+    uint32_t new_mode = gba->cpsr & PSR_MODE;
     mode_change(old_mode, new_mode);
 }
 
 uint32_t read_spsr() {
-    uint32_t mode = cpsr & PSR_MODE;
+    uint32_t mode = gba->cpsr & PSR_MODE;
     switch (mode) {
         case PSR_MODE_USR: break;
-        case PSR_MODE_FIQ: return spsr_fiq;
-        case PSR_MODE_IRQ: return spsr_irq;
-        case PSR_MODE_SVC: return spsr_svc;
-        case PSR_MODE_ABT: return spsr_abt;
-        case PSR_MODE_UND: return spsr_und;
+        case PSR_MODE_FIQ: return gba->spsr_fiq;
+        case PSR_MODE_IRQ: return gba->spsr_irq;
+        case PSR_MODE_SVC: return gba->spsr_svc;
+        case PSR_MODE_ABT: return gba->spsr_abt;
+        case PSR_MODE_UND: return gba->spsr_und;
         case PSR_MODE_SYS: break;
         default: assert(false); break;
     }
-    return cpsr;
+    return gba->cpsr;
 }
 
 void write_spsr(uint32_t psr) {
-    uint32_t mode = cpsr & PSR_MODE;
+    uint32_t mode = gba->cpsr & PSR_MODE;
     switch (mode) {
         case PSR_MODE_USR: break;
-        case PSR_MODE_FIQ: spsr_fiq = psr; break;
-        case PSR_MODE_IRQ: spsr_irq = psr; break;
-        case PSR_MODE_SVC: spsr_svc = psr; break;
-        case PSR_MODE_ABT: spsr_abt = psr; break;
-        case PSR_MODE_UND: spsr_und = psr; break;
+        case PSR_MODE_FIQ: gba->spsr_fiq = psr; break;
+        case PSR_MODE_IRQ: gba->spsr_irq = psr; break;
+        case PSR_MODE_SVC: gba->spsr_svc = psr; break;
+        case PSR_MODE_ABT: gba->spsr_abt = psr; break;
+        case PSR_MODE_UND: gba->spsr_und = psr; break;
         case PSR_MODE_SYS: break;
         default: assert(false); break;
     }
 }
 
 uint32_t get_pc() {
-    return r[REG_PC] - (branch_taken ? 0 : 2 * SIZEOF_INSTR);
+    return gba->r[REG_PC] - (gba->branch_taken ? 0 : 2 * SIZEOF_INSTR);
 }
 
 void arm_disasm(uint32_t address, uint32_t op, std::string &s) {
@@ -225,27 +212,53 @@ void arm_disasm(uint32_t address, uint32_t op, std::string &s) {
 }
 
 void arm_fill_pipeline() {
-    arm_op = memory_read_word(r[REG_PC]);
-    arm_pipeline[0] = memory_read_word(r[REG_PC] + 4);
-    arm_pipeline[1] = memory_read_word(r[REG_PC] + 8);
-    branch_taken = false;
-    r[REG_PC] += 8;
+    gba->arm_op = memory_read_word(gba->r[REG_PC]);
+    gba->arm_pipeline[0] = memory_read_word(gba->r[REG_PC] + 4);
+    gba->arm_pipeline[1] = memory_read_word(gba->r[REG_PC] + 8);
+    gba->branch_taken = false;
+    gba->r[REG_PC] += 8;
 }
 
 void arm_step() {
-    uint32_t cond = BITS(arm_op, 28, 31);
+    if (gba->cpu_jit_enabled && arm_jit_step()) return;
+
+    cpu_block_instr *instr = gba->arm_cache_instr;
+    if (instr == nullptr || instr == gba->arm_cache_end || gba->arm_cache_pc != gba->r[REG_PC]) {
+        instr = arm_cache_lookup();
+    }
+    if (instr != nullptr && instr->op == gba->arm_op) {
+        gba->arm_cache_instr = instr + 1;
+        if (condition_passed(BITS(gba->arm_op, 28, 31))) {
+            (*instr->handler.arm)(gba->arm_op);
+        }
+
+        if (!gba->branch_taken) {
+            gba->r[REG_PC] += 4;
+            gba->arm_op = gba->arm_pipeline[0];
+            gba->arm_pipeline[0] = gba->arm_pipeline[1];
+            system_tick(instr->fetch_cycles);
+            // The cursor is dropped if the instruction or a DMA overwrote cached code
+            gba->arm_pipeline[1] = (gba->arm_cache_instr != nullptr ? instr->fetch : memory_peek_word(gba->r[REG_PC]));
+            gba->arm_cache_pc = gba->r[REG_PC];
+        } else {
+            gba->arm_cache_instr = nullptr;
+        }
+        return;
+    }
+
+    uint32_t cond = BITS(gba->arm_op, 28, 31);
     if (condition_passed(cond)) {
-        uint32_t index = BITS(arm_op, 20, 27) << 4 | BITS(arm_op, 4, 7);
+        uint32_t index = BITS(gba->arm_op, 20, 27) << 4 | BITS(gba->arm_op, 4, 7);
         void (*handler)(uint32_t) = arm_lookup[index];
         assert(handler != nullptr);
-        (*handler)(arm_op);
+        (*handler)(gba->arm_op);
     }
 
-    if (!branch_taken) {
-        r[REG_PC] += 4;
-        arm_op = arm_pipeline[0];
-        arm_pipeline[0] = arm_pipeline[1];
-        arm_pipeline[1] = memory_read_word(r[REG_PC]);
+    if (!gba->branch_taken) {
+        gba->r[REG_PC] += 4;
+        gba->arm_op = gba->arm_pipeline[0];
+        gba->arm_pipeline[0] = gba->arm_pipeline[1];
+        gba->arm_pipeline[1] = memory_read_word(gba->r[REG_PC]);
     }
 }
 
@@ -257,24 +270,48 @@ void thumb_disasm(uint32_t address, uint16_t op, std::string &s) {
 }
 
 void thumb_fill_pipeline() {
-    thumb_op = memory_read_halfword(r[REG_PC]);
-    thumb_pipeline[0] = memory_read_halfword(r[REG_PC] + 2);
-    thumb_pipeline[1] = memory_read_halfword(r[REG_PC] + 4);
-    branch_taken = false;
-    r[REG_PC] += 4;
+    gba->thumb_op = memory_read_halfword(gba->r[REG_PC]);
+    gba->thumb_pipeline[0] = memory_read_halfword(gba->r[REG_PC] + 2);
+    gba->thumb_pipeline[1] = memory_read_halfword(gba->r[REG_PC] + 4);
+    gba->branch_taken = false;
+    gba->r[REG_PC] += 4;
 }
 
 void thumb_step() {
-    uint16_t index = BITS(thumb_op, 8, 15);
+    if (gba->cpu_jit_enabled && thumb_jit_step()) return;
+
+    cpu_block_instr *instr = gba->thumb_cache_instr;
+    if (instr == nullptr || instr == gba->thumb_cache_end || gba->thumb_cache_pc != gba->r[REG_PC]) {
+        instr = thumb_cache_lookup();
+    }
+    if (instr != nullptr && instr->op == gba->thumb_op) {
+        gba->thumb_cache_instr = instr + 1;
+        (*instr->handler.thumb)(gba->thumb_op);
+
+        if (!gba->branch_taken) {
+            gba->r[REG_PC] += 2;
+            gba->thumb_op = gba->thumb_pipeline[0];
+            gba->thumb_pipeline[0] = gba->thumb_pipeline[1];
+            system_tick(instr->fetch_cycles);
+            // The cursor is dropped if the instruction or a DMA overwrote cached code
+            gba->thumb_pipeline[1] = (gba->thumb_cache_instr != nullptr ? instr->fetch : memory_peek_halfword(gba->r[REG_PC]));
+            gba->thumb_cache_pc = gba->r[REG_PC];
+        } else {
+            gba->thumb_cache_instr = nullptr;
+        }
+        return;
+    }
+
+    uint16_t index = BITS(gba->thumb_op, 8, 15);
     void (*handler)(uint16_t) = thumb_lookup[index];
     assert(handler != nullptr);
-    (*handler)(thumb_op);
+    (*handler)(gba->thumb_op);
 
-    if (!branch_taken) {
-        r[REG_PC] += 2;
-        thumb_op = thumb_pipeline[0];
-        thumb_pipeline[0] = thumb_pipeline[1];
-        thumb_pipeline[1] = memory_read_halfword(r[REG_PC]);
+    if (!gba->branch_taken) {
+        gba->r[REG_PC] += 2;
+        gba->thumb_op = gba->thumb_pipeline[0];
+        gba->thumb_pipeline[0] = gba->thumb_pipeline[1];
+        gba->thumb_pipeline[1] = memory_read_halfword(gba->r[REG_PC]);
     }
 }
 
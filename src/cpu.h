@@ -21,20 +21,20 @@
 
 // clang-format off
 
-#define FLAG_C()           (cpsr & PSR_C ? true : false)
-#define FLAG_T()           (cpsr & PSR_T ? true : false)
+#define FLAG_C()           (gba->cpsr & PSR_C ? true : false)
+#define FLAG_T()           (gba->cpsr & PSR_T ? true : false)
 
-#define ASSIGN_N(x)        if ((x)) { cpsr |= PSR_N; } else { cpsr &= ~PSR_N; }
-#define ASSIGN_Z(x)        if ((x)) { cpsr |= PSR_Z; } else { cpsr &= ~PSR_Z; }
-#define ASSIGN_C(x)        if ((x)) { cpsr |= PSR_C; } else { cpsr &= ~PSR_C; }
-#define ASSIGN_V(x)        if ((x)) { cpsr |= PSR_V; } else { cpsr &= ~PSR_V; }
-#define ASSIGN_T(x)        if ((x)) { cpsr |= PSR_T; } else { cpsr &= ~PSR_T; }
+#define ASSIGN_N(x)        if ((x)) { gba->cpsr |= PSR_N; } else { gba->cpsr &= ~PSR_N; }
+#define ASSIGN_Z(x)        if ((x)) { gba->cpsr |= PSR_Z; } else { gba->cpsr &= ~PSR_Z; }
+#define ASSIGN_C(x)        if ((x)) { gba->cpsr |= PSR_C; } else { gba->cpsr &= ~PSR_C; }
+#define ASSIGN_V(x)        if ((x)) { gba->cpsr |= PSR_V; } else { gba->cpsr &= ~PSR_V; }
+#define ASSIGN_T(x)        if ((x)) { gba->cpsr |= PSR_T; } else { gba->cpsr &= ~PSR_T; }
 
-#define CLEAR_C()          cpsr &= ~PSR_C
+#define CLEAR_C()          gba->cpsr &= ~PSR_C
 
 // clang-format on
 
-#define SIZEOF_INSTR       (cpsr & PSR_T ? 2 : 4)
+#define SIZEOF_INSTR       (gba->cpsr & PSR_T ? 2 : 4)
 
 #define ARM_AND            0
 #define ARM_EOR            1
@@ -121,17 +121,36 @@
 #define VEC_IRQ            0x18
 #define VEC_FIQ            0x1c
 
-extern uint32_t r[16];
-extern uint32_t r14_irq, r14_svc, r14_und;
-extern uint32_t cpsr;
-extern uint32_t spsr_irq, spsr_svc, spsr_und;
-extern bool branch_taken;
+#define CODE_LINE_SHIFT    6
+#define CODE_LINE_MASK     ((1 << CODE_LINE_SHIFT) - 1)
 
-extern uint32_t arm_op;
-extern uint32_t arm_pipeline[2];
+#define BLOCK_CACHE_SIZE   4096  // Must be a power of two
+#define BLOCK_MAX_INSTRS   32
 
-extern uint16_t thumb_op;
-extern uint16_t thumb_pipeline[2];
+extern void (*arm_lookup[4096])(uint32_t);
+extern void (*thumb_lookup[256])(uint16_t);
+extern const uint16_t cond_lookup[16];
+
+struct cpu_block_instr {
+    union {
+        void (*arm)(uint32_t);
+        void (*thumb)(uint16_t);
+    } handler;
+    uint32_t op;
+    uint32_t fetch;  // Value loaded into the pipeline once the instruction has executed
+    uint32_t fetch_cycles;
+};
+
+struct cpu_block {
+    uint32_t tag;  // Start address, with bit 0 set for Thumb blocks
+    uint32_t size;
+    uint32_t length;
+    uint32_t pipeline[2];  // Instructions following the first one when the block was decoded
+    const uint8_t *code;   // Native code from the JIT, if it has been compiled
+    uint32_t uses;         // Times the JIT has reached the block since it was decoded
+    bool idle;             // Starts a loop that only waits for memory or I/O to change
+    cpu_block_instr instrs[BLOCK_MAX_INSTRS];
+};
 
 void arm_init_registers(bool skip_bios);
 uint32_t align_word(uint32_t address, uint32_t value);
@@ -160,6 +179,25 @@ bool print_arm_rlist(std::string &s, uint32_t rlist);
 bool print_thumb_rlist(std::string &s, uint32_t rlist);
 void print_bios_function_name(std::string &s, uint8_t i);
 
+// cpu-cache.c
+inline uint32_t block_cache_index(uint32_t address) {
+    return ((address >> 1) ^ (address >> 17)) & (BLOCK_CACHE_SIZE - 1);
+}
+
+void cpu_cache_flush();
+void cpu_cache_invalidate(uint32_t address);
+void cpu_cache_end_frame();
+cpu_block *cpu_cache_lookup(bool thumb);
+cpu_block_instr *arm_cache_lookup();
+cpu_block_instr *thumb_cache_lookup();
+
+// cpu-jit.c
+
+bool cpu_jit_supported();
+void cpu_jit_release();
+bool arm_jit_step();
+bool thumb_jit_step();
+
 // cpu-arm.c
 void arm_data_processing_register_disasm(uint32_t address, uint32_t op, std::string &s);
 void arm_data_processing_register(uint32_t op);
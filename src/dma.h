@@ -19,9 +19,5 @@
 #define DMA_IRQ        (1 << 30)
 #define DMA_ENABLE     (1 << 31)
 
-extern int dma_channel_active;
-extern int dma_channel_finished;
-extern uint32_t dma_pc;
-
 void dma_reset(int ch);
 void dma_update(uint32_t current_timing);
@@ -7,30 +7,19 @@
 #include <cassert>
 #include <ctime>
 
+#include "context.h"
 #include "memory.h"
 
-bool has_rtc;
-
-uint16_t gpio_data;
-uint16_t gpio_direction;
-uint16_t gpio_read_enable;
-
-uint64_t rtc_rbits;
-uint32_t rtc_num_rbits;
-uint64_t rtc_wbits;
-uint32_t rtc_num_wbits;
-uint32_t rtc_state;
-
 void gpio_init() {
-    gpio_data = 0;
-    gpio_direction = 0;
-    gpio_read_enable = 0;
-
-    rtc_rbits = 0;
-    rtc_num_rbits = 0;
-    rtc_wbits = 0;
-    rtc_num_wbits = 0;
-    rtc_state = 0;
+    gba->gpio_data = 0;
+    gba->gpio_direction = 0;
+    gba->gpio_read_enable = 0;
+
+    gba->rtc_rbits = 0;
+    gba->rtc_num_rbits = 0;
+    gba->rtc_wbits = 0;
+    gba->rtc_num_wbits = 0;
+    gba->rtc_state = 0;
 }
 
 uint8_t bcd_to_decimal(uint8_t x) {
@@ -47,16 +36,16 @@ uint8_t decimal_to_bcd(uint8_t x) {
 
 static void rtc_send(uint8_t value) {
     for (int i = 0; i < 8; i++) {
-        rtc_rbits <<= 1;
-        rtc_rbits |= (value >> i) & 1;
+        gba->rtc_rbits <<= 1;
+        gba->rtc_rbits |= (value >> i) & 1;
     }
-    rtc_num_rbits += 8;
+    gba->rtc_num_rbits += 8;
 }
 
 static uint16_t rtc_read_bit() {
-    if (rtc_num_rbits > 0) {
-        rtc_num_rbits--;
-        return (rtc_rbits >> rtc_num_rbits) & 1;
+    if (gba->rtc_num_rbits > 0) {
+        gba->rtc_num_rbits--;
+        return (gba->rtc_rbits >> gba->rtc_num_rbits) & 1;
     }
     return 0;
 }
@@ -65,22 +54,22 @@ static void rtc_write_bit(uint16_t value) {
     std::time_t rawtime;
     std::tm *timeinfo;
 
-    rtc_wbits <<= 1;
-    rtc_wbits |= value & 1;
-    rtc_num_wbits++;
+    gba->rtc_wbits <<= 1;
+    gba->rtc_wbits |= value & 1;
+    gba->rtc_num_wbits++;
 
-    if (rtc_state == 0) {  // Command received
-        if (rtc_num_wbits < 8) return;
-        rtc_state = (uint8_t) rtc_wbits;
-        rtc_rbits = 0;
-        rtc_num_rbits = 0;
-        rtc_wbits = 0;
-        rtc_num_wbits = 0;
+    if (gba->rtc_state == 0) {  // Command received
+        if (gba->rtc_num_wbits < 8) return;
+        gba->rtc_state = (uint8_t) gba->rtc_wbits;
+        gba->rtc_rbits = 0;
+        gba->rtc_num_rbits = 0;
+        gba->rtc_wbits = 0;
+        gba->rtc_num_wbits = 0;
 
-        switch (rtc_state) {
+        switch (gba->rtc_state) {
             case 0x60:  // Reset
             case 0x61:
-                rtc_state = 0;
+                gba->rtc_state = 0;
                 break;
 
             case 0x62:  // Write status
@@ -88,7 +77,7 @@ static void rtc_write_bit(uint16_t value) {
 
             case 0x63:  // Read status
                 rtc_send(STATUS_24HOUR);
-                rtc_state = 0;
+                gba->rtc_state = 0;
                 break;
 
             case 0x64:  // Write date and time
@@ -104,7 +93,7 @@ static void rtc_write_bit(uint16_t value) {
                 rtc_send(decimal_to_bcd(timeinfo->tm_hour));
                 rtc_send(decimal_to_bcd(timeinfo->tm_min));
                 rtc_send(decimal_to_bcd(timeinfo->tm_sec));
-                rtc_state = 0;
+                gba->rtc_state = 0;
                 break;
 
             case 0x66:  // Write time
@@ -116,7 +105,7 @@ static void rtc_write_bit(uint16_t value) {
                 rtc_send(decimal_to_bcd(timeinfo->tm_hour));
                 rtc_send(decimal_to_bcd(timeinfo->tm_min));
                 rtc_send(decimal_to_bcd(timeinfo->tm_sec));
-                rtc_state = 0;
+                gba->rtc_state = 0;
                 break;
 
             default:
@@ -124,29 +113,29 @@ static void rtc_write_bit(uint16_t value) {
                 break;
         }
     } else {  // Data received
-        switch (rtc_state) {
+        switch (gba->rtc_state) {
             case 0x62:  // Write status
-                if (rtc_num_wbits < 8) return;
+                if (gba->rtc_num_wbits < 8) return;
                 // Do nothing
-                rtc_state = 0;
-                rtc_wbits = 0;
-                rtc_num_wbits = 0;
+                gba->rtc_state = 0;
+                gba->rtc_wbits = 0;
+                gba->rtc_num_wbits = 0;
                 break;
 
             case 0x64:  // Write date and time
-                if (rtc_num_wbits < 56) return;
+                if (gba->rtc_num_wbits < 56) return;
                 // Do nothing
-                rtc_state = 0;
-                rtc_wbits = 0;
-                rtc_num_wbits = 0;
+                gba->rtc_state = 0;
+                gba->rtc_wbits = 0;
+                gba->rtc_num_wbits = 0;
                 break;
 
             case 0x66:  // Write time
-                if (rtc_num_wbits < 24) return;
+                if (gba->rtc_num_wbits < 24) return;
                 // Do nothing
-                rtc_state = 0;
-                rtc_wbits = 0;
-                rtc_num_wbits = 0;
+                gba->rtc_state = 0;
+                gba->rtc_wbits = 0;
+                gba->rtc_num_wbits = 0;
                 break;
 
             default:
@@ -157,11 +146,11 @@ static void rtc_write_bit(uint16_t value) {
 }
 
 uint16_t gpio_read_halfword(uint32_t address) {
-    if (gpio_read_enable) {
+    if (gba->gpio_read_enable) {
         switch (address) {
-            case 0xc4: return gpio_data;
-            case 0xc6: return gpio_direction;
-            case 0xc8: return gpio_read_enable;
+            case 0xc4: return gba->gpio_data;
+            case 0xc6: return gba->gpio_direction;
+            case 0xc8: return gba->gpio_read_enable;
             default: break;
         }
     }
@@ -173,31 +162,31 @@ void gpio_write_halfword(uint32_t address, uint16_t value) {
 
     switch (address) {
         case 0xc4:
-            last_gpio_data = gpio_data;
-            gpio_data = value & 0xf;
-            if (has_rtc && (gpio_data & RTC_CS) && (gpio_data & RTC_SCK) && !(last_gpio_data & RTC_SCK)) {
-                if (gpio_direction & RTC_SIO) {
-                    if (gpio_data & RTC_SIO) {
+            last_gpio_data = gba->gpio_data;
+            gba->gpio_data = value & 0xf;
+            if (gba->has_rtc && (gba->gpio_data & RTC_CS) && (gba->gpio_data & RTC_SCK) && !(last_gpio_data & RTC_SCK)) {
+                if (gba->gpio_direction & RTC_SIO) {
+                    if (gba->gpio_data & RTC_SIO) {
                         rtc_write_bit(1);
                     } else {
                         rtc_write_bit(0);
                     }
                 } else {
                     if (rtc_read_bit()) {
-                        gpio_data |= RTC_SIO;
+                        gba->gpio_data |= RTC_SIO;
                     } else {
-                        gpio_data &= ~RTC_SIO;
+                        gba->gpio_data &= ~RTC_SIO;
                     }
                 }
             }
             break;
 
         case 0xc6:
-            gpio_direction = value & 0xf;
+            gba->gpio_direction = value & 0xf;
             break;
 
         case 0xc8:
-            gpio_read_enable = value & 1;
+            gba->gpio_read_enable = value & 1;
             break;
 
         default:
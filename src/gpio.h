@@ -21,8 +21,6 @@
 #define ALARM_AM      0
 #define ALARM_PM      0x80
 
-extern bool has_rtc;
-
 void gpio_init();
 uint16_t gpio_read_halfword(uint32_t address);
 void gpio_write_halfword(uint32_t address, uint16_t value);
@@ -0,0 +1,75 @@
+// Copyright (c) 2021 Ridge Shrubsall
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Lock-free ways of passing data between the GUI thread and the emulation thread. Each has exactly
+// one thread writing to it and one thread reading from it.
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+#define CACHE_LINE_SIZE 64
+
+// Ring buffer holding up to N - 1 items
+template <typename T, size_t N>
+struct spsc_queue {
+    T items[N];
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head = 0;  // Next item to read, only moved by the reader
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail = 0;  // Next slot to write, only moved by the writer
+
+    // Writer side, fails if the queue is full
+    bool push(T item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = (t + 1) % N;
+        if (next == head.load(std::memory_order_acquire)) return false;
+        items[t] = std::move(item);
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Reader side, null if the queue is empty
+    T *front() {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return nullptr;
+        return &items[h];
+    }
+
+    void pop() {
+        size_t h = head.load(std::memory_order_relaxed);
+        items[h] = T();  // Let go of anything the item owns
+        head.store((h + 1) % N, std::memory_order_release);
+    }
+};
+
+// The writer fills one buffer while the reader holds another, and the third holds the newest
+// complete one. Neither side ever waits, and the reader always gets the newest complete buffer.
+template <typename T>
+struct triple_buffer {
+    T buffers[3];
+    std::atomic<uint8_t> middle = 1 | 4;  // Index of the spare buffer, plus bit 2 while the reader has yet to take it
+    uint8_t back = 0;                     // Only used by the writer
+    uint8_t front = 2;                    // Only used by the reader
+
+    // Writer side
+    T &write_buffer() {
+        return buffers[back];
+    }
+
+    void publish() {
+        back = middle.exchange(back | 4, std::memory_order_acq_rel) & 3;
+    }
+
+    // Reader side, returns whether there was a newer buffer to switch to
+    bool update() {
+        if (!(middle.load(std::memory_order_relaxed) & 4)) return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+        return true;
+    }
+
+    const T &read_buffer() {
+        return buffers[front];
+    }
+};
@@ -0,0 +1,254 @@
+// Copyright (c) 2021 Ridge Shrubsall
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Runs a ROM for a fixed number of frames without opening a window or an audio device, for
+// throughput testing and batch runs on machines with no display.
+
+#include <stdint.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fmt/core.h>
+
+#include "audio.h"
+#include "bios.h"
+#include "context.h"
+#include "cpu.h"
+#include "system.h"
+#include "video.h"
+
+static const struct {
+    const char *name;
+    uint16_t mask;
+} key_names[] = {
+    {"A", KEY_A},
+    {"B", KEY_B},
+    {"SELECT", KEY_SELECT},
+    {"START", KEY_START},
+    {"RIGHT", KEY_RIGHT},
+    {"LEFT", KEY_LEFT},
+    {"UP", KEY_UP},
+    {"DOWN", KEY_DOWN},
+    {"R", KEY_R},
+    {"L", KEY_L},
+};
+
+static void print_usage() {
+    fmt::print(stderr,
+               "Usage: ygba-headless [options] ROM FRAMES\n"
+               "\n"
+               "Options:\n"
+               "  --bios FILE        BIOS image to use (default: gba_bios.bin)\n"
+               "  --skip-bios        Start the game directly instead of running the boot logo\n"
+               "  --hle              Emulate BIOS calls instead of running the BIOS code\n"
+               "  --jit              Use the JIT recompiler\n"
+               "  --run-ahead N      Run N frames ahead of the input, as the GUI option does\n"
+               "  --skip-render      Only draw the last frame\n"
+               "  --input FILE       Input script, one \"FRAME KEY+KEY...\" line per change (\"-\" for no keys)\n"
+               "  --dump-frame FILE  Write the last frame as a binary PPM image\n"
+               "  --dump-audio FILE  Write the audio as raw signed 16-bit stereo at 48000 Hz\n");
+}
+
+// Each line holds the keys that are down from the given frame onwards, e.g. "120 START" or
+// "300 A+RIGHT". Blank lines and lines starting with '#' are skipped.
+static bool read_input_script(const std::string &path, std::map<uint64_t, uint16_t> &script) {
+    std::FILE *f = std::fopen(path.c_str(), "rb");
+    if (f == nullptr) return false;
+
+    std::string text;
+    char buffer[4096];
+    size_t n;
+    while ((n = std::fread(buffer, 1, sizeof(buffer), f)) != 0) text.append(buffer, n);
+    std::fclose(f);
+
+    size_t line_start = 0;
+    int line_number = 0;
+    while (line_start < text.size()) {
+        size_t line_end = std::min(text.find('\n', line_start), text.size());
+        std::string line = text.substr(line_start, line_end - line_start);
+        line_start = line_end + 1;
+        line_number++;
+
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        size_t first = line.find_first_not_of(" \t");
+        if (first == std::string::npos || line[first] == '#') continue;
+
+        char *end;
+        uint64_t frame = std::strtoull(line.c_str() + first, &end, 10);
+        size_t keys_start = line.find_first_not_of(" \t", end - line.c_str());
+        if (end == line.c_str() + first || keys_start == std::string::npos) {
+            fmt::print(stderr, "{}:{}: expected a frame number and keys\n", path, line_number);
+            return false;
+        }
+        std::string keys_text = line.substr(keys_start, line.find_first_of(" \t", keys_start) - keys_start);
+
+        uint16_t keys = 0;
+        if (keys_text != "-") {
+            size_t name_start = 0;
+            while (name_start <= keys_text.size()) {
+                size_t name_end = std::min(keys_text.find('+', name_start), keys_text.size());
+                std::string name = keys_text.substr(name_start, name_end - name_start);
+                std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::toupper(c); });
+                name_start = name_end + 1;
+
+                auto key = std::find_if(std::begin(key_names), std::end(key_names), [&](const auto &k) { return name == k.name; });
+                if (key == std::end(key_names)) {
+                    fmt::print(stderr, "{}:{}: unknown key '{}'\n", path, line_number, name);
+                    return false;
+                }
+                keys |= key->mask;
+            }
+        }
+        script[frame] = keys;
+    }
+    return true;
+}
+
+static bool write_frame(const std::string &path) {
+    std::FILE *f = std::fopen(path.c_str(), "wb");
+    if (f == nullptr) return false;
+
+    std::string header = fmt::format("P6\n{} {}\n255\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+    std::vector<uint8_t> rgb;
+    rgb.reserve(SCREEN_WIDTH * SCREEN_HEIGHT * 3);
+    for (int y = 0; y < SCREEN_HEIGHT; y++) {
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            uint32_t pixel = gba->screen_pixels[y][x];  // 0xAABBGGRR
+            rgb.push_back(pixel & 0xff);
+            rgb.push_back((pixel >> 8) & 0xff);
+            rgb.push_back((pixel >> 16) & 0xff);
+        }
+    }
+    std::fwrite(header.data(), header.size(), 1, f);
+    std::fwrite(rgb.data(), rgb.size(), 1, f);
+
+    std::fclose(f);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    std::string bios_path = "gba_bios.bin";
+    std::string input_path;
+    std::string frame_path;
+    std::string audio_path;
+    int run_ahead = 0;
+    bool skip_bios = false;
+    bool hle = false;
+    bool jit = false;
+    bool skip_render = false;
+    std::vector<std::string> args;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        bool has_value = i + 1 < argc;
+        if (arg == "--bios" && has_value) {
+            bios_path = argv[++i];
+        } else if (arg == "--skip-bios") {
+            skip_bios = true;
+        } else if (arg == "--hle") {
+            hle = true;
+        } else if (arg == "--jit") {
+            jit = true;
+        } else if (arg == "--run-ahead" && has_value) {
+            run_ahead = std::atoi(argv[++i]);
+        } else if (arg == "--skip-render") {
+            skip_render = true;
+        } else if (arg == "--input" && has_value) {
+            input_path = argv[++i];
+        } else if (arg == "--dump-frame" && has_value) {
+            frame_path = argv[++i];
+        } else if (arg == "--dump-audio" && has_value) {
+            audio_path = argv[++i];
+        } else if (arg.starts_with("--")) {
+            print_usage();
+            return EXIT_FAILURE;
+        } else {
+            args.push_back(arg);
+        }
+    }
+
+    char *end = nullptr;
+    uint64_t num_frames = args.size() == 2 ? std::strtoull(args[1].c_str(), &end, 10) : 0;
+    if (args.size() != 2 || *end != '\0' || num_frames == 0 || run_ahead < 0) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    const std::string &rom_path = args[0];
+
+    std::map<uint64_t, uint16_t> script;
+    if (!input_path.empty() && !read_input_script(input_path, script)) {
+        fmt::print(stderr, "Failed to read input script '{}'\n", input_path);
+        return EXIT_FAILURE;
+    }
+
+    std::FILE *audio_file = nullptr;
+    if (!audio_path.empty()) {
+        audio_file = std::fopen(audio_path.c_str(), "wb");
+        if (audio_file == nullptr) {
+            fmt::print(stderr, "Failed to open audio file '{}'\n", audio_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    arm_init_lookup();
+    thumb_init_lookup();
+
+    gba = system_create_context();
+    gba->skip_bios = skip_bios;
+    gba->bios_hle_enabled = hle;
+    gba->cpu_jit_enabled = jit;
+    system_read_bios_file(bios_path);  // May turn on skip_bios and HLE if there's no BIOS file
+    system_reset(false);
+    if (!system_load_rom(rom_path)) {
+        fmt::print(stderr, "Failed to open ROM file '{}'\n", rom_path);
+        return EXIT_FAILURE;
+    }
+
+    // The GUI's audio thread drains the ring as it plays, here it's done in step with the frames
+    std::vector<int16_t> samples;
+
+    uint16_t keys = 0;
+    auto script_next = script.begin();
+    auto start_time = std::chrono::steady_clock::now();
+
+    for (uint64_t frame = 0; frame < num_frames; frame++) {
+        while (script_next != script.end() && script_next->first <= frame) {
+            keys = script_next->second;
+            ++script_next;
+        }
+        system_set_keys(keys);
+        gba->video_skip_render = (skip_render && frame != num_frames - 1);
+        system_emulate_frame_run_ahead(run_ahead);
+
+        if (audio_file != nullptr) {
+            audio_mix(1, AUDIO_RING_SIZE);
+            samples.resize(audio_buffered() * 2);
+            audio_render(samples.data(), (int) samples.size());
+            std::fwrite(samples.data(), sizeof(int16_t), samples.size(), audio_file);
+        }
+    }
+
+    auto end_time = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end_time - start_time).count();
+    double fps = num_frames / seconds;
+    fmt::print("{} frames in {:.3f} s, {:.1f} fps ({:.1f}x)\n", num_frames, seconds, fps, fps * CYCLES_FRAME / 16777216);
+    uint64_t tile_lookups = gba->tile_cache_hits + gba->tile_cache_misses;
+    if (tile_lookups != 0) {
+        fmt::print("Tile cache: {} hits, {} misses ({:.1f}% hit rate)\n", gba->tile_cache_hits, gba->tile_cache_misses, 100.0 * gba->tile_cache_hits / tile_lookups);
+    }
+
+    if (audio_file != nullptr) std::fclose(audio_file);
+    if (!frame_path.empty() && !write_frame(frame_path)) {
+        fmt::print(stderr, "Failed to write frame file '{}'\n", frame_path);
+        return EXIT_FAILURE;
+    }
+
+    system_destroy_context(gba);  // Save data is left untouched, so batch runs can be repeated
+    return EXIT_SUCCESS;
+}
@@ -46,8 +46,8 @@ typedef struct {
         io_union16 pd;
         io_union32 x0;
         io_union32 y0;
-        double x;
-        double y;
+        int32_t x;  // Internal reference point, 20.8 fixed point
+        int32_t y;
     } bg_affine[2];
     io_union16 winh[2];
     io_union16 winv[2];
@@ -92,7 +92,7 @@ typedef struct {
         io_union16 counter;
         io_union16 reload;
         io_union16 control;
-        uint32_t elapsed;
+        uint64_t start;  // Cycle at which the counter held its stored value
     } timer[4];
 
     // Serial Communication (1)
@@ -120,10 +120,6 @@ typedef struct {
     uint8_t haltcnt;
 } io_registers;
 
-extern io_registers ioreg;
-
-extern bool halted;
-
 // LCD I/O Registers
 #define REG_DISPCNT     0
 #define REG_DISPSTAT    4
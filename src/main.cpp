@@ -2,8 +2,14 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
 #include <stdint.h>
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iterator>
 #include <string>
+#include <vector>
 
 #include <fmt/core.h>
 
@@ -21,25 +27,317 @@
 
 #include "audio.h"
 #include "backup.h"
+#include "bios.h"
+#include "context.h"
 #include "cpu.h"
 #include "gpio.h"
+#include "handoff.h"
 #include "io.h"
 #include "memory.h"
+#include "rewind.h"
 #include "system.h"
 #include "video.h"
 
+#define FRAME_RATE            (16777216.0 / CYCLES_FRAME)  // 59.73 Hz
+#define MAX_FRAMES_PER_UPDATE 16                           // Any further behind than this and the pacer gives up catching up
+#define AUDIO_DEVICE_SAMPLES  1024                         // Frames the audio thread asks for at a time
+#define AUDIO_MAX_RATE_SHIFT  0.005                        // Furthest the rate control bends the pitch to hold the latency
+#define DISASM_LINES          10                           // Instructions shown from the program counter onwards
+#define MEMORY_VIEW_SIZE      0x1000                       // Bytes sent from where the memory window is scrolled to
+
+static const struct {
+    const char *name;
+    double speed;  // 0 for as fast as possible
+} speed_options[] = {
+    {"50%", 0.5},
+    {"100%", 1},
+    {"200%", 2},
+    {"400%", 4},
+    {"Unlimited", 0},
+};
+
+typedef struct {
+    uint16_t keys;
+    bool rewind;
+    bool fast_forward;
+} emulation_input;
+
+typedef uint32_t screen_buffer[SCREEN_HEIGHT][SCREEN_WIDTH];
+
+// Everything the GUI shows of the machine, copied out by the emulation thread with each frame
+typedef struct {
+    screen_buffer screen;
+    uint32_t r[16];  // r15 is the address of the executing instruction
+    uint32_t cpsr;
+    uint32_t ops[DISASM_LINES];
+    uint32_t memory_address;
+    uint8_t memory[MEMORY_VIEW_SIZE];
+    uint32_t dma_src_addr[4];
+    int fifo_a_r, fifo_b_r;
+    int fifo_a_w, fifo_b_w;
+    size_t rewind_bytes;
+    bool has_eeprom;
+    bool has_flash;
+    bool has_sram;
+    bool has_rtc;
+    bool skip_bios;
+    bool bios_hle_enabled;
+    bool bios_stub_installed;
+    bool cpu_jit_enabled;
+} emulation_snapshot;
+
+static SDL_GameController *game_controller;
+static SDL_AudioDeviceID audio_device;
+static GLuint screen_texture;
+
+// Shared between the GUI thread and the emulation thread
+static spsc_queue<emulation_input, 256> input_queue;
+static spsc_queue<std::function<void()>, 64> command_queue;  // Run on the emulation thread between frames
+static triple_buffer<emulation_snapshot> snapshots;
+static std::atomic<bool> emulation_running = true;
+static std::atomic<bool> jit_supported = false;  // Probed once by the emulation thread
+static std::atomic<uint32_t> memory_view_address = 0;
+static std::atomic<int> speed_option = 1;
+static std::atomic<int> run_ahead_frames = 0;
+static std::atomic<double> frame_time = 0;
+static std::atomic<double> achieved_speed = 0;
+static std::atomic<double> tile_cache_hit_rate = 0;
+static std::atomic<int> audio_latency = 64;  // Milliseconds of sound to keep queued
+static bool paused = false;  // Only used on the emulation thread
+
+static void audio_callback(void *userdata, uint8_t *stream, int len) {
+    gba = (gba_context *) userdata;  // SDL's audio thread has no instance of its own
+    audio_render((int16_t *) stream, len / 2);
+}
+
+static SDL_AudioDeviceID audio_init() {
+    SDL_AudioSpec want;
+    std::memset(&want, 0, sizeof(want));
+    want.freq = AUDIO_SAMPLE_RATE;
+    want.format = AUDIO_S16;
+    want.channels = 2;
+    want.samples = AUDIO_DEVICE_SAMPLES;
+    want.callback = audio_callback;
+    want.userdata = gba;
+    SDL_AudioDeviceID device = SDL_OpenAudioDevice(nullptr, 0, &want, nullptr, 0);
+    if (device == 0) {
+        SDL_Log("Failed to open audio device: %s", SDL_GetError());
+        std::exit(EXIT_FAILURE);
+    }
+    SDL_PauseAudioDevice(device, 0);
+    return device;
+}
+
+static void process_input() {
+    static emulation_input last_input;
+    const Uint8 *key_state = SDL_GetKeyboardState(nullptr);
+    uint16_t keys = 0;
+    if (key_state[SDL_SCANCODE_X]) keys |= KEY_A;
+    if (key_state[SDL_SCANCODE_Z]) keys |= KEY_B;
+    if (key_state[SDL_SCANCODE_BACKSPACE]) keys |= KEY_SELECT;
+    if (key_state[SDL_SCANCODE_RETURN]) keys |= KEY_START;
+    if (key_state[SDL_SCANCODE_RIGHT]) keys |= KEY_RIGHT;
+    if (key_state[SDL_SCANCODE_LEFT]) keys |= KEY_LEFT;
+    if (key_state[SDL_SCANCODE_UP]) keys |= KEY_UP;
+    if (key_state[SDL_SCANCODE_DOWN]) keys |= KEY_DOWN;
+    if (key_state[SDL_SCANCODE_S]) keys |= KEY_R;
+    if (key_state[SDL_SCANCODE_A]) keys |= KEY_L;
+    if (game_controller != nullptr) {
+        if (SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_A)) keys |= KEY_A;
+        if (SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_B)) keys |= KEY_B;
+        if (SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_BACK)) keys |= KEY_SELECT;
+        if (SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_START)) keys |= KEY_START;
+        if (SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_DPAD_RIGHT)) keys |= KEY_RIGHT;
+        if (SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_DPAD_LEFT)) keys |= KEY_LEFT;
+        if (SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_DPAD_UP)) keys |= KEY_UP;
+        if (SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_DPAD_DOWN)) keys |= KEY_DOWN;
+        if (SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_RIGHTSHOULDER)) keys |= KEY_R;
+        if (SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_LEFTSHOULDER)) keys |= KEY_L;
+    }
+
+    emulation_input input;
+    input.keys = keys;
+    input.rewind = key_state[SDL_SCANCODE_GRAVE];
+    input.fast_forward = key_state[SDL_SCANCODE_TAB];
+    if (input.keys == last_input.keys && input.rewind == last_input.rewind && input.fast_forward == last_input.fast_forward) return;
+    if (input_queue.push(input)) last_input = input;  // If it's full, try again on the next update
+}
+
+// Queues something to be done on the emulation thread, which keeps to itself everything that
+// changes the machine state
+static void emulation_command(std::function<void()> command) {
+    while (!command_queue.push(command)) SDL_Delay(1);
+}
+
+// Works out how many frames are due at the given speed from the wall clock, so the speed doesn't
+// depend on the display's refresh rate or on vsync. As fast as possible, it's as many frames as
+// fit in a 60 Hz update.
+static int pacer_frames_due(double speed, double frame_time) {
+    static Uint64 start;
+    static uint64_t frames_run;
+    static double last_speed = -1;
+
+    if (speed == 0) {
+        last_speed = speed;
+        return std::clamp((int) (1 / (60 * std::max(frame_time, 1e-4))), 1, MAX_FRAMES_PER_UPDATE);
+    }
+
+    Uint64 now = SDL_GetPerformanceCounter();
+    uint64_t due = (uint64_t) ((double) (now - start) / SDL_GetPerformanceFrequency() * FRAME_RATE * speed);
+    if (speed != last_speed || due > frames_run + MAX_FRAMES_PER_UPDATE) {
+        // Start counting again after a change of speed, or after a pause or stall
+        start = now;
+        frames_run = 0;
+        last_speed = speed;
+        return 1;
+    }
+    int frames = (int) (due - frames_run);
+    frames_run = due;
+    return frames;
+}
+
+// Emulated frames per second relative to the real console, over the last half second or so
+static double measure_speed(int frames) {
+    static Uint64 start;
+    static int frames_run;
+    static double speed;
+
+    Uint64 now = SDL_GetPerformanceCounter();
+    frames_run += frames;
+    double elapsed = (double) (now - start) / SDL_GetPerformanceFrequency();
+    if (elapsed >= 0.5) {
+        speed = frames_run / (elapsed * FRAME_RATE);
+        start = now;
+        frames_run = 0;
+    }
+    return speed;
+}
+
+// Takes the input changes that are due for the next frame. A press and a release of the same key
+// are kept for different frames, so short presses aren't lost when the GUI falls behind.
+static void emulation_take_input(emulation_input &input) {
+    uint16_t pressed = 0;
+    while (emulation_input *next = input_queue.front()) {
+        if (pressed & ~next->keys) break;
+        pressed |= next->keys & ~input.keys;
+        input = *next;
+        input_queue.pop();
+    }
+}
+
+// Queues the sound of the frame just run. The host's audio clock never quite matches ours, so the
+// pitch is bent by a fraction of a percent to keep the ring near the chosen latency.
+static void emulation_mix_audio(double speed) {
+    double target = AUDIO_SAMPLE_RATE * audio_latency.load(std::memory_order_relaxed) / 1000.0;
+    double stretch = (speed == 0 || speed > 1 ? 1 : 1 / speed);  // Slower than real time plays out at a lower pitch
+    stretch *= 1 + AUDIO_MAX_RATE_SHIFT * std::clamp((target - audio_buffered()) / target, -1.0, 1.0);
+    audio_mix(stretch, std::min((size_t) target * 2, (size_t) AUDIO_RING_SIZE));
+}
+
+static void emulation_publish_snapshot(uint32_t memory_address) {
+    emulation_snapshot &snapshot = snapshots.write_buffer();
+    std::memcpy(snapshot.screen, gba->screen_pixels, sizeof(screen_buffer));
+
+    std::copy(std::begin(gba->r), std::end(gba->r), snapshot.r);
+    snapshot.r[REG_PC] = get_pc();
+    snapshot.cpsr = gba->cpsr;
+    for (int i = 0; i < DISASM_LINES; i++) {
+        uint32_t address = snapshot.r[REG_PC] + i * SIZEOF_INSTR;
+        snapshot.ops[i] = (FLAG_T() ? memory_peek_halfword(address) : memory_peek_word(address));
+    }
+    snapshot.memory_address = memory_address;
+    for (uint32_t i = 0; i < MEMORY_VIEW_SIZE; i++) snapshot.memory[i] = memory_peek_byte(memory_address + i);
+
+    for (int i = 0; i < 4; i++) snapshot.dma_src_addr[i] = gba->ioreg.dma[i].src_addr;
+    snapshot.fifo_a_r = gba->ioreg.fifo_a_r;
+    snapshot.fifo_b_r = gba->ioreg.fifo_b_r;
+    snapshot.fifo_a_w = gba->ioreg.fifo_a_w;
+    snapshot.fifo_b_w = gba->ioreg.fifo_b_w;
+    snapshot.rewind_bytes = gba->rewind_bytes;
+    snapshot.has_eeprom = gba->has_eeprom;
+    snapshot.has_flash = gba->has_flash;
+    snapshot.has_sram = gba->has_sram;
+    snapshot.has_rtc = gba->has_rtc;
+    snapshot.skip_bios = gba->skip_bios;
+    snapshot.bios_hle_enabled = gba->bios_hle_enabled;
+    snapshot.bios_stub_installed = gba->bios_stub_installed;
+    snapshot.cpu_jit_enabled = gba->cpu_jit_enabled;
+    snapshots.publish();
+}
+
+static int emulation_thread(void *userdata) {
+    gba = (gba_context *) userdata;
+    emulation_input input = {};
+    uint32_t memory_address = 0;
+    jit_supported.store(cpu_jit_supported(), std::memory_order_relaxed);
+
+    while (emulation_running.load(std::memory_order_relaxed)) {
+        bool updated = false;
+        while (std::function<void()> *command = command_queue.front()) {
+            (*command)();
+            command_queue.pop();
+            updated = true;
+        }
+
+        int frames = 0;
+        if (!paused) {
+            emulation_take_input(input);
+            system_set_keys(input.keys);
+            double speed = (input.fast_forward ? 0 : speed_options[speed_option.load(std::memory_order_relaxed)].speed);
+            frames = (gba->single_step ? 1 : pacer_frames_due(speed, frame_time.load(std::memory_order_relaxed)));
+
+            if (input.rewind && gba->rewind_interval != 0) {
+                bool rewound = false;
+                for (int i = 0; i < frames; i++) rewound |= rewind_step_back();
+                if (rewound) system_emulate_frame();  // Redraw the screen from the restored state
+            } else {
+                int ahead = run_ahead_frames.load(std::memory_order_relaxed);
+                for (int i = 0; i < frames; i++) {
+                    gba->video_skip_render = (i != frames - 1);  // Only the last frame gets shown
+                    Uint64 start = SDL_GetPerformanceCounter();
+                    if (ahead != 0) {
+                        system_emulate_frame_run_ahead(ahead);
+                    } else {
+                        system_emulate_frame();
+                    }
+                    if (gba->single_step) continue;  // A single instruction isn't worth timing, hearing or rewinding to
+                    double elapsed = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+                    frame_time.store(frame_time.load(std::memory_order_relaxed) * 0.95 + elapsed * 0.05, std::memory_order_relaxed);
+                    emulation_mix_audio(speed);
+                    rewind_capture();
+                }
+                gba->video_skip_render = false;
+                achieved_speed.store(measure_speed(frames), std::memory_order_relaxed);
+                uint64_t tile_lookups = gba->tile_cache_hits + gba->tile_cache_misses;
+                if (tile_lookups != 0) tile_cache_hit_rate.store((double) gba->tile_cache_hits / tile_lookups, std::memory_order_relaxed);
+            }
+            if (gba->single_step) paused = true;
+        }
+
+        uint32_t view = memory_view_address.load(std::memory_order_relaxed);
+        if (frames != 0 || updated || view != memory_address) {
+            memory_address = view;
+            emulation_publish_snapshot(memory_address);
+        } else {
+            SDL_Delay(1);  // Nothing due yet
+        }
+    }
+    return 0;
+}
+
 // Main code
 int main(int argc, char *argv[]) {
     arm_init_lookup();
     thumb_init_lookup();
 
-    system_read_bios_file();
+    gba = system_create_context();
+    system_read_bios_file("gba_bios.bin");
     system_reset(false);
 
     if (argc == 2) {
-        skip_bios = true;
+        gba->skip_bios = true;
         const std::string rom_path(argv[1]);
-        system_load_rom(rom_path);
+        if (!system_load_rom(rom_path)) SDL_Log("Failed to load ROM '%s'", rom_path.c_str());
     }
 
     // Setup SDL
@@ -106,7 +404,7 @@ int main(int argc, char *argv[]) {
     SDL_EventState(SDL_DROPFILE, SDL_ENABLE);
 
     // Initalize audio
-    SDL_AudioDeviceID audio_device = audio_init();
+    audio_device = audio_init();
 
     // Initialize gamepad
     SDL_GameControllerAddMappingsFromFile("gamecontrollerdb.txt");
@@ -161,6 +459,13 @@ int main(int argc, char *argv[]) {
     bool show_memory_window = false;
     ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
 
+    // The machine runs on its own thread, so the GUI can't hold it up
+    SDL_Thread *emulation = SDL_CreateThread(emulation_thread, "Emulation", gba);
+    if (emulation == nullptr) {
+        SDL_Log("Failed to create emulation thread: %s", SDL_GetError());
+        std::exit(EXIT_FAILURE);
+    }
+
     // Main loop
     bool done = false;
     while (!done) {
@@ -179,7 +484,9 @@ int main(int argc, char *argv[]) {
             } else if (event.type == SDL_DROPFILE) {
                 char *dropped_file = event.drop.file;
                 const std::string rom_path(dropped_file);
-                system_load_rom(rom_path);
+                emulation_command([=] {
+                    if (!system_load_rom(rom_path)) SDL_Log("Failed to load ROM '%s'", rom_path.c_str());
+                });
                 SDL_free(dropped_file);
             }
         }
@@ -220,20 +527,19 @@ int main(int argc, char *argv[]) {
             ImGui::End();
         }
 
-        system_process_input();
-
-        static bool paused = false;
-        if (!paused) {
-            system_emulate_frame();
-            if (single_step) paused = true;
+        process_input();
+
+        // The GUI only ever looks at the machine through the newest snapshot
+        bool snapshot_updated = snapshots.update();
+        const emulation_snapshot &snapshot = snapshots.read_buffer();
+        if (snapshot_updated) {
+            glBindTexture(GL_TEXTURE_2D, screen_texture);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, SCREEN_WIDTH, SCREEN_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, snapshot.screen);
+            glBindTexture(GL_TEXTURE_2D, 0);
         }
 
-        glBindTexture(GL_TEXTURE_2D, screen_texture);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, SCREEN_WIDTH, SCREEN_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, screen_pixels);
-        glBindTexture(GL_TEXTURE_2D, 0);
-
         // Screen
         static int screen_scale = 3;
         ImGui::Begin("Screen");
@@ -246,21 +552,22 @@ int main(int argc, char *argv[]) {
         if (show_debugger_window) {
             ImGui::Begin("Debugger", &show_debugger_window);
 
+            const uint32_t *r = snapshot.r;
             ImGui::Text("%s", fmt::format(" r0: {:08X}   r1: {:08X}   r2: {:08X}   r3: {:08X}", r[0], r[1], r[2], r[3]).c_str());
             ImGui::Text("%s", fmt::format(" r4: {:08X}   r5: {:08X}   r6: {:08X}   r7: {:08X}", r[4], r[5], r[6], r[7]).c_str());
             ImGui::Text("%s", fmt::format(" r8: {:08X}   r9: {:08X}  r10: {:08X}  r11: {:08X}", r[8], r[9], r[10], r[11]).c_str());
-            ImGui::Text("%s", fmt::format("r12: {:08X}  r13: {:08X}  r14: {:08X}  r15: {:08X}", r[12], r[13], r[14], get_pc()).c_str());
+            ImGui::Text("%s", fmt::format("r12: {:08X}  r13: {:08X}  r14: {:08X}  r15: {:08X}", r[12], r[13], r[14], r[15]).c_str());
 
             std::string cpsr_flag_text;
             std::string cpsr_mode_text;
-            cpsr_flag_text += (cpsr & PSR_N ? "N" : "-");
-            cpsr_flag_text += (cpsr & PSR_Z ? "Z" : "-");
-            cpsr_flag_text += (cpsr & PSR_C ? "C" : "-");
-            cpsr_flag_text += (cpsr & PSR_V ? "V" : "-");
-            cpsr_flag_text += (cpsr & PSR_I ? "I" : "-");
-            cpsr_flag_text += (cpsr & PSR_F ? "F" : "-");
-            cpsr_flag_text += (cpsr & PSR_T ? "T" : "-");
-            switch (cpsr & PSR_MODE) {
+            cpsr_flag_text += (snapshot.cpsr & PSR_N ? "N" : "-");
+            cpsr_flag_text += (snapshot.cpsr & PSR_Z ? "Z" : "-");
+            cpsr_flag_text += (snapshot.cpsr & PSR_C ? "C" : "-");
+            cpsr_flag_text += (snapshot.cpsr & PSR_V ? "V" : "-");
+            cpsr_flag_text += (snapshot.cpsr & PSR_I ? "I" : "-");
+            cpsr_flag_text += (snapshot.cpsr & PSR_F ? "F" : "-");
+            cpsr_flag_text += (snapshot.cpsr & PSR_T ? "T" : "-");
+            switch (snapshot.cpsr & PSR_MODE) {
                 case PSR_MODE_USR: cpsr_mode_text = "User"; break;
                 case PSR_MODE_FIQ: cpsr_mode_text = "FIQ"; break;
                 case PSR_MODE_IRQ: cpsr_mode_text = "IRQ"; break;
@@ -270,34 +577,42 @@ int main(int argc, char *argv[]) {
                 case PSR_MODE_SYS: cpsr_mode_text = "System"; break;
                 default: cpsr_mode_text = "Illegal"; break;
             }
-            ImGui::Text("%s", fmt::format("cpsr: {:08X} [{}] {}", cpsr, cpsr_flag_text, cpsr_mode_text).c_str());
+            ImGui::Text("%s", fmt::format("cpsr: {:08X} [{}] {}", snapshot.cpsr, cpsr_flag_text, cpsr_mode_text).c_str());
 
             if (ImGui::Button("Run")) {
-                paused = false;
-                single_step = false;
+                emulation_command([] {
+                    paused = false;
+                    gba->single_step = false;
+                });
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Pause")) {
+                emulation_command([] { paused = true; });
             }
             ImGui::SameLine();
             if (ImGui::Button("Step")) {
-                paused = false;
-                single_step = true;
+                emulation_command([] {
+                    paused = false;
+                    gba->single_step = true;
+                });
             }
 
             if (ImGui::BeginTable("disassembly", 3, ImGuiTableFlags_Borders | ImGuiTableFlags_Resizable)) {
-                uint32_t pc = get_pc();
-                for (int i = 0; i < 10; i++) {
-                    uint32_t address = pc + i * SIZEOF_INSTR;
+                bool thumb = (snapshot.cpsr & PSR_T);
+                for (int i = 0; i < DISASM_LINES; i++) {
+                    uint32_t address = snapshot.r[REG_PC] + i * (thumb ? 2 : 4);
                     ImGui::TableNextRow();
                     ImGui::TableNextColumn();
                     ImGui::Text("%s", fmt::format("{:08X}", address).c_str());
                     std::string disasm_text;
-                    if (FLAG_T()) {
-                        uint16_t op = memory_peek_halfword(address);
+                    if (thumb) {
+                        uint16_t op = (uint16_t) snapshot.ops[i];
                         ImGui::TableNextColumn();
                         ImGui::Text("%s", fmt::format("{:04X}", op).c_str());
                         ImGui::TableNextColumn();
                         thumb_disasm(address, op, disasm_text);
                     } else {
-                        uint32_t op = memory_peek_word(address);
+                        uint32_t op = snapshot.ops[i];
                         ImGui::TableNextColumn();
                         ImGui::Text("%s", fmt::format("{:08X}", op).c_str());
                         ImGui::TableNextColumn();
@@ -311,30 +626,85 @@ int main(int argc, char *argv[]) {
         }
 
         // Memory
+        // Reads come from the bytes sent with the snapshot, and the emulation thread is told where the
+        // window has scrolled to so it sends the right ones next time
         static MemoryEditor mem_edit;
+        static uint32_t memory_view_lowest;
+        memory_view_lowest = UINT32_MAX;
+        mem_edit.UserData = (void *) &snapshot;
         mem_edit.ReadFn = [](const uint8_t *mem, std::size_t off, void *user_data) {
             UNUSED(mem);
-            UNUSED(user_data);
-            return memory_peek_byte(off);
+            const emulation_snapshot *snapshot = (const emulation_snapshot *) user_data;
+            memory_view_lowest = std::min(memory_view_lowest, (uint32_t) off);
+            uint32_t index = (uint32_t) off - snapshot->memory_address;
+            return (uint8_t) (index < MEMORY_VIEW_SIZE ? snapshot->memory[index] : 0);
         };
         mem_edit.WriteFn = [](uint8_t *mem, std::size_t off, uint8_t d, void *user_data) {
             UNUSED(mem);
             UNUSED(user_data);
-            memory_poke_byte(off, d);
+            emulation_command([=] { memory_poke_byte(off, d); });
         };
         if (show_memory_window) {
             ImGui::Begin("Memory", &show_memory_window);
             mem_edit.DrawContents(nullptr, 0x10000000);
             ImGui::End();
+            if (memory_view_lowest != UINT32_MAX) memory_view_address.store(memory_view_lowest & ~0xf, std::memory_order_relaxed);
         }
 
         // Settings
         ImGui::Begin("Settings");
-        ImGui::Checkbox("Has EEPROM", &has_eeprom);
-        ImGui::Checkbox("Has Flash", &has_flash);
-        ImGui::Checkbox("Has SRAM", &has_sram);
-        ImGui::Checkbox("Has RTC", &has_rtc);
-        ImGui::Checkbox("Skip BIOS", &skip_bios);
+        // Edits go to copies, which the emulation thread picks up between frames
+        bool has_eeprom = snapshot.has_eeprom;
+        bool has_flash = snapshot.has_flash;
+        bool has_sram = snapshot.has_sram;
+        bool has_rtc = snapshot.has_rtc;
+        bool skip = snapshot.skip_bios;
+        bool hle = snapshot.bios_hle_enabled;
+        bool jit = snapshot.cpu_jit_enabled;
+        if (ImGui::Checkbox("Has EEPROM", &has_eeprom)) {
+            emulation_command([=] {
+                gba->has_eeprom = has_eeprom;
+                memory_map_pages();
+            });
+        }
+        if (ImGui::Checkbox("Has Flash", &has_flash)) emulation_command([=] { gba->has_flash = has_flash; });
+        if (ImGui::Checkbox("Has SRAM", &has_sram)) emulation_command([=] { gba->has_sram = has_sram; });
+        if (ImGui::Checkbox("Has RTC", &has_rtc)) {
+            emulation_command([=] {
+                gba->has_rtc = has_rtc;
+                memory_map_pages();
+            });
+        }
+        if (ImGui::Checkbox("Skip BIOS", &skip)) emulation_command([=] { gba->skip_bios = skip; });
+        ImGui::BeginDisabled(snapshot.bios_stub_installed);  // Without a BIOS image there's nothing else to run
+        if (ImGui::Checkbox("HLE BIOS", &hle)) emulation_command([=] { gba->bios_hle_enabled = hle; });
+        ImGui::EndDisabled();
+        if (jit_supported.load(std::memory_order_relaxed) && ImGui::Checkbox("Use JIT", &jit)) emulation_command([=] { gba->cpu_jit_enabled = jit; });
+
+        int speed = speed_option.load(std::memory_order_relaxed);
+        if (ImGui::BeginCombo("Speed", speed_options[speed].name)) {
+            for (int i = 0; i < (int) std::size(speed_options); i++) {
+                if (ImGui::Selectable(speed_options[i].name, i == speed)) speed_option.store(i, std::memory_order_relaxed);
+            }
+            ImGui::EndCombo();
+        }
+        ImGui::SameLine();
+        ImGui::Text("%s", fmt::format("{:.0f}%", achieved_speed.load(std::memory_order_relaxed) * 100).c_str());
+
+        int ahead = run_ahead_frames.load(std::memory_order_relaxed);
+        if (ImGui::SliderInt("Run-ahead", &ahead, 0, 4)) run_ahead_frames.store(ahead, std::memory_order_relaxed);
+        ImGui::SameLine();
+        ImGui::Text("%s", fmt::format("{:.2f} ms/frame", frame_time.load(std::memory_order_relaxed) * 1000).c_str());
+        ImGui::Text("%s", fmt::format("Tile cache: {:.1f}% hits", tile_cache_hit_rate.load(std::memory_order_relaxed) * 100).c_str());
+
+        static bool rewind_enabled = false;
+        if (ImGui::Checkbox("Rewind", &rewind_enabled)) {
+            emulation_command([enabled = rewind_enabled] { rewind_init(enabled ? REWIND_INTERVAL : 0, REWIND_BUDGET); });
+        }
+        if (rewind_enabled) {
+            ImGui::SameLine();
+            ImGui::Text("%s", fmt::format("{:.1f} MB", snapshot.rewind_bytes / 1048576.0).c_str());
+        }
 
         static bool sync_to_video = true;
         ImGui::Checkbox("Sync to video", &sync_to_video);
@@ -344,18 +714,37 @@ int main(int argc, char *argv[]) {
         ImGui::Checkbox("Mute audio", &mute_audio);
         SDL_PauseAudioDevice(audio_device, mute_audio ? 1 : 0);
 
-        ImGui::Text("%s", fmt::format("DMA1SAD: {:08X}", ioreg.dma[1].src_addr).c_str());
-        ImGui::Text("%s", fmt::format("DMA2SAD: {:08X}", ioreg.dma[2].src_addr).c_str());
-        ImGui::Text("%s", fmt::format("fifo_a_r: {}", ioreg.fifo_a_r).c_str());
-        ImGui::Text("%s", fmt::format("fifo_a_w: {}", ioreg.fifo_a_w).c_str());
-        ImGui::Text("%s", fmt::format("fifo_b_r: {}", ioreg.fifo_b_r).c_str());
-        ImGui::Text("%s", fmt::format("fifo_b_w: {}", ioreg.fifo_b_w).c_str());
+        int latency = audio_latency.load(std::memory_order_relaxed);
+        if (ImGui::SliderInt("Audio latency", &latency, 32, 160, "%d ms")) audio_latency.store(latency, std::memory_order_relaxed);
+        ImGui::SameLine();
+        ImGui::Text("%s", fmt::format("{:.0f} ms queued", audio_buffered() * 1000.0 / AUDIO_SAMPLE_RATE).c_str());
+
+        ImGui::Text("%s", fmt::format("DMA1SAD: {:08X}", snapshot.dma_src_addr[1]).c_str());
+        ImGui::Text("%s", fmt::format("DMA2SAD: {:08X}", snapshot.dma_src_addr[2]).c_str());
+        ImGui::Text("%s", fmt::format("fifo_a_r: {}", snapshot.fifo_a_r).c_str());
+        ImGui::Text("%s", fmt::format("fifo_a_w: {}", snapshot.fifo_a_w).c_str());
+        ImGui::Text("%s", fmt::format("fifo_b_r: {}", snapshot.fifo_b_r).c_str());
+        ImGui::Text("%s", fmt::format("fifo_b_w: {}", snapshot.fifo_b_w).c_str());
 
         if (ImGui::Button("Reset")) {
-            system_reset(true);
+            emulation_command([] { system_reset(true); });
         }
         if (ImGui::Button("Manual save")) {
-            system_write_save_file();
+            emulation_command([] { system_write_save_file(); });
+        }
+        static std::vector<uint8_t> state_slot;  // Only used on the emulation thread
+        if (ImGui::Button("Save state")) {
+            emulation_command([] {
+                state_slot.resize(system_state_size());
+                system_save_state(state_slot.data());
+            });
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Load state")) {
+            emulation_command([] {
+                if (state_slot.empty()) return;
+                if (!system_load_state(state_slot.data(), state_slot.size())) SDL_Log("Failed to load state");
+            });
         }
         ImGui::End();
 
@@ -368,7 +757,10 @@ int main(int argc, char *argv[]) {
         SDL_GL_SwapWindow(window);
     }
 
-    if (!save_path.empty()) {
+    emulation_running.store(false, std::memory_order_relaxed);
+    SDL_WaitThread(emulation, nullptr);
+
+    if (!gba->save_path.empty()) {
         system_write_save_file();
     }
 
@@ -389,5 +781,7 @@ int main(int argc, char *argv[]) {
     SDL_DestroyWindow(window);
     SDL_Quit();
 
+    system_destroy_context(gba);
+
     return 0;
 }
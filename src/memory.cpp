@@ -8,6 +8,7 @@
 #include <fmt/core.h>
 
 #include "backup.h"
+#include "context.h"
 #include "cpu.h"
 #include "dma.h"
 #include "gpio.h"
@@ -17,30 +18,20 @@
 
 //#define LOG_BAD_MEMORY_ACCESS
 
-uint8_t system_rom[0x4000];
-uint32_t last_bios_access;
-uint8_t cpu_ewram[0x40000];
-uint8_t cpu_iwram[0x8000];
-uint8_t palette_ram[0x400];
-uint8_t video_ram[0x18000];
-uint8_t object_ram[0x400];
-uint8_t game_rom[0x2000000];
-uint32_t game_rom_size;
-uint32_t game_rom_mask;
 
 uint32_t memory_open_bus() {
-    if (dma_channel_active != -1) {
-        return ioreg.dma[dma_channel_active].value.dw;
-    } else if (get_pc() - dma_pc == SIZEOF_INSTR) {
-        return ioreg.dma[dma_channel_finished].value.dw;
+    if (gba->dma_channel_active != -1) {
+        return gba->ioreg.dma[gba->dma_channel_active].value.dw;
+    } else if (get_pc() - gba->dma_pc == SIZEOF_INSTR) {
+        return gba->ioreg.dma[gba->dma_channel_finished].value.dw;
     } else if (!FLAG_T()) {
-        return arm_pipeline[1];
+        return gba->arm_pipeline[1];
     } else {
-        return thumb_pipeline[1] | thumb_pipeline[1] << 16;
+        return gba->thumb_pipeline[1] | gba->thumb_pipeline[1] << 16;
     }
 }
 
-static uint32_t cycles_byte_or_halfword(uint8_t region) {
+uint32_t cycles_byte_or_halfword(uint8_t region) {
     switch (region) {
         case 0:
         case 3:
@@ -68,7 +59,7 @@ static uint32_t cycles_byte_or_halfword(uint8_t region) {
     }
 }
 
-static uint32_t cycles_word(uint8_t region) {
+uint32_t cycles_word(uint8_t region) {
     switch (region) {
         case 0:
         case 3:
@@ -100,44 +91,147 @@ static uint32_t cycles_word(uint8_t region) {
     }
 }
 
+// Points each page that behaves like plain memory straight at its backing array. The BIOS, I/O,
+// backup and unmapped pages, and game ROM pages with EEPROM, GPIO or open bus in them, are left
+// to the slow path. Must be called again when the cartridge features change.
+void memory_map_pages() {
+    for (uint32_t i = 0; i < PAGE_COUNT; i++) {
+        uint32_t address = i << PAGE_SHIFT;
+        uint8_t region = address >> 24;
+        memory_page &page = gba->memory_pages[i];
+        page.base = nullptr;
+        page.mask = 0;
+        page.cycles_byte_or_halfword = (uint8_t) cycles_byte_or_halfword(region);
+        page.cycles_word = (uint8_t) cycles_word(region);
+        page.flags = 0;
+
+        switch (region) {
+            case 2:
+                page.base = gba->cpu_ewram;
+                page.mask = 0x3ffff;
+                page.flags = PAGE_WRITE | PAGE_WRITE_BYTE | PAGE_CODE;
+                break;
+            case 3:
+                page.base = gba->cpu_iwram;
+                page.mask = 0x7fff;
+                page.flags = PAGE_WRITE | PAGE_WRITE_BYTE | PAGE_CODE;
+                break;
+            case 5:
+                page.base = gba->palette_ram;
+                page.mask = 0x3ff;
+                page.flags = PAGE_WRITE;
+                break;
+            case 7:
+                page.base = gba->object_ram;
+                page.mask = 0x3ff;
+                page.flags = PAGE_WRITE;
+                break;
+            case 8:
+            case 9:
+            case 0xa:
+            case 0xb:
+            case 0xc:
+            case 0xd: {
+                uint32_t offset = address & 0x1ffffff;
+                if (offset + PAGE_MASK > gba->game_rom_mask) break;
+                if (gba->has_rtc && region == 8 && offset == 0) break;
+                if (gba->has_eeprom && region == 0xd) break;
+                page.base = gba->game_rom + offset;
+                page.mask = PAGE_MASK;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    memory_map_vram();
+}
+
+// Called when DISPCNT switches between tiled and bitmap modes, which changes the VRAM OBJ mirror
+void memory_map_vram() {
+    bool bitmap_mode = video_in_bitmap_mode();
+    for (uint32_t i = 0x06000000 >> PAGE_SHIFT; i < 0x07000000 >> PAGE_SHIFT; i++) {
+        uint32_t offset = (i << PAGE_SHIFT) & 0x1ffff;
+        memory_page &page = gba->memory_pages[i];
+        if (offset >= 0x18000) {
+            if (bitmap_mode) {
+                page.base = nullptr;
+                page.flags = 0;
+                continue;
+            }
+            offset -= 0x8000;
+        }
+        page.base = gba->video_ram + offset;
+        page.mask = PAGE_MASK;
+        page.flags = PAGE_WRITE | PAGE_TILES;
+    }
+}
+
 uint8_t rom_read_byte(uint32_t address) {
-    if (address > game_rom_mask) return (uint8_t) ((uint16_t) (address >> 1) >> 8 * (address & 1));
-    return game_rom[address & game_rom_mask];
+    if (address > gba->game_rom_mask) return (uint8_t) ((uint16_t) (address >> 1) >> 8 * (address & 1));
+    return gba->game_rom[address & gba->game_rom_mask];
 }
 
 uint16_t rom_read_halfword(uint32_t address) {
-    if (address > game_rom_mask) return (uint16_t) (address >> 1);
-    return *(uint16_t *) &game_rom[address & (game_rom_mask & ~1)];
+    if (address > gba->game_rom_mask) return (uint16_t) (address >> 1);
+    return *(uint16_t *) &gba->game_rom[address & (gba->game_rom_mask & ~1)];
 }
 
 uint32_t rom_read_word(uint32_t address) {
-    if (address > game_rom_mask) return (uint16_t) ((address & ~2) >> 1) | (uint16_t) ((address | 2) >> 1) << 16;
-    return *(uint32_t *) &game_rom[address & (game_rom_mask & ~3)];
+    if (address > gba->game_rom_mask) return (uint16_t) ((address & ~2) >> 1) | (uint16_t) ((address | 2) >> 1) << 16;
+    return *(uint32_t *) &gba->game_rom[address & (gba->game_rom_mask & ~3)];
+}
+
+static void cpu_cache_write_ewram(uint32_t address) {
+    if (gba->cache_ewram_code[(address & 0x3ffff) >> CODE_LINE_SHIFT]) cpu_cache_invalidate(address);
+}
+
+static void cpu_cache_write_iwram(uint32_t address) {
+    if (gba->cache_iwram_code[(address & 0x7fff) >> CODE_LINE_SHIFT]) cpu_cache_invalidate(address);
+}
+
+// Keeps what's derived from a page up to date when it's written through the fast path
+static void memory_write_watched(const memory_page &page, uint32_t address) {
+    if (page.flags & PAGE_TILES) {
+        video_tile_write(&page.base[address & page.mask] - gba->video_ram);
+    } else if (address >> 24 == 2) {
+        cpu_cache_write_ewram(address);
+    } else {
+        cpu_cache_write_iwram(address);
+    }
 }
 
 uint8_t memory_read_byte(uint32_t address, bool peek) {
+    if (address < 0x10000000) {
+        const memory_page &page = gba->memory_pages[address >> PAGE_SHIFT];
+        if (page.base != nullptr) {
+            if (!peek) system_tick(page.cycles_byte_or_halfword);
+            return page.base[address & page.mask];
+        }
+    }
+
     uint8_t region = address >> 24;
     if (!peek) system_tick(cycles_byte_or_halfword(region));
     switch (region) {
         case 0:
             if (address >= 0x4000) break;
-            if (get_pc() < 0x4000) last_bios_access = address;
-            return system_rom[last_bios_access];
+            if (get_pc() < 0x4000) gba->last_bios_access = address;
+            return gba->system_rom[gba->last_bios_access];
         case 2:
-            return cpu_ewram[address & 0x3ffff];
+            return gba->cpu_ewram[address & 0x3ffff];
         case 3:
-            return cpu_iwram[address & 0x7fff];
+            return gba->cpu_iwram[address & 0x7fff];
         case 4:
             return io_read_byte(address & 0x3ffffff);
         case 5:
-            return palette_ram[address & 0x3ff];
+            return gba->palette_ram[address & 0x3ff];
         case 6:
             address &= 0x1ffff;
             if (video_in_bitmap_mode() && address >= 0x18000) return 0;  // No VRAM OBJ mirror in bitmap mode
             if (address >= 0x18000) address -= 0x8000;
-            return video_ram[address];
+            return gba->video_ram[address];
         case 7:
-            return object_ram[address & 0x3ff];
+            return gba->object_ram[address & 0x3ff];
         case 8:
         case 9:
         case 0xa:
@@ -158,6 +252,16 @@ uint8_t memory_read_byte(uint32_t address, bool peek) {
 }
 
 void memory_write_byte(uint32_t address, uint8_t value, bool poke) {
+    if (address < 0x10000000) {
+        const memory_page &page = gba->memory_pages[address >> PAGE_SHIFT];
+        if (page.flags & PAGE_WRITE_BYTE) {
+            if (!poke) system_tick(page.cycles_byte_or_halfword);
+            if (page.flags & (PAGE_CODE | PAGE_TILES)) memory_write_watched(page, address);
+            page.base[address & page.mask] = value;
+            return;
+        }
+    }
+
     uint8_t region = address >> 24;
     if (!poke) system_tick(cycles_byte_or_halfword(region));
     switch (region) {
@@ -165,22 +269,25 @@ void memory_write_byte(uint32_t address, uint8_t value, bool poke) {
             if (address >= 0x4000) break;
             return;  // Read only
         case 2:
-            cpu_ewram[address & 0x3ffff] = value;
+            cpu_cache_write_ewram(address);
+            gba->cpu_ewram[address & 0x3ffff] = value;
             return;
         case 3:
-            cpu_iwram[address & 0x7fff] = value;
+            cpu_cache_write_iwram(address);
+            gba->cpu_iwram[address & 0x7fff] = value;
             return;
         case 4:
             io_write_byte(address & 0x3ffffff, value);
             return;
         case 5:
-            *(uint16_t *) &palette_ram[address & 0x3fe] = value | value << 8;
+            *(uint16_t *) &gba->palette_ram[address & 0x3fe] = value | value << 8;
             return;
         case 6:
             address &= 0x1fffe;
             if (video_in_bitmap_mode() && address >= 0x18000) return;             // No VRAM OBJ mirror in bitmap mode
             if (address >= (video_in_bitmap_mode() ? 0x14000 : 0x10000)) return;  // VRAM OBJ 8-bit write ignored
-            *(uint16_t *) &video_ram[address] = value | value << 8;
+            video_tile_write(address);
+            *(uint16_t *) &gba->video_ram[address] = value | value << 8;
             return;
         case 7:
             return;  // OAM 8-bit write ignored
@@ -204,38 +311,46 @@ void memory_write_byte(uint32_t address, uint8_t value, bool poke) {
 }
 
 uint16_t memory_read_halfword(uint32_t address, bool peek) {
+    if (address < 0x10000000) {
+        const memory_page &page = gba->memory_pages[address >> PAGE_SHIFT];
+        if (page.base != nullptr) {
+            if (!peek) system_tick(page.cycles_byte_or_halfword);
+            return *(uint16_t *) &page.base[address & page.mask & ~1];
+        }
+    }
+
     uint8_t region = address >> 24;
     if (!peek) system_tick(cycles_byte_or_halfword(region));
     switch (region) {
         case 0:
             if (address >= 0x4000) break;
-            if (get_pc() < 0x4000) last_bios_access = address & 0x3ffe;
-            return *(uint16_t *) &system_rom[last_bios_access];
+            if (get_pc() < 0x4000) gba->last_bios_access = address & 0x3ffe;
+            return *(uint16_t *) &gba->system_rom[gba->last_bios_access];
         case 2:
-            return *(uint16_t *) &cpu_ewram[address & 0x3fffe];
+            return *(uint16_t *) &gba->cpu_ewram[address & 0x3fffe];
         case 3:
-            return *(uint16_t *) &cpu_iwram[address & 0x7ffe];
+            return *(uint16_t *) &gba->cpu_iwram[address & 0x7ffe];
         case 4:
             return io_read_halfword(address & 0x3fffffe);
         case 5:
-            return *(uint16_t *) &palette_ram[address & 0x3fe];
+            return *(uint16_t *) &gba->palette_ram[address & 0x3fe];
         case 6:
             address &= 0x1fffe;
             if (video_in_bitmap_mode() && address >= 0x18000) return 0;  // No VRAM OBJ mirror in bitmap mode
             if (address >= 0x18000) address -= 0x8000;
-            return *(uint16_t *) &video_ram[address];
+            return *(uint16_t *) &gba->video_ram[address];
         case 7:
-            return *(uint16_t *) &object_ram[address & 0x3fe];
+            return *(uint16_t *) &gba->object_ram[address & 0x3fe];
         case 8:
         case 9:
         case 0xa:
         case 0xb:
         case 0xc:
         case 0xd:
-            if (has_eeprom && address >= (game_rom_size <= 0x1000000 ? 0x0d000000 : 0x0dffff00)) {
+            if (gba->has_eeprom && address >= (gba->game_rom_size <= 0x1000000 ? 0x0d000000 : 0x0dffff00)) {
                 return eeprom_read_bit();
             }
-            if (has_rtc && (address >= 0x080000c4 && address < 0x080000ca)) {
+            if (gba->has_rtc && (address >= 0x080000c4 && address < 0x080000ca)) {
                 return gpio_read_halfword(address & 0x1fffffe);
             }
             return rom_read_halfword(address & 0x1fffffe);
@@ -252,6 +367,16 @@ uint16_t memory_read_halfword(uint32_t address, bool peek) {
 }
 
 void memory_write_halfword(uint32_t address, uint16_t value, bool poke) {
+    if (address < 0x10000000) {
+        const memory_page &page = gba->memory_pages[address >> PAGE_SHIFT];
+        if (page.flags & PAGE_WRITE) {
+            if (!poke) system_tick(page.cycles_byte_or_halfword);
+            if (page.flags & (PAGE_CODE | PAGE_TILES)) memory_write_watched(page, address);
+            *(uint16_t *) &page.base[address & page.mask & ~1] = value;
+            return;
+        }
+    }
+
     uint8_t region = address >> 24;
     if (!poke) system_tick(cycles_byte_or_halfword(region));
     switch (region) {
@@ -259,25 +384,28 @@ void memory_write_halfword(uint32_t address, uint16_t value, bool poke) {
             if (address >= 0x4000) break;
             return;  // Read only
         case 2:
-            *(uint16_t *) &cpu_ewram[address & 0x3fffe] = value;
+            cpu_cache_write_ewram(address);
+            *(uint16_t *) &gba->cpu_ewram[address & 0x3fffe] = value;
             return;
         case 3:
-            *(uint16_t *) &cpu_iwram[address & 0x7ffe] = value;
+            cpu_cache_write_iwram(address);
+            *(uint16_t *) &gba->cpu_iwram[address & 0x7ffe] = value;
             return;
         case 4:
             io_write_halfword(address & 0x3fffffe, value);
             return;
         case 5:
-            *(uint16_t *) &palette_ram[address & 0x3fe] = value;
+            *(uint16_t *) &gba->palette_ram[address & 0x3fe] = value;
             return;
         case 6:
             address &= 0x1fffe;
             if (video_in_bitmap_mode() && address >= 0x18000) return;  // No VRAM OBJ mirror in bitmap mode
             if (address >= 0x18000) address -= 0x8000;
-            *(uint16_t *) &video_ram[address] = value;
+            video_tile_write(address);
+            *(uint16_t *) &gba->video_ram[address] = value;
             return;
         case 7:
-            *(uint16_t *) &object_ram[address & 0x3fe] = value;
+            *(uint16_t *) &gba->object_ram[address & 0x3fe] = value;
             return;
         case 8:
         case 9:
@@ -285,11 +413,11 @@ void memory_write_halfword(uint32_t address, uint16_t value, bool poke) {
         case 0xb:
         case 0xc:
         case 0xd:
-            if (has_eeprom && address >= (game_rom_size <= 0x1000000 ? 0x0d000000 : 0x0dffff00)) {
+            if (gba->has_eeprom && address >= (gba->game_rom_size <= 0x1000000 ? 0x0d000000 : 0x0dffff00)) {
                 eeprom_write_bit(value);
                 return;
             }
-            if (has_rtc && (address >= 0x080000c4 && address < 0x080000ca)) {
+            if (gba->has_rtc && (address >= 0x080000c4 && address < 0x080000ca)) {
                 gpio_write_halfword(address & 0x1fffffe, value);
                 return;
             }
@@ -306,28 +434,36 @@ void memory_write_halfword(uint32_t address, uint16_t value, bool poke) {
 }
 
 uint32_t memory_read_word(uint32_t address, bool peek) {
+    if (address < 0x10000000) {
+        const memory_page &page = gba->memory_pages[address >> PAGE_SHIFT];
+        if (page.base != nullptr) {
+            if (!peek) system_tick(page.cycles_word);
+            return *(uint32_t *) &page.base[address & page.mask & ~3];
+        }
+    }
+
     uint8_t region = address >> 24;
     if (!peek) system_tick(cycles_word(region));
     switch (region) {
         case 0:
             if (address >= 0x4000) break;
-            if (get_pc() < 0x4000) last_bios_access = address & 0x3ffc;
-            return *(uint32_t *) &system_rom[last_bios_access];
+            if (get_pc() < 0x4000) gba->last_bios_access = address & 0x3ffc;
+            return *(uint32_t *) &gba->system_rom[gba->last_bios_access];
         case 2:
-            return *(uint32_t *) &cpu_ewram[address & 0x3fffc];
+            return *(uint32_t *) &gba->cpu_ewram[address & 0x3fffc];
         case 3:
-            return *(uint32_t *) &cpu_iwram[address & 0x7ffc];
+            return *(uint32_t *) &gba->cpu_iwram[address & 0x7ffc];
         case 4:
             return io_read_word(address & 0x3fffffc);
         case 5:
-            return *(uint32_t *) &palette_ram[address & 0x3fc];
+            return *(uint32_t *) &gba->palette_ram[address & 0x3fc];
         case 6:
             address &= 0x1fffc;
             if (video_in_bitmap_mode() && address >= 0x18000) return 0;  // No VRAM OBJ mirror in bitmap mode
             if (address >= 0x18000) address -= 0x8000;
-            return *(uint32_t *) &video_ram[address];
+            return *(uint32_t *) &gba->video_ram[address];
         case 7:
-            return *(uint32_t *) &object_ram[address & 0x3fc];
+            return *(uint32_t *) &gba->object_ram[address & 0x3fc];
         case 8:
         case 9:
         case 0xa:
@@ -348,6 +484,16 @@ uint32_t memory_read_word(uint32_t address, bool peek) {
 }
 
 void memory_write_word(uint32_t address, uint32_t value, bool poke) {
+    if (address < 0x10000000) {
+        const memory_page &page = gba->memory_pages[address >> PAGE_SHIFT];
+        if (page.flags & PAGE_WRITE) {
+            if (!poke) system_tick(page.cycles_word);
+            if (page.flags & (PAGE_CODE | PAGE_TILES)) memory_write_watched(page, address);
+            *(uint32_t *) &page.base[address & page.mask & ~3] = value;
+            return;
+        }
+    }
+
     uint8_t region = address >> 24;
     if (!poke) system_tick(cycles_word(region));
     switch (region) {
@@ -355,25 +501,28 @@ void memory_write_word(uint32_t address, uint32_t value, bool poke) {
             if (address >= 0x4000) break;
             return;  // Read only
         case 2:
-            *(uint32_t *) &cpu_ewram[address & 0x3fffc] = value;
+            cpu_cache_write_ewram(address);
+            *(uint32_t *) &gba->cpu_ewram[address & 0x3fffc] = value;
             return;
         case 3:
-            *(uint32_t *) &cpu_iwram[address & 0x7ffc] = value;
+            cpu_cache_write_iwram(address);
+            *(uint32_t *) &gba->cpu_iwram[address & 0x7ffc] = value;
             return;
         case 4:
             io_write_word(address & 0x3fffffc, value);
             return;
         case 5:
-            *(uint32_t *) &palette_ram[address & 0x3fc] = value;
+            *(uint32_t *) &gba->palette_ram[address & 0x3fc] = value;
             return;
         case 6:
             address &= 0x1fffc;
             if (video_in_bitmap_mode() && address >= 0x18000) return;  // No VRAM OBJ mirror in bitmap mode
             if (address >= 0x18000) address -= 0x8000;
-            *(uint32_t *) &video_ram[address] = value;
+            video_tile_write(address);
+            *(uint32_t *) &gba->video_ram[address] = value;
             return;
         case 7:
-            *(uint32_t *) &object_ram[address & 0x3fc] = value;
+            *(uint32_t *) &gba->object_ram[address & 0x3fc] = value;
             return;
         case 8:
         case 9:
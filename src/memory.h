@@ -5,18 +5,30 @@
 
 #include <stdint.h>
 
-extern uint8_t system_rom[0x4000];
-extern uint32_t last_bios_access;
-extern uint8_t cpu_ewram[0x40000];
-extern uint8_t cpu_iwram[0x8000];
-extern uint8_t palette_ram[0x400];
-extern uint8_t video_ram[0x18000];
-extern uint8_t object_ram[0x400];
-extern uint8_t game_rom[0x2000000];
-extern uint32_t game_rom_size;
-extern uint32_t game_rom_mask;
+#define PAGE_SHIFT 14  // 16 KB pages
+#define PAGE_MASK  ((1 << PAGE_SHIFT) - 1)
+#define PAGE_COUNT (0x10000000 >> PAGE_SHIFT)  // Everything above is unmapped
+
+#define PAGE_WRITE      (1 << 0)  // Halfword and word writes can go straight to memory
+#define PAGE_WRITE_BYTE (1 << 1)  // So can byte writes
+#define PAGE_CODE       (1 << 2)  // Writes must check for cached code
+#define PAGE_TILES      (1 << 3)  // Writes must mark decoded tiles as stale
+
+struct memory_page {
+    uint8_t *base;  // Host memory for the page, or nullptr if accesses need the slow path
+    uint32_t mask;  // Applied to the address to get the offset into base
+    uint8_t cycles_byte_or_halfword;
+    uint8_t cycles_word;
+    uint8_t flags;
+};
+
 
 uint32_t memory_open_bus();
+uint32_t cycles_byte_or_halfword(uint8_t region);
+uint32_t cycles_word(uint8_t region);
+
+void memory_map_pages();
+void memory_map_vram();
 
 uint8_t rom_read_byte(uint32_t address);
 uint16_t rom_read_halfword(uint32_t address);
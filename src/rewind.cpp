@@ -0,0 +1,144 @@
+// Copyright (c) 2021 Ridge Shrubsall
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "rewind.h"
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "context.h"
+#include "system.h"
+
+// The newest snapshot is kept whole, and each delta is the XOR of a snapshot with the one before
+// it, so stepping back only decodes one delta into the newest snapshot. Most of the state doesn't
+// change between snapshots, so the XOR is run-length coded a 64-bit word at a time as pairs of
+// (unchanged words, changed words) counts, each pair followed by the changed words themselves.
+
+static uint64_t load_word(const uint8_t *p) {
+    uint64_t x;
+    std::memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+static void store_word(uint8_t *p, uint64_t x) {
+    std::memcpy(p, &x, sizeof(x));
+}
+
+static uint8_t *write_count(uint8_t *out, size_t count) {
+    while (count >= 0x80) {
+        *out++ = (uint8_t) (count | 0x80);
+        count >>= 7;
+    }
+    *out++ = (uint8_t) count;
+    return out;
+}
+
+static const uint8_t *read_count(const uint8_t *in, size_t &count) {
+    count = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = *in++;
+        count |= (size_t) (byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return in;
+}
+
+// Returns the number of bytes written to out, which has room for the worst case
+static size_t rewind_encode(const uint8_t *older, const uint8_t *newer, size_t size, uint8_t *out) {
+    uint8_t *start = out;
+    size_t words = size / 8;
+    size_t i = 0;
+    while (i < words) {
+        size_t same_start = i;
+        while (i < words && load_word(&older[i * 8]) == load_word(&newer[i * 8])) i++;
+        size_t diff_start = i;
+        while (i < words && load_word(&older[i * 8]) != load_word(&newer[i * 8])) i++;
+
+        out = write_count(out, diff_start - same_start);
+        out = write_count(out, i - diff_start);
+        for (size_t j = diff_start; j < i; j++) {
+            store_word(out, load_word(&older[j * 8]) ^ load_word(&newer[j * 8]));
+            out += 8;
+        }
+    }
+    return out - start;
+}
+
+static void rewind_decode(const std::vector<uint8_t> &delta, uint8_t *state) {
+    const uint8_t *in = delta.data();
+    const uint8_t *end = in + delta.size();
+    uint8_t *p = state;
+    while (in < end) {
+        size_t same, diff;
+        in = read_count(in, same);
+        in = read_count(in, diff);
+        p += same * 8;
+        for (size_t j = 0; j < diff; j++) {
+            store_word(p, load_word(p) ^ load_word(in));
+            p += 8;
+            in += 8;
+        }
+    }
+}
+
+void rewind_init(int interval, size_t budget) {
+    rewind_clear();
+    gba->rewind_interval = interval;
+    gba->rewind_budget = budget;
+
+    size_t size = (system_state_size() + 7) & ~(size_t) 7;  // Padded to whole words with zeros
+    gba->rewind_snapshot.assign(interval != 0 ? size : 0, 0);
+    gba->rewind_scratch.assign(interval != 0 ? size : 0, 0);
+    gba->rewind_encoded.resize(interval != 0 ? size + size / 8 + 16 : 0);
+}
+
+void rewind_clear() {
+    gba->rewind_deltas.clear();
+    gba->rewind_bytes = 0;
+    gba->rewind_frames = 0;
+    gba->rewind_has_snapshot = false;
+}
+
+// Called after each frame that runs forwards
+void rewind_capture() {
+    if (gba->rewind_interval == 0 || ++gba->rewind_frames < gba->rewind_interval) return;
+    gba->rewind_frames = 0;
+
+    system_save_state(gba->rewind_scratch.data());
+    if (gba->rewind_has_snapshot) {
+        size_t size = gba->rewind_snapshot.size();
+        size_t length = rewind_encode(gba->rewind_snapshot.data(), gba->rewind_scratch.data(), size, gba->rewind_encoded.data());
+
+        // Reuse the oldest deltas' memory once the budget is used up
+        std::vector<uint8_t> delta;
+        while (!gba->rewind_deltas.empty() && gba->rewind_bytes + length > gba->rewind_budget) {
+            delta = std::move(gba->rewind_deltas.front());
+            gba->rewind_deltas.pop_front();
+            gba->rewind_bytes -= delta.size();
+        }
+        delta.assign(gba->rewind_encoded.begin(), gba->rewind_encoded.begin() + length);
+        gba->rewind_deltas.push_back(std::move(delta));
+        gba->rewind_bytes += length;
+    }
+    std::swap(gba->rewind_snapshot, gba->rewind_scratch);
+    gba->rewind_has_snapshot = true;
+}
+
+// Goes back to the newest snapshot, or to the one before it if no frames have been captured since
+bool rewind_step_back() {
+    if (!gba->rewind_has_snapshot) return false;
+
+    if (gba->rewind_frames == 0) {
+        if (gba->rewind_deltas.empty()) return false;
+        rewind_decode(gba->rewind_deltas.back(), gba->rewind_snapshot.data());
+        gba->rewind_bytes -= gba->rewind_deltas.back().size();
+        gba->rewind_deltas.pop_back();
+    }
+    gba->rewind_frames = 0;
+    return system_load_state(gba->rewind_snapshot.data(), system_state_size());
+}
@@ -0,0 +1,15 @@
+// Copyright (c) 2021 Ridge Shrubsall
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+
+#define REWIND_INTERVAL 4                  // Frames between snapshots
+#define REWIND_BUDGET   (64 * 1024 * 1024)  // Bytes of deltas kept, several minutes for most games
+
+void rewind_init(int interval, size_t budget);
+void rewind_clear();
+void rewind_capture();
+bool rewind_step_back();
@@ -0,0 +1,69 @@
+// Copyright (c) 2021 Ridge Shrubsall
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include "scheduler.h"
+
+#include <stdint.h>
+#include <cassert>
+
+#include "context.h"
+#include "timer.h"
+#include "video.h"
+
+void (*const event_handler[NUM_EVENTS])(uint64_t) = {
+    [](uint64_t when) { timer_event(0, when); },
+    [](uint64_t when) { timer_event(1, when); },
+    [](uint64_t when) { timer_event(2, when); },
+    [](uint64_t when) { timer_event(3, when); },
+    video_event,
+};
+
+static void scheduler_find_next_event() {
+    gba->scheduler_next_event = EVENT_NEVER;
+    for (int i = 0; i < NUM_EVENTS; i++) {
+        if (gba->event_deadline[i] < gba->scheduler_next_event) {
+            gba->scheduler_next_event = gba->event_deadline[i];
+        }
+    }
+}
+
+void scheduler_reset() {
+    gba->scheduler_cycles = 0;
+    for (int i = 0; i < NUM_EVENTS; i++) {
+        gba->event_deadline[i] = EVENT_NEVER;
+    }
+    gba->scheduler_next_event = EVENT_NEVER;
+}
+
+void scheduler_add(int event, uint64_t when) {
+    assert(event >= 0 && event < NUM_EVENTS);
+    gba->event_deadline[event] = when;
+    scheduler_find_next_event();
+}
+
+void scheduler_remove(int event) {
+    assert(event >= 0 && event < NUM_EVENTS);
+    gba->event_deadline[event] = EVENT_NEVER;
+    scheduler_find_next_event();
+}
+
+void scheduler_dispatch() {
+    // Handlers can tick the clock (e.g. via DMA) and re-enter, so each event is
+    // unscheduled before its handler runs.
+    while (gba->scheduler_cycles >= gba->scheduler_next_event) {
+        for (int i = 0; i < NUM_EVENTS; i++) {
+            uint64_t when = gba->event_deadline[i];
+            if (when != gba->scheduler_next_event) continue;
+            gba->event_deadline[i] = EVENT_NEVER;
+            scheduler_find_next_event();
+            event_handler[i](when);
+            break;
+        }
+    }
+}
+
+void scheduler_skip_to_next_event() {
+    if (gba->scheduler_next_event == EVENT_NEVER) return;
+    if (gba->scheduler_cycles < gba->scheduler_next_event) gba->scheduler_cycles = gba->scheduler_next_event;
+    scheduler_dispatch();
+}
@@ -0,0 +1,21 @@
+// Copyright (c) 2021 Ridge Shrubsall
+// SPDX-License-Identifier: BSD-3-Clause
+
+#pragma once
+
+#include <stdint.h>
+
+#define EVENT_TIMER0 0
+#define EVENT_TIMER1 1
+#define EVENT_TIMER2 2
+#define EVENT_TIMER3 3
+#define EVENT_VIDEO  4
+#define NUM_EVENTS   5
+
+#define EVENT_NEVER UINT64_MAX
+
+void scheduler_reset();
+void scheduler_add(int event, uint64_t when);
+void scheduler_remove(int event);
+void scheduler_dispatch();
+void scheduler_skip_to_next_event();
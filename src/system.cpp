@@ -6,304 +6,552 @@
 #include <stdint.h>
 #include <algorithm>
 #include <bit>
-#include <cassert>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <functional>
-#include <map>
+#include <set>
 #include <string>
 #include <tuple>
 
-#include <SDL.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <fmt/core.h>
 
 #include "backup.h"
+#include "bios.h"
+#include "context.h"
 #include "cpu.h"
 #include "dma.h"
 #include "gpio.h"
 #include "io.h"
 #include "memory.h"
+#include "rewind.h"
+#include "scheduler.h"
 #include "timer.h"
 #include "video.h"
 
-SDL_GameController *game_controller;
+thread_local constinit gba_context *gba;
+
+static uint8_t game_rom_empty[4];  // Stands in for the cartridge until a ROM is loaded
+
+#define IDLE_LOOP_MAX_CYCLES 256  // Longest pass through a loop that still counts as spinning
+#define IDLE_LOOP_CONFIRM    8    // Passes in a row before a newly found idle loop is trusted
 
-bool skip_bios;
-bool single_step;
-std::string save_path;
-uint32_t idle_loop_address;
-uint16_t idle_loop_last_irq;
+#define STATE_MAGIC   0x54534247  // "GBST"
+#define STATE_VERSION 3           // Bump whenever the machine state in gba_context changes
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;        // Bytes of machine state that follow the header
+    uint8_t game_id[16];  // Title and game code from the cartridge header
+} state_header;
 
 void system_reset(bool keep_save_data) {
-    std::memset(cpu_ewram, 0, sizeof(cpu_ewram));
-    std::memset(cpu_iwram, 0, sizeof(cpu_iwram));
-    std::memset(&ioreg, 0, sizeof(ioreg));
-    std::memset(palette_ram, 0, sizeof(palette_ram));
-    std::memset(video_ram, 0, sizeof(video_ram));
-    std::memset(object_ram, 0, sizeof(object_ram));
+    std::memset(gba->cpu_ewram, 0, sizeof(gba->cpu_ewram));
+    std::memset(gba->cpu_iwram, 0, sizeof(gba->cpu_iwram));
+    std::memset(&gba->ioreg, 0, sizeof(gba->ioreg));
+    std::memset(gba->palette_ram, 0, sizeof(gba->palette_ram));
+    std::memset(gba->video_ram, 0, sizeof(gba->video_ram));
+    video_tile_cache_flush();
+    std::memset(gba->object_ram, 0, sizeof(gba->object_ram));
     if (!keep_save_data) backup_erase();
     backup_init();
     gpio_init();
+    bios_init();
     io_init_keypad_interrupt();
 
-    std::memset(r, 0, sizeof(uint32_t) * 16);
-    arm_init_registers(skip_bios);
-    branch_taken = true;
-
-    halted = false;
-    dma_channel_active = -1;
-    dma_channel_finished = 0;
-    dma_pc = 0;
-
-    video_cycles = 0;
-    ioreg.dispcnt.w = 0x80;
-    ioreg.bg_affine[0].pa.w = 0x100;
-    ioreg.bg_affine[0].pd.w = 0x100;
-    ioreg.bg_affine[1].pa.w = 0x100;
-    ioreg.bg_affine[1].pd.w = 0x100;
-    last_bios_access = 0;
-
-    if (skip_bios) {
+    std::memset(gba->r, 0, sizeof(uint32_t) * 16);
+    arm_init_registers(gba->skip_bios);
+    gba->branch_taken = true;
+    cpu_cache_flush();
+
+    gba->halted = false;
+    gba->idle_loop_head = 0;
+    gba->idle_loop_passes = 0;
+    gba->dma_channel_active = -1;
+    gba->dma_channel_finished = 0;
+    gba->dma_pc = 0;
+
+    scheduler_reset();
+    gba->ioreg.dispcnt.w = 0x80;
+    gba->ioreg.bg_affine[0].pa.w = 0x100;
+    gba->ioreg.bg_affine[0].pd.w = 0x100;
+    gba->ioreg.bg_affine[1].pa.w = 0x100;
+    gba->ioreg.bg_affine[1].pd.w = 0x100;
+    gba->last_bios_access = 0;
+    memory_map_pages();
+
+    if (gba->skip_bios) {
         // Mario & Luigi: Superstar Saga
-        video_cycles = CYCLES_SCANLINE * 126 + 859;
-        ioreg.vcount.w = 126;
+        video_init(CYCLES_SCANLINE * 126 + 859);
 
-        ioreg.soundcnt_h.w = 0x880e;
-        ioreg.soundbias.w = 0x200;
+        gba->ioreg.soundcnt_h.w = 0x880e;
+        gba->ioreg.soundbias.w = 0x200;
 
         // Beyblade V-Force: Ultimate Blader Jam, Pac-Man World
-        ioreg.fifo_a_ticks = 11;
-        ioreg.fifo_b_ticks = 11;
+        gba->ioreg.fifo_a_ticks = 11;
+        gba->ioreg.fifo_b_ticks = 11;
 
         // Sonic Advance
-        ioreg.rcnt.w = 0x8000;
+        gba->ioreg.rcnt.w = 0x8000;
 
-        ioreg.postflg = 1;
-        last_bios_access = 0xe4;
+        gba->ioreg.postflg = 1;
+        gba->last_bios_access = 0xe4;
+    } else {
+        video_init(0);
     }
 }
 
-void system_read_bios_file() {
-    SDL_RWops *rw = SDL_RWFromFile("gba_bios.bin", "rb");
-    if (rw == nullptr) {
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Missing BIOS file", "Failed to open BIOS file 'gba_bios.bin'.", nullptr);
-        std::exit(EXIT_FAILURE);
+// Loads the BIOS for the current instance only, so others keep their own image and options
+void system_read_bios_file(const std::string &bios_path) {
+    std::FILE *f = std::fopen(bios_path.c_str(), "rb");
+    if (f == nullptr) {
+        // Fall back to emulating the BIOS calls, which only works for games started past the boot logo
+        fmt::print(stderr, "Failed to open BIOS file '{}', using HLE BIOS\n", bios_path);
+        bios_install_stub();
+        gba->skip_bios = true;
+        return;
+    }
+
+    std::fread(gba->system_rom, sizeof(gba->system_rom), 1, f);
+    gba->bios_stub_installed = false;
+
+    std::fclose(f);
+}
+
+// The ROM is given a window rounded up to a power of two, so that reads between the end of the
+// image and game_rom_mask return zeros. Only the pages that get touched take up memory.
+// Returns nullptr, with nothing left open or mapped, if the file can't be used.
+static uint8_t *system_map_rom_file(const std::string &rom_path, uint32_t &size, uint32_t &mask) {
+#ifdef _WIN32
+    std::FILE *f = std::fopen(rom_path.c_str(), "rb");
+    if (f == nullptr) return nullptr;
+
+    std::fseek(f, 0, SEEK_END);
+    long length = std::ftell(f);
+    std::rewind(f);
+    if (length <= 0) {
+        std::fclose(f);
+        return nullptr;
+    }
+    size = (uint32_t) std::min<long>(length, 0x2000000);
+    mask = std::bit_ceil(size) - 1;
+    uint8_t *rom = (uint8_t *) VirtualAlloc(nullptr, mask + 1, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (rom == nullptr) {
+        std::fclose(f);
+        return nullptr;
+    }
+    bool ok = (std::fread(rom, size, 1, f) == 1);
+    std::fclose(f);
+
+    // Read only from here on, like the file mapping elsewhere
+    DWORD old_protect;
+    if (!ok || !VirtualProtect(rom, mask + 1, PAGE_READONLY, &old_protect)) {
+        VirtualFree(rom, 0, MEM_RELEASE);
+        return nullptr;
+    }
+    return rom;
+#else
+    int fd = open(rom_path.c_str(), O_RDONLY);
+    if (fd == -1) return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+        close(fd);
+        return nullptr;
+    }
+    size = (uint32_t) std::min<off_t>(st.st_size, 0x2000000);
+    mask = std::bit_ceil(size) - 1;
+    void *window = mmap(nullptr, mask + 1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (window == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+    }
+    void *rom = mmap(window, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    close(fd);
+    if (rom == MAP_FAILED) {
+        munmap(window, mask + 1);
+        return nullptr;
     }
+    return (uint8_t *) rom;
+#endif
+}
 
-    SDL_RWread(rw, system_rom, sizeof(system_rom), 1);
+static void system_unmap_rom_file() {
+#ifdef _WIN32
+    VirtualFree(gba->game_rom, 0, MEM_RELEASE);
+#else
+    munmap(gba->game_rom, gba->game_rom_mask + 1);
+#endif
+}
 
-    SDL_RWclose(rw);
+static void system_set_rom(uint8_t *rom, uint32_t size, uint32_t mask) {
+    if (gba->game_rom_size != 0) {
+        system_unmap_rom_file();
+    }
+    gba->game_rom = rom;
+    gba->game_rom_size = size;
+    gba->game_rom_mask = mask;
 }
 
-static void system_read_rom_file(const std::string &rom_path) {
-    std::memset(game_rom, 0, sizeof(game_rom));
+// Each line holds the title, code and version of a game, then the address of an idle loop, separated by tabs
+static void system_read_idle_loops() {
+    gba->idle_loops.clear();
+    gba->idle_loops_changed = false;
+
+    std::FILE *f = std::fopen(gba->idle_loop_path.c_str(), "rb");
+    if (f == nullptr) return;
+
+    std::string text;
+    char buffer[4096];
+    size_t n;
+    while ((n = std::fread(buffer, 1, sizeof(buffer), f)) != 0) text.append(buffer, n);
+    std::fclose(f);
+
+    size_t line_start = 0;
+    while (line_start < text.size()) {
+        size_t line_end = std::min(text.find('\n', line_start), text.size());
+        std::string line = text.substr(line_start, line_end - line_start);
+        line_start = line_end + 1;
+
+        size_t tab1 = line.find('\t');
+        size_t tab2 = line.find('\t', tab1 + 1);
+        size_t tab3 = line.find('\t', tab2 + 1);
+        if (tab1 == std::string::npos || tab2 == std::string::npos || tab3 == std::string::npos) continue;
+        auto key = std::make_tuple(line.substr(0, tab1), line.substr(tab1 + 1, tab2 - tab1 - 1),
+                                   (uint8_t) std::strtoul(line.c_str() + tab2 + 1, nullptr, 10));
+        if (key == gba->game_key) {
+            gba->idle_loops.insert((uint32_t) std::strtoul(line.c_str() + tab3 + 1, nullptr, 16));
+        }
+    }
+}
+
+// Rewrites the file with every loop found so far. This is left until the game is unloaded or the
+// instance destroyed, so nothing is written while frames, run-ahead ones included, are running.
+static void system_write_idle_loops() {
+    if (!gba->idle_loops_changed) return;
+    gba->idle_loops_changed = false;
 
-    SDL_RWops *rw = SDL_RWFromFile(rom_path.c_str(), "rb");
-    if (rw == nullptr) return;
+    std::FILE *f = std::fopen(gba->idle_loop_path.c_str(), "wb");
+    if (f == nullptr) return;
 
-    SDL_RWseek(rw, 0, RW_SEEK_END);
-    game_rom_size = SDL_RWtell(rw);
-    assert(game_rom_size != 0);
-    game_rom_mask = std::bit_ceil(game_rom_size) - 1;
-    SDL_RWseek(rw, 0, RW_SEEK_SET);
-    if (game_rom_size <= sizeof(game_rom)) {
-        SDL_RWread(rw, game_rom, game_rom_size, 1);
+    const auto &[game_title, game_code, game_version] = gba->game_key;
+    for (uint32_t address : gba->idle_loops) {
+        std::string line = fmt::format("{}\t{}\t{}\t{:08x}\n", game_title, game_code, game_version, address);
+        std::fwrite(line.data(), line.size(), 1, f);
     }
 
-    SDL_RWclose(rw);
+    std::fclose(f);
 }
 
-static void system_read_save_file() {
-    SDL_RWops *rw = SDL_RWFromFile(save_path.c_str(), "rb");
-    if (rw == nullptr) return;
+// The new instance still needs a system_reset once it is bound to a thread
+gba_context *system_create_context() {
+    gba_context *context = new gba_context();
+    context->game_rom = game_rom_empty;
+    return context;
+}
 
-    if (has_eeprom) {
-        SDL_RWread(rw, backup_eeprom, sizeof(backup_eeprom), 1);
-    } else if (has_flash) {
-        SDL_RWread(rw, backup_flash, sizeof(backup_flash), 1);
-    } else if (has_sram) {
-        SDL_RWread(rw, backup_sram, sizeof(backup_sram), 1);
+void system_destroy_context(gba_context *context) {
+    gba_context *current = gba;
+    gba = context;
+    system_write_idle_loops();
+    if (gba->game_rom_size != 0) system_unmap_rom_file();
+    cpu_jit_release();
+    gba = (current != context ? current : nullptr);
+    delete context;
+}
+
+static void system_read_save_file() {
+    std::FILE *f = std::fopen(gba->save_path.c_str(), "rb");
+    if (f == nullptr) return;
+
+    if (gba->has_eeprom) {
+        std::fread(gba->backup_eeprom, sizeof(gba->backup_eeprom), 1, f);
+    } else if (gba->has_flash) {
+        std::fread(gba->backup_flash, sizeof(gba->backup_flash), 1, f);
+    } else if (gba->has_sram) {
+        std::fread(gba->backup_sram, sizeof(gba->backup_sram), 1, f);
     }
 
-    SDL_RWclose(rw);
+    std::fclose(f);
 }
 
 void system_write_save_file() {
-    if (!has_eeprom && !has_flash && !has_sram) return;
+    if (!gba->has_eeprom && !gba->has_flash && !gba->has_sram) return;
 
-    SDL_RWops *rw = SDL_RWFromFile(save_path.c_str(), "wb");
-    if (rw == nullptr) return;
+    std::FILE *f = std::fopen(gba->save_path.c_str(), "wb");
+    if (f == nullptr) return;
 
-    if (has_eeprom) {
-        SDL_RWwrite(rw, backup_eeprom, sizeof(backup_eeprom), 1);
-    } else if (has_flash) {
-        SDL_RWwrite(rw, backup_flash, sizeof(backup_flash), 1);
-    } else if (has_sram) {
-        SDL_RWwrite(rw, backup_sram, sizeof(backup_sram), 1);
+    if (gba->has_eeprom) {
+        std::fwrite(gba->backup_eeprom, sizeof(gba->backup_eeprom), 1, f);
+    } else if (gba->has_flash) {
+        std::fwrite(gba->backup_flash, sizeof(gba->backup_flash), 1, f);
+    } else if (gba->has_sram) {
+        std::fwrite(gba->backup_sram, sizeof(gba->backup_sram), 1, f);
     }
 
-    SDL_RWclose(rw);
+    std::fclose(f);
+}
+
+// The machine state is everything in gba_context before game_rom, so a save state is a header
+// followed by a copy of that block.
+static size_t system_machine_state_size() {
+    return (uint8_t *) &gba->game_rom - (uint8_t *) gba;
+}
+
+size_t system_state_size() {
+    return sizeof(state_header) + system_machine_state_size();
+}
+
+void system_save_state(uint8_t *state) {
+    state_header header;
+    header.magic = STATE_MAGIC;
+    header.version = STATE_VERSION;
+    header.size = (uint32_t) system_machine_state_size();
+    std::memset(header.game_id, 0, sizeof(header.game_id));
+    if (gba->game_rom_size >= 0xb0) std::memcpy(header.game_id, &gba->game_rom[0xa0], sizeof(header.game_id));
+
+    std::memcpy(state, &header, sizeof(header));
+    std::memcpy(state + sizeof(header), gba, header.size);
+}
+
+bool system_load_state(const uint8_t *state, size_t size) {
+    if (size != system_state_size()) return false;
+
+    state_header header;
+    std::memcpy(&header, state, sizeof(header));
+    uint8_t game_id[sizeof(header.game_id)] = {};
+    if (gba->game_rom_size >= 0xb0) std::memcpy(game_id, &gba->game_rom[0xa0], sizeof(game_id));
+    if (header.magic != STATE_MAGIC || header.version != STATE_VERSION || header.size != system_machine_state_size() ||
+        std::memcmp(header.game_id, game_id, sizeof(game_id)) != 0) {
+        return false;
+    }
+
+    std::memcpy((uint8_t *) gba, state + sizeof(header), header.size);
+
+    // Rebuild the host state that depends on what was just loaded
+    cpu_cache_flush();
+    memory_map_pages();
+    video_tile_cache_flush();
+    gba->timer_counter_read = false;
+    gba->idle_loop_head = 0;
+    gba->idle_loop_passes = 0;
+    return true;
 }
 
 static bool rom_contains_string(const std::string &s) {
-    const uint8_t *text_begin = game_rom;
-    const uint8_t *text_end = text_begin + game_rom_size;
+    const uint8_t *text_begin = gba->game_rom;
+    const uint8_t *text_end = text_begin + gba->game_rom_size;
     const uint8_t *pattern_begin = (const uint8_t *) s.c_str();
     const uint8_t *pattern_end = pattern_begin + s.length();
     const auto it = std::search(text_begin, text_end, std::boyer_moore_searcher(pattern_begin, pattern_end));
     return it != text_end;
 }
 
-const std::map<std::tuple<std::string, std::string, uint8_t>, uint32_t> idle_loop_address_map{
-    {{"ADVANCEWARS", "AWRE", 0}, 0x80387ec},   // Advance Wars (USA)
-    {{"ADVANCEWARS", "AWRE", 1}, 0x8038818},   // Advance Wars (USA) (Rev 1)
-    {{"DRILL DOZER", "V49E", 0}, 0x80006ba},   // Drill Dozer (USA)
-    {{"FFTA_USVER.", "AFXE", 0}, 0x8000418},   // Final Fantasy Tactics Advance (USA, Australia)
-    {{"KURURIN", "AKRP", 0}, 0x800041a},       // Kurukuru Kururin (Europe)
-    {{"POKEMON EMER", "BPEE", 0}, 0x80008c6},  // Pokemon - Emerald Version (USA, Europe)
-    {{"POKEMON FIRE", "BPRE", 0}, 0x80008aa},  // Pokemon - FireRed Version (USA)
-    {{"POKEMON FIRE", "BPRE", 1}, 0x80008be},  // Pokemon - FireRed Version (USA, Europe) (Rev 1)
-    {{"POKEMON LEAF", "BPGE", 0}, 0x80008aa},  // Pokemon - LeafGreen Version (USA)
-    {{"POKEMON LEAF", "BPGE", 1}, 0x80008be},  // Pokemon - LeafGreen Version (USA, Europe) (Rev 1)
-};
-
 static void system_detect_cartridge_features() {
-    has_eeprom = false;
-    has_flash = false;
-    has_sram = false;
-    has_rtc = false;
-    idle_loop_address = 0;
+    gba->has_eeprom = false;
+    gba->has_flash = false;
+    gba->has_sram = false;
+    gba->has_rtc = false;
 
     if (rom_contains_string("EEPROM_V")) {
-        has_eeprom = true;
+        gba->has_eeprom = true;
     }
     if (rom_contains_string("FLASH_V") || rom_contains_string("FLASH512_V")) {
-        has_flash = true;
-        flash_manufacturer = MANUFACTURER_PANASONIC;
-        flash_device = DEVICE_MN63F805MNP;
+        gba->has_flash = true;
+        gba->flash_manufacturer = MANUFACTURER_PANASONIC;
+        gba->flash_device = DEVICE_MN63F805MNP;
     }
     if (rom_contains_string("FLASH1M_V")) {
-        has_flash = true;
-        flash_manufacturer = MANUFACTURER_SANYO;
-        flash_device = DEVICE_LE26FV10N1TS;
+        gba->has_flash = true;
+        gba->flash_manufacturer = MANUFACTURER_SANYO;
+        gba->flash_device = DEVICE_LE26FV10N1TS;
     }
     if (rom_contains_string("SRAM_V") || rom_contains_string("SRAM_F_V")) {
-        has_sram = true;
+        gba->has_sram = true;
     }
     if (rom_contains_string("SIIRTC_V")) {
-        has_rtc = true;
+        gba->has_rtc = true;
     }
 
-    std::string game_title((char *) &game_rom[0xa0], 12);
+    std::string game_title((char *) &gba->game_rom[0xa0], 12);
     if (const auto it = std::find(game_title.begin(), game_title.end(), '\0'); it != game_title.end()) {
         game_title.erase(it, game_title.end());
     }
-    std::string game_code((char *) &game_rom[0xac], 4);
+    std::string game_code((char *) &gba->game_rom[0xac], 4);
     if (const auto it = std::find(game_code.begin(), game_code.end(), '\0'); it != game_code.end()) {
         game_code.erase(it, game_code.end());
     }
-    uint8_t game_version = game_rom[0xbc];
+    uint8_t game_version = gba->game_rom[0xbc];
 
-    auto key = std::make_tuple(game_title, game_code, game_version);
+    gba->game_key = std::make_tuple(game_title, game_code, game_version);
 
-    if (idle_loop_address_map.contains(key)) {
-        idle_loop_address = idle_loop_address_map.at(key);
+    if (gba->game_key == std::make_tuple("MONKEYBALLJR", "ALUE", 0)) {  // Super Monkey Ball Jr. (USA)
+        gba->has_eeprom = true;
+        gba->has_flash = gba->has_sram = false;
+    } else if (gba->game_key == std::make_tuple("TOPGUN CZ", "A2YE", 0)) {  // Top Gun - Combat Zones (USA) (En,Fr,De,Es,It)
+        gba->has_eeprom = gba->has_flash = gba->has_sram = false;
     }
-    if (key == std::make_tuple("MONKEYBALLJR", "ALUE", 0)) {  // Super Monkey Ball Jr. (USA)
-        has_eeprom = true;
-        has_flash = has_sram = false;
-    } else if (key == std::make_tuple("TOPGUN CZ", "A2YE", 0)) {  // Top Gun - Combat Zones (USA) (En,Fr,De,Es,It)
-        has_eeprom = has_flash = has_sram = false;
+}
+
+// Called when the CPU has just branched. Once a loop that can only be waiting for an
+// interrupt or I/O to change has spun enough times, nothing it reads can change before
+// the next event, so the time in between is skipped.
+static void system_check_idle_loop() {
+    uint32_t address = gba->r[REG_PC];
+    bool thumb = FLAG_T();
+    cpu_block *block = &gba->block_cache[block_cache_index(address)];
+    if (block->tag != (address | (thumb ? 1 : 0)) || !block->idle) {
+        gba->idle_loop_head = 0;
+        return;
+    }
+
+    bool spinning = (address == gba->idle_loop_head && gba->scheduler_cycles - gba->idle_loop_cycles <= IDLE_LOOP_MAX_CYCLES);
+    if (spinning && gba->timer_counter_read) {
+        // Waiting on a timer, which counts between events
+        block->idle = false;
+        gba->idle_loop_head = 0;
+        return;
     }
+    gba->timer_counter_read = false;
+    gba->idle_loop_passes = (spinning ? gba->idle_loop_passes + 1 : 0);
+    gba->idle_loop_head = address;
+
+    if (gba->idle_loop_passes == IDLE_LOOP_CONFIRM && !gba->idle_loops.contains(address)) {
+        gba->idle_loops.insert(address);
+        gba->idle_loops_changed = true;
+    }
+    if (gba->idle_loop_passes != 0 && gba->idle_loops.contains(address) && !(gba->ioreg.irq.w & gba->ioreg.ie.w)) {
+        scheduler_skip_to_next_event();
+    }
+    gba->idle_loop_cycles = gba->scheduler_cycles;
 }
 
-void system_load_rom(const std::string &rom_path) {
+// Leaves the current game running if the new one can't be loaded
+bool system_load_rom(const std::string &rom_path) {
     const std::string rom_ext{".gba"};
-    if (!rom_path.ends_with(rom_ext)) return;
+    if (!rom_path.ends_with(rom_ext)) return false;
+
+    uint32_t size, mask;
+    uint8_t *rom = system_map_rom_file(rom_path, size, mask);
+    if (rom == nullptr) return false;
 
-    if (!save_path.empty()) {
+    if (!gba->save_path.empty()) {
         system_write_save_file();
     }
-    save_path = rom_path;
-    std::string::size_type n = save_path.rfind(rom_ext);
-    save_path.replace(n, rom_ext.length(), ".sav");
+    system_write_idle_loops();
+    // The save data and the idle loops found for the game are kept next to the ROM
+    std::string rom_base = rom_path.substr(0, rom_path.length() - rom_ext.length());
+    gba->save_path = rom_base + ".sav";
+    gba->idle_loop_path = rom_base + ".idle";
 
     system_reset(false);
-    system_read_rom_file(rom_path);
+    system_set_rom(rom, size, mask);
     system_detect_cartridge_features();
+    memory_map_pages();
+    system_read_idle_loops();
     system_read_save_file();
+    rewind_clear();
+    return true;
 }
 
-void system_process_input() {
-    const Uint8 *key_state = SDL_GetKeyboardState(nullptr);
-    static bool keys[10];
-    std::memset(keys, 0, sizeof(keys));
-    keys[0] |= (bool) key_state[SDL_SCANCODE_X];          // Button A
-    keys[1] |= (bool) key_state[SDL_SCANCODE_Z];          // Button B
-    keys[2] |= (bool) key_state[SDL_SCANCODE_BACKSPACE];  // Select
-    keys[3] |= (bool) key_state[SDL_SCANCODE_RETURN];     // Start
-    keys[4] |= (bool) key_state[SDL_SCANCODE_RIGHT];      // Right
-    keys[5] |= (bool) key_state[SDL_SCANCODE_LEFT];       // Left
-    keys[6] |= (bool) key_state[SDL_SCANCODE_UP];         // Up
-    keys[7] |= (bool) key_state[SDL_SCANCODE_DOWN];       // Down
-    keys[8] |= (bool) key_state[SDL_SCANCODE_S];          // Button R
-    keys[9] |= (bool) key_state[SDL_SCANCODE_A];          // Button L
-    if (game_controller != nullptr) {
-        keys[0] |= (bool) SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_A);              // Button A
-        keys[1] |= (bool) SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_B);              // Button B
-        keys[2] |= (bool) SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_BACK);           // Select
-        keys[3] |= (bool) SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_START);          // Start
-        keys[4] |= (bool) SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_DPAD_RIGHT);     // Right
-        keys[5] |= (bool) SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_DPAD_LEFT);      // Left
-        keys[6] |= (bool) SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_DPAD_UP);        // Up
-        keys[7] |= (bool) SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_DPAD_DOWN);      // Down
-        keys[8] |= (bool) SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_RIGHTSHOULDER);  // Button R
-        keys[9] |= (bool) SDL_GameControllerGetButton(game_controller, SDL_CONTROLLER_BUTTON_LEFTSHOULDER);   // Button L
-    }
-    if (keys[4] && keys[5]) keys[4] = keys[5] = false;  // Disallow opposing directions
-    if (keys[6] && keys[7]) keys[6] = keys[7] = false;
-    ioreg.keyinput.w = 0x3ff;
-    for (int i = 0; i < 10; i++) {
-        if (keys[i]) {
-            ioreg.keyinput.w &= ~(1 << i);
-        }
-    }
+void system_set_keys(uint16_t keys) {
+    if ((keys & KEY_RIGHT) && (keys & KEY_LEFT)) keys &= ~(KEY_RIGHT | KEY_LEFT);  // Disallow opposing directions
+    if ((keys & KEY_UP) && (keys & KEY_DOWN)) keys &= ~(KEY_UP | KEY_DOWN);
+    gba->ioreg.keyinput.w = 0x3ff & ~keys;
 }
 
 void system_emulate_frame() {
-    video_frame_drawn = false;
+    gba->video_frame_drawn = false;
 
     while (true) {
         if (FLAG_T()) {
-            if (branch_taken) thumb_fill_pipeline();
-            if (!halted) thumb_step();
+            if (gba->branch_taken) thumb_fill_pipeline();
+            if (!gba->halted) thumb_step();
         } else {
-            if (branch_taken) arm_fill_pipeline();
-            if (!halted) arm_step();
+            if (gba->branch_taken) arm_fill_pipeline();
+            if (!gba->halted) arm_step();
         }
 
-        // Idle loop optimization
-        if (idle_loop_address != 0 && idle_loop_address == get_pc()) {
-            bool vblank_raised = (idle_loop_last_irq & INT_VBLANK);
-            bool vblank_handled = !(ioreg.irq.w & INT_VBLANK);
-            if (!(vblank_raised && vblank_handled)) {
-                halted = true;
-            }
-            idle_loop_last_irq = ioreg.irq.w;
-        }
+        if (gba->branch_taken) system_check_idle_loop();
 
-        if (ioreg.irq.w & ioreg.ie.w) {
-            halted = false;
-            if (!branch_taken && !(cpsr & PSR_I) && ioreg.ime.w) {
+        if (gba->ioreg.irq.w & gba->ioreg.ie.w) {
+            gba->halted = false;
+            if (!gba->branch_taken && !(gba->cpsr & PSR_I) && gba->ioreg.ime.w) {
                 arm_hardware_interrupt();
             }
         }
 
-        if (halted) system_idle();
-        if (video_frame_drawn || (single_step && !halted)) break;
+        // Nothing can wake the CPU before the next event, so skip straight to it
+        if (gba->halted) scheduler_skip_to_next_event();
+        if (gba->video_frame_drawn || (gba->single_step && !gba->halted)) break;
+    }
+
+    cpu_cache_end_frame();
+}
+
+// Puts back a state saved earlier in this run. Unlike system_load_state, compiled blocks are only
+// dropped where RAM differs from the saved copy, so the block cache stays warm. Decoded tiles are
+// treated the same way.
+static void system_restore_run_ahead_state(const uint8_t *state) {
+    const uint8_t *machine = state + sizeof(state_header);
+    const uint8_t *ewram = machine + (gba->cpu_ewram - (uint8_t *) gba);
+    const uint8_t *iwram = machine + (gba->cpu_iwram - (uint8_t *) gba);
+    const uint8_t *vram = machine + (gba->video_ram - (uint8_t *) gba);
+    for (uint32_t i = 0; i < sizeof(gba->cache_ewram_code); i++) {
+        uint32_t offset = i << CODE_LINE_SHIFT;
+        if (gba->cache_ewram_code[i] && std::memcmp(&gba->cpu_ewram[offset], &ewram[offset], CODE_LINE_MASK + 1) != 0) {
+            cpu_cache_invalidate(0x02000000 | offset);
+        }
+    }
+    for (uint32_t i = 0; i < sizeof(gba->cache_iwram_code); i++) {
+        uint32_t offset = i << CODE_LINE_SHIFT;
+        if (gba->cache_iwram_code[i] && std::memcmp(&gba->cpu_iwram[offset], &iwram[offset], CODE_LINE_MASK + 1) != 0) {
+            cpu_cache_invalidate(0x03000000 | offset);
+        }
+    }
+    for (uint32_t offset = 0; offset < sizeof(gba->video_ram); offset += 32) {
+        if (std::memcmp(&gba->video_ram[offset], &vram[offset], 32) != 0) video_tile_write(offset);
     }
+
+    std::memcpy((uint8_t *) gba, machine, system_machine_state_size());
+    gba->arm_cache_instr = nullptr;
+    gba->thumb_cache_instr = nullptr;
+    memory_map_vram();
+    gba->timer_counter_read = false;
+    gba->idle_loop_head = 0;
+    gba->idle_loop_passes = 0;
 }
 
-void system_tick(uint32_t cycles) {
-    timer_update(cycles);
-    video_update(cycles);
+// Runs a frame, then runs the given number of frames past it with the same keys and shows the
+// last of those, so the screen answers input that many frames sooner. Everything else the extra
+// frames did, sound included, is undone afterwards.
+void system_emulate_frame_run_ahead(int frames) {
+    if (frames == 0) {
+        system_emulate_frame();
+        return;
+    }
+
+    bool skip_render = gba->video_skip_render;
+    gba->video_skip_render = true;
+    system_emulate_frame();
+    gba->run_ahead_state.resize(system_state_size());
+    system_save_state(gba->run_ahead_state.data());
+    for (int i = 0; i < frames; i++) {
+        gba->video_skip_render = (skip_render || i != frames - 1);
+        system_emulate_frame();
+    }
+    gba->video_skip_render = skip_render;
+    system_restore_run_ahead_state(gba->run_ahead_state.data());
 }
@@ -4,9 +4,11 @@
 #pragma once
 
 #include <stdint.h>
+#include <cstddef>
 #include <string>
 
-#include <SDL.h>
+#include "context.h"
+#include "scheduler.h"
 
 #define INT_VBLANK (1 << 0)
 #define INT_HBLANK (1 << 1)
@@ -23,19 +25,34 @@
 #define INT_BUTTON (1 << 12)
 #define INT_CART   (1 << 13)
 
-extern SDL_GameController *game_controller;
-
-extern bool skip_bios;
-extern bool single_step;
-extern std::string save_path;
-
+#define KEY_A      (1 << 0)
+#define KEY_B      (1 << 1)
+#define KEY_SELECT (1 << 2)
+#define KEY_START  (1 << 3)
+#define KEY_RIGHT  (1 << 4)
+#define KEY_LEFT   (1 << 5)
+#define KEY_UP     (1 << 6)
+#define KEY_DOWN   (1 << 7)
+#define KEY_R      (1 << 8)
+#define KEY_L      (1 << 9)
+
+gba_context *system_create_context();
+void system_destroy_context(gba_context *context);
 void system_reset(bool keep_save_data);
-void system_read_bios_file();
+void system_read_bios_file(const std::string &bios_path);
 void system_write_save_file();
-void system_load_rom(const std::string &rom_path);
-void system_process_input();
+bool system_load_rom(const std::string &rom_path);
+size_t system_state_size();
+void system_save_state(uint8_t *state);
+bool system_load_state(const uint8_t *state, size_t size);
+void system_set_keys(uint16_t keys);
 void system_emulate_frame();
-void system_tick(uint32_t cycles);
+void system_emulate_frame_run_ahead(int frames);
+
+inline void system_tick(uint32_t cycles) {
+    gba->scheduler_cycles += cycles;
+    if (gba->scheduler_cycles >= gba->scheduler_next_event) scheduler_dispatch();
+}
 
 inline void system_idle() {
     system_tick(1);
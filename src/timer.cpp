@@ -4,78 +4,102 @@
 #include "timer.h"
 
 #include <stdint.h>
-#include <cstdlib>
 
+#include "context.h"
 #include "cpu.h"
 #include "dma.h"
 #include "io.h"
+#include "scheduler.h"
 
-void timer_reset(int i) {
-    ioreg.timer[i].counter.w = ioreg.timer[i].reload.w;
-    ioreg.timer[i].elapsed = 0;
+const int prescaler_shift[4] = {0, 6, 8, 10};
+
+static bool timer_running(int i) {
+    uint16_t control = gba->ioreg.timer[i].control.w;
+    return (control & TM_ENABLE) && !(control & TM_CASCADE);
 }
 
-void timer_update(uint32_t cycles) {
-    bool overflow = false;
+static uint64_t timer_ticks(int i) {
+    int shift = prescaler_shift[gba->ioreg.timer[i].control.w & TM_FREQ_MASK];
+    return (gba->scheduler_cycles - gba->ioreg.timer[i].start) >> shift;
+}
 
-    for (int i = 0; i < 4; i++) {
-        uint16_t &counter = ioreg.timer[i].counter.w;
-        uint16_t reload = ioreg.timer[i].reload.w;
-        uint16_t control = ioreg.timer[i].control.w;
-        uint32_t &elapsed = ioreg.timer[i].elapsed;
+uint16_t timer_read_counter(int i) {
+    uint16_t counter = gba->ioreg.timer[i].counter.w;
+    if (!timer_running(i)) return counter;
+    gba->timer_counter_read = true;
 
-        if (!(control & TM_ENABLE)) {
-            overflow = false;
-            continue;
-        }
+    uint64_t ticks = timer_ticks(i);
+    uint32_t ticks_to_overflow = 0x10000 - counter;
+    if (ticks < ticks_to_overflow) return counter + ticks;
 
-        int increment = 0;
-        if (control & TM_CASCADE) {
-            increment = (overflow ? 1 : 0);
-        } else {
-            elapsed += cycles;
-            uint32_t freq;
-            switch (control & TM_FREQ_MASK) {
-                case TM_FREQ_1: freq = 1; break;
-                case TM_FREQ_64: freq = 64; break;
-                case TM_FREQ_256: freq = 256; break;
-                case TM_FREQ_1024: freq = 1024; break;
-                default: std::abort();
-            }
-            if (elapsed >= freq) {
-                increment = elapsed / freq;
-                elapsed = elapsed % freq;
-            }
-        }
+    // Overflow not dispatched yet, so count on from the reload value
+    uint16_t reload = gba->ioreg.timer[i].reload.w;
+    return reload + (ticks - ticks_to_overflow) % (0x10000 - reload);
+}
+
+void timer_sync(int i) {
+    if (timer_running(i)) {
+        int shift = prescaler_shift[gba->ioreg.timer[i].control.w & TM_FREQ_MASK];
+        uint64_t ticks = timer_ticks(i);
+        gba->ioreg.timer[i].counter.w = timer_read_counter(i);
+        gba->ioreg.timer[i].start += ticks << shift;  // Keep the prescaler phase
+    } else {
+        gba->ioreg.timer[i].start = gba->scheduler_cycles;
+    }
+}
+
+void timer_reset(int i) {
+    gba->ioreg.timer[i].counter.w = gba->ioreg.timer[i].reload.w;
+    gba->ioreg.timer[i].start = gba->scheduler_cycles;
+}
+
+void timer_schedule(int i) {
+    if (timer_running(i)) {
+        int shift = prescaler_shift[gba->ioreg.timer[i].control.w & TM_FREQ_MASK];
+        uint64_t ticks_to_overflow = 0x10000 - gba->ioreg.timer[i].counter.w;
+        scheduler_add(EVENT_TIMER0 + i, gba->ioreg.timer[i].start + (ticks_to_overflow << shift));
+    } else {
+        scheduler_remove(EVENT_TIMER0 + i);
+    }
+}
+
+static void timer_overflow(int i) {
+    bool fifo_a_tick = BIT(gba->ioreg.soundcnt_h.w, 10) == i;
+    bool fifo_b_tick = BIT(gba->ioreg.soundcnt_h.w, 14) == i;
+    bool refill = false;
+    if (fifo_a_tick) {
+        gba->ioreg.fifo_a_ticks = (gba->ioreg.fifo_a_ticks + 1) % 16;
+        if (gba->ioreg.fifo_a_ticks == 0) gba->ioreg.fifo_a_refill = refill = true;
+    }
+    if (fifo_b_tick) {
+        gba->ioreg.fifo_b_ticks = (gba->ioreg.fifo_b_ticks + 1) % 16;
+        if (gba->ioreg.fifo_b_ticks == 0) gba->ioreg.fifo_b_refill = refill = true;
+    }
+    if (refill) {
+        // A request the DMA can't serve yet, because a transfer is under way, stays set until that transfer ends
+        dma_update(DMA_AT_REFRESH);
+    }
+    if (gba->ioreg.timer[i].control.w & TM_IRQ) {
+        gba->ioreg.irq.w |= 1 << (3 + i);
+    }
 
-        overflow = false;
-        for (int n = 0; n < increment; n++) {
+    if (i < 3) {
+        uint16_t control = gba->ioreg.timer[i + 1].control.w;
+        if ((control & TM_ENABLE) && (control & TM_CASCADE)) {
+            uint16_t &counter = gba->ioreg.timer[i + 1].counter.w;
             counter++;
             if (counter == 0) {
-                counter = reload;
-                overflow = true;
-            }
-        }
-
-        if (overflow) {
-            bool fifo_a_tick = BIT(ioreg.soundcnt_h.w, 10) == i;
-            bool fifo_b_tick = BIT(ioreg.soundcnt_h.w, 14) == i;
-            if (fifo_a_tick) {
-                ioreg.fifo_a_ticks = (ioreg.fifo_a_ticks + 1) % 16;
-                if (ioreg.fifo_a_ticks == 0) ioreg.fifo_a_refill = true;
-            }
-            if (fifo_b_tick) {
-                ioreg.fifo_b_ticks = (ioreg.fifo_b_ticks + 1) % 16;
-                if (ioreg.fifo_b_ticks == 0) ioreg.fifo_b_refill = true;
-            }
-            if (ioreg.fifo_a_refill || ioreg.fifo_b_refill) {
-                dma_update(DMA_AT_REFRESH);
-                ioreg.fifo_a_refill = false;
-                ioreg.fifo_b_refill = false;
-            }
-            if (control & TM_IRQ) {
-                ioreg.irq.w |= 1 << (3 + i);
+                counter = gba->ioreg.timer[i + 1].reload.w;
+                timer_overflow(i + 1);
             }
         }
     }
 }
+
+void timer_event(int i, uint64_t when) {
+    // Reschedule first, since FIFO refill DMA can tick the clock
+    gba->ioreg.timer[i].counter.w = gba->ioreg.timer[i].reload.w;
+    gba->ioreg.timer[i].start = when;
+    timer_schedule(i);
+    timer_overflow(i);
+}
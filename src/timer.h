@@ -14,5 +14,8 @@
 #define TM_ENABLE    (1 << 7)
 #define TM_FREQ_MASK 3
 
+uint16_t timer_read_counter(int i);
+void timer_sync(int i);
 void timer_reset(int i);
-void timer_update(uint32_t cycles);
+void timer_schedule(int i);
+void timer_event(int i, uint64_t when);
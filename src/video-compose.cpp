@@ -0,0 +1,236 @@
+// Copyright (c) 2021 Ridge Shrubsall
+// SPDX-License-Identifier: BSD-3-Clause
+
+// Turns the top two layers of each pixel into final screen colours, applying the blend effects
+// with the hardware's 4-bit integer coefficients. There's a scalar version for any host, and SSE2
+// and AVX2 versions for x86-64, picked at runtime by what the CPU supports.
+
+#include "video.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+#endif
+
+#include "cpu.h"
+
+static_assert(SCREEN_WIDTH % 16 == 0, "The vector versions work in blocks of 8 and 16 pixels");
+
+typedef void (*compose_kernel)(const ScanlineInfo &scanline, const BlendInfo &blend, const uint32_t *lut, uint32_t *out);
+
+static int blend_alpha(int a, int b, const BlendInfo &blend) {
+    int c = (a * blend.eva + b * blend.evb) >> 4;
+    return (c > 31 ? 31 : c);
+}
+
+static int blend_brighten(int a, const BlendInfo &blend) {
+    return a + (((31 - a) * blend.evy) >> 4);
+}
+
+static int blend_darken(int a, const BlendInfo &blend) {
+    return a - ((a * blend.evy) >> 4);
+}
+
+[[maybe_unused]] static void compose_line_scalar(const ScanlineInfo &scanline, const BlendInfo &blend, const uint32_t *lut, uint32_t *out) {
+    for (int x = 0; x < SCREEN_WIDTH; x++) {
+        uint16_t top = scanline.top[x];
+        uint16_t bottom = scanline.bottom[x];
+        bool enable_blend = scanline.flags[x] & ScanlineFlags::EnableBlend;
+        bool sprite_transparency = scanline.flags[x] & ScanlineFlags::SpriteTransparency;
+        bool top_ok = BIT(blend.top_bgs, scanline.top_bg[x]);
+        bool bottom_ok = BIT(blend.bottom_bgs, scanline.bottom_bg[x]);
+
+        int mode = (enable_blend && top_ok ? blend.mode : 0);
+        if (mode == 1 && !bottom_ok) mode = 0;
+        if (sprite_transparency && bottom_ok) mode = 1;  // Semi-transparent sprites always alpha blend
+
+        int red = BITS(top, 0, 4);
+        int green = BITS(top, 5, 9);
+        int blue = BITS(top, 10, 14);
+
+        switch (mode) {
+            case 1:
+                red = blend_alpha(red, BITS(bottom, 0, 4), blend);
+                green = blend_alpha(green, BITS(bottom, 5, 9), blend);
+                blue = blend_alpha(blue, BITS(bottom, 10, 14), blend);
+                break;
+            case 2:
+                red = blend_brighten(red, blend);
+                green = blend_brighten(green, blend);
+                blue = blend_brighten(blue, blend);
+                break;
+            case 3:
+                red = blend_darken(red, blend);
+                green = blend_darken(green, blend);
+                blue = blend_darken(blue, blend);
+                break;
+        }
+
+        out[x] = lut[blue << 10 | green << 5 | red];
+    }
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+static bool cpu_has_avx2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    bool ymm_enabled = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;  // The OS saves the YMM registers
+    __cpuidex(info, 7, 0);
+    return ymm_enabled && (info[1] & (1 << 5));
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+// Lanes are all ones where the layer ID is one of the given layers
+static __m128i layer_mask_sse2(__m128i ids, int layers) {
+    __m128i mask = _mm_setzero_si128();
+    for (int i = 0; i < 6; i++) {
+        if (BIT(layers, i)) mask = _mm_or_si128(mask, _mm_cmpeq_epi16(ids, _mm_set1_epi16(i)));
+    }
+    return mask;
+}
+
+static __m128i select_sse2(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static __m128i blend_channel_sse2(__m128i a, __m128i b, __m128i alpha, __m128i brighten, __m128i darken, const BlendInfo &blend) {
+    __m128i max = _mm_set1_epi16(31);
+    __m128i mixed = _mm_mullo_epi16(a, _mm_set1_epi16(blend.eva));
+    mixed = _mm_add_epi16(mixed, _mm_mullo_epi16(b, _mm_set1_epi16(blend.evb)));
+    mixed = _mm_min_epi16(_mm_srli_epi16(mixed, 4), max);
+    __m128i up = _mm_add_epi16(a, _mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(max, a), _mm_set1_epi16(blend.evy)), 4));
+    __m128i down = _mm_sub_epi16(a, _mm_srli_epi16(_mm_mullo_epi16(a, _mm_set1_epi16(blend.evy)), 4));
+    return select_sse2(alpha, mixed, select_sse2(brighten, up, select_sse2(darken, down, a)));
+}
+
+// 8 pixels at a time
+static void compose_line_sse2(const ScanlineInfo &scanline, const BlendInfo &blend, const uint32_t *lut, uint32_t *out) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i all = _mm_set1_epi16(-1);
+    __m128i mode_alpha = (blend.mode == 1 ? all : zero);
+    __m128i mode_brighten = (blend.mode == 2 ? all : zero);
+    __m128i mode_darken = (blend.mode == 3 ? all : zero);
+    __m128i channel = _mm_set1_epi16(31);
+
+    for (int x = 0; x < SCREEN_WIDTH; x += 8) {
+        __m128i top = _mm_loadu_si128((const __m128i *) &scanline.top[x]);
+        __m128i bottom = _mm_loadu_si128((const __m128i *) &scanline.bottom[x]);
+        __m128i top_bg = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) &scanline.top_bg[x]), zero);
+        __m128i bottom_bg = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) &scanline.bottom_bg[x]), zero);
+        __m128i flags = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) &scanline.flags[x]), zero);
+
+        __m128i enable_blend = _mm_cmpeq_epi16(_mm_and_si128(flags, _mm_set1_epi16(EnableBlend)), _mm_set1_epi16(EnableBlend));
+        __m128i sprite_transparency = _mm_cmpeq_epi16(_mm_and_si128(flags, _mm_set1_epi16(SpriteTransparency)), _mm_set1_epi16(SpriteTransparency));
+        __m128i top_ok = _mm_and_si128(enable_blend, layer_mask_sse2(top_bg, blend.top_bgs));
+        __m128i bottom_ok = layer_mask_sse2(bottom_bg, blend.bottom_bgs);
+
+        __m128i forced = _mm_and_si128(sprite_transparency, bottom_ok);
+        __m128i alpha = _mm_or_si128(forced, _mm_and_si128(_mm_and_si128(top_ok, bottom_ok), mode_alpha));
+        __m128i brighten = _mm_andnot_si128(forced, _mm_and_si128(top_ok, mode_brighten));
+        __m128i darken = _mm_andnot_si128(forced, _mm_and_si128(top_ok, mode_darken));
+
+        __m128i color = _mm_and_si128(top, _mm_set1_epi16(0x7fff));
+        if (_mm_movemask_epi8(_mm_or_si128(alpha, _mm_or_si128(brighten, darken))) != 0) {
+            __m128i red = blend_channel_sse2(_mm_and_si128(top, channel), _mm_and_si128(bottom, channel), alpha, brighten, darken, blend);
+            __m128i green = blend_channel_sse2(_mm_and_si128(_mm_srli_epi16(top, 5), channel), _mm_and_si128(_mm_srli_epi16(bottom, 5), channel), alpha, brighten, darken, blend);
+            __m128i blue = blend_channel_sse2(_mm_and_si128(_mm_srli_epi16(top, 10), channel), _mm_and_si128(_mm_srli_epi16(bottom, 10), channel), alpha, brighten, darken, blend);
+            color = _mm_or_si128(red, _mm_or_si128(_mm_slli_epi16(green, 5), _mm_slli_epi16(blue, 10)));
+        }
+
+        alignas(16) uint16_t colors[8];
+        _mm_store_si128((__m128i *) colors, color);
+        for (int i = 0; i < 8; i++) {
+            out[x + i] = lut[colors[i]];
+        }
+    }
+}
+
+TARGET_AVX2 static __m256i layer_mask_avx2(__m256i ids, int layers) {
+    __m256i mask = _mm256_setzero_si256();
+    for (int i = 0; i < 6; i++) {
+        if (BIT(layers, i)) mask = _mm256_or_si256(mask, _mm256_cmpeq_epi16(ids, _mm256_set1_epi16(i)));
+    }
+    return mask;
+}
+
+TARGET_AVX2 static __m256i blend_channel_avx2(__m256i a, __m256i b, __m256i alpha, __m256i brighten, __m256i darken, const BlendInfo &blend) {
+    __m256i max = _mm256_set1_epi16(31);
+    __m256i mixed = _mm256_mullo_epi16(a, _mm256_set1_epi16(blend.eva));
+    mixed = _mm256_add_epi16(mixed, _mm256_mullo_epi16(b, _mm256_set1_epi16(blend.evb)));
+    mixed = _mm256_min_epi16(_mm256_srli_epi16(mixed, 4), max);
+    __m256i up = _mm256_add_epi16(a, _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(max, a), _mm256_set1_epi16(blend.evy)), 4));
+    __m256i down = _mm256_sub_epi16(a, _mm256_srli_epi16(_mm256_mullo_epi16(a, _mm256_set1_epi16(blend.evy)), 4));
+    return _mm256_blendv_epi8(_mm256_blendv_epi8(_mm256_blendv_epi8(a, down, darken), up, brighten), mixed, alpha);
+}
+
+// 16 pixels at a time, with the colour lookups done by gathers
+TARGET_AVX2 static void compose_line_avx2(const ScanlineInfo &scanline, const BlendInfo &blend, const uint32_t *lut, uint32_t *out) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i all = _mm256_set1_epi16(-1);
+    __m256i mode_alpha = (blend.mode == 1 ? all : zero);
+    __m256i mode_brighten = (blend.mode == 2 ? all : zero);
+    __m256i mode_darken = (blend.mode == 3 ? all : zero);
+    __m256i channel = _mm256_set1_epi16(31);
+
+    for (int x = 0; x < SCREEN_WIDTH; x += 16) {
+        __m256i top = _mm256_loadu_si256((const __m256i *) &scanline.top[x]);
+        __m256i bottom = _mm256_loadu_si256((const __m256i *) &scanline.bottom[x]);
+        __m256i top_bg = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &scanline.top_bg[x]));
+        __m256i bottom_bg = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &scanline.bottom_bg[x]));
+        __m256i flags = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) &scanline.flags[x]));
+
+        __m256i enable_blend = _mm256_cmpeq_epi16(_mm256_and_si256(flags, _mm256_set1_epi16(EnableBlend)), _mm256_set1_epi16(EnableBlend));
+        __m256i sprite_transparency = _mm256_cmpeq_epi16(_mm256_and_si256(flags, _mm256_set1_epi16(SpriteTransparency)), _mm256_set1_epi16(SpriteTransparency));
+        __m256i top_ok = _mm256_and_si256(enable_blend, layer_mask_avx2(top_bg, blend.top_bgs));
+        __m256i bottom_ok = layer_mask_avx2(bottom_bg, blend.bottom_bgs);
+
+        __m256i forced = _mm256_and_si256(sprite_transparency, bottom_ok);
+        __m256i alpha = _mm256_or_si256(forced, _mm256_and_si256(_mm256_and_si256(top_ok, bottom_ok), mode_alpha));
+        __m256i brighten = _mm256_andnot_si256(forced, _mm256_and_si256(top_ok, mode_brighten));
+        __m256i darken = _mm256_andnot_si256(forced, _mm256_and_si256(top_ok, mode_darken));
+
+        __m256i color = _mm256_and_si256(top, _mm256_set1_epi16(0x7fff));
+        if (!_mm256_testz_si256(_mm256_or_si256(alpha, _mm256_or_si256(brighten, darken)), all)) {
+            __m256i red = blend_channel_avx2(_mm256_and_si256(top, channel), _mm256_and_si256(bottom, channel), alpha, brighten, darken, blend);
+            __m256i green = blend_channel_avx2(_mm256_and_si256(_mm256_srli_epi16(top, 5), channel), _mm256_and_si256(_mm256_srli_epi16(bottom, 5), channel), alpha, brighten, darken, blend);
+            __m256i blue = blend_channel_avx2(_mm256_and_si256(_mm256_srli_epi16(top, 10), channel), _mm256_and_si256(_mm256_srli_epi16(bottom, 10), channel), alpha, brighten, darken, blend);
+            color = _mm256_or_si256(red, _mm256_or_si256(_mm256_slli_epi16(green, 5), _mm256_slli_epi16(blue, 10)));
+        }
+
+        __m256i low = _mm256_cvtepu16_epi32(_mm256_castsi256_si128(color));
+        __m256i high = _mm256_cvtepu16_epi32(_mm256_extracti128_si256(color, 1));
+        _mm256_storeu_si256((__m256i *) &out[x], _mm256_i32gather_epi32((const int *) lut, low, 4));
+        _mm256_storeu_si256((__m256i *) &out[x + 8], _mm256_i32gather_epi32((const int *) lut, high, 4));
+    }
+}
+
+static compose_kernel compose_select() {
+    return (cpu_has_avx2() ? compose_line_avx2 : compose_line_sse2);
+}
+
+#else
+
+static compose_kernel compose_select() {
+    return compose_line_scalar;
+}
+
+#endif
+
+void video_compose_line(const ScanlineInfo &scanline, const BlendInfo &blend, const uint32_t *lut, uint32_t *out) {
+    static const compose_kernel kernel = compose_select();
+    kernel(scanline, blend, lut, out);
+}
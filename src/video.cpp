@@ -4,42 +4,18 @@
 #include "video.h"
 
 #include <stdint.h>
+#include <array>
 #include <cassert>
-#include <cmath>
 #include <cstring>
 
+#include "context.h"
 #include "cpu.h"
 #include "dma.h"
 #include "io.h"
 #include "memory.h"
+#include "scheduler.h"
 #include "system.h"
 
-uint32_t video_cycles;
-bool video_frame_drawn;
-
-uint32_t screen_texture;
-uint32_t screen_pixels[SCREEN_HEIGHT][SCREEN_WIDTH];
-
-enum ScanlineFlags {
-    EnableBlend = 1,
-    SpriteTransparency = 2,
-    SpriteMask = 4
-};
-
-struct ScanlineInfo {
-    uint16_t top;
-    uint16_t bottom;
-    uint8_t top_bg;
-    uint8_t bottom_bg;
-    uint8_t flags;
-};
-
-ScanlineInfo scanline[SCREEN_WIDTH];
-
-bool active_compute_sprite_masks;
-bool active_sprite_transparency;
-bool active_sprite_mask;
-
 enum WindowRegion {
     None = 0,
     Win0 = 1,
@@ -48,15 +24,6 @@ enum WindowRegion {
     WinOut = 4
 };
 
-struct WindowInfo {
-    int left;
-    int top;
-    int right;
-    int bottom;
-};
-
-WindowInfo win0, win1;
-
 static bool is_point_in_window(WindowInfo window, int x, int y) {
     bool x_ok = false;
     bool y_ok = false;
@@ -76,14 +43,14 @@ static bool is_point_in_window(WindowInfo window, int x, int y) {
 }
 
 static WindowRegion window_find_region(int x, int y) {
-    bool enable_win0 = (ioreg.dispcnt.w & DCNT_WIN0);
-    bool enable_win1 = (ioreg.dispcnt.w & DCNT_WIN1);
-    bool enable_winobj = (ioreg.dispcnt.w & DCNT_WINOBJ);
+    bool enable_win0 = (gba->ioreg.dispcnt.w & DCNT_WIN0);
+    bool enable_win1 = (gba->ioreg.dispcnt.w & DCNT_WIN1);
+    bool enable_winobj = (gba->ioreg.dispcnt.w & DCNT_WINOBJ);
     bool enable_winout = (enable_win0 || enable_win1 || enable_winobj);
 
-    bool inside_win0 = (enable_win0 && is_point_in_window(win0, x, y));
-    bool inside_win1 = (enable_win1 && is_point_in_window(win1, x, y));
-    bool inside_winobj = (enable_winobj && (scanline[x].flags & ScanlineFlags::SpriteMask));
+    bool inside_win0 = (enable_win0 && is_point_in_window(gba->win0, x, y));
+    bool inside_win1 = (enable_win1 && is_point_in_window(gba->win1, x, y));
+    bool inside_winobj = (enable_winobj && (gba->scanline.flags[x] & ScanlineFlags::SpriteMask));
 
     if (inside_win0) {
         return WindowRegion::Win0;
@@ -101,10 +68,10 @@ static WindowRegion window_find_region(int x, int y) {
 static bool window_enable_blend(WindowRegion region) {
     switch (region) {
         case WindowRegion::None: break;
-        case WindowRegion::Win0: return BIT(ioreg.winin.w, 5);
-        case WindowRegion::Win1: return BIT(ioreg.winin.w, 13);
-        case WindowRegion::WinObj: return BIT(ioreg.winout.w, 13);
-        case WindowRegion::WinOut: return BIT(ioreg.winout.w, 5);
+        case WindowRegion::Win0: return BIT(gba->ioreg.winin.w, 5);
+        case WindowRegion::Win1: return BIT(gba->ioreg.winin.w, 13);
+        case WindowRegion::WinObj: return BIT(gba->ioreg.winout.w, 13);
+        case WindowRegion::WinOut: return BIT(gba->ioreg.winout.w, 5);
     }
 
     return true;
@@ -113,30 +80,22 @@ static bool window_enable_blend(WindowRegion region) {
 static bool window_bg_visible(WindowRegion region, int bg) {
     switch (region) {
         case WindowRegion::None: break;
-        case WindowRegion::Win0: return BIT(ioreg.winin.w, bg);
-        case WindowRegion::Win1: return BIT(ioreg.winin.w, 8 + bg);
-        case WindowRegion::WinObj: return BIT(ioreg.winout.w, 8 + bg);
-        case WindowRegion::WinOut: return BIT(ioreg.winout.w, bg);
+        case WindowRegion::Win0: return BIT(gba->ioreg.winin.w, bg);
+        case WindowRegion::Win1: return BIT(gba->ioreg.winin.w, 8 + bg);
+        case WindowRegion::WinObj: return BIT(gba->ioreg.winout.w, 8 + bg);
+        case WindowRegion::WinOut: return BIT(gba->ioreg.winout.w, bg);
     }
 
     return true;
 }
 
-static double fixed1p4_to_double(int8_t x) {
-    return (x >> 4) + ((x & 0xf) / 16.0);
-}
-
-static double fixed8p8_to_double(int16_t x) {
-    return (x >> 8) + ((x & 0xff) / 256.0);
-}
-
-static double fixed20p8_to_double(int32_t x) {
+static int32_t fixed20p8_sign_extend(uint32_t x) {
     SIGN_EXTEND(x, 27);
-    return (x >> 8) + ((x & 0xff) / 256.0);
+    return (int32_t) x;
 }
 
 bool video_in_bitmap_mode() {
-    uint16_t mode = ioreg.dispcnt.w & 7;
+    uint16_t mode = gba->ioreg.dispcnt.w & 7;
     return (mode >= 3 && mode <= 5);
 }
 
@@ -152,54 +111,54 @@ static uint32_t rgb555_to_rgb888(uint16_t pixel) {
     return 0xff << 24 | blue << 16 | green << 8 | red;
 }
 
-static uint16_t rgb565_blend(uint16_t a, uint16_t b, double weight_a, double weight_b) {
-    int red_a = BITS(a, 0, 4);
-    int green_a = BITS(a, 5, 9) << 1 | BIT(a, 15);
-    int blue_a = BITS(a, 10, 14);
-
-    int red_b = BITS(b, 0, 4);
-    int green_b = BITS(b, 5, 9) << 1 | BIT(b, 15);
-    int blue_b = BITS(b, 10, 14);
-
-    int red = red_a * weight_a + red_b * weight_b;
-    int green = green_a * weight_a + green_b * weight_b;
-    int blue = blue_a * weight_a + blue_b * weight_b;
+// Screen pixel for every BGR555 colour, used unless the frontend sets its own table
+static const std::array<uint32_t, COLOR_COUNT> color_lut_default = [] {
+    std::array<uint32_t, COLOR_COUNT> lut;
+    for (int i = 0; i < COLOR_COUNT; i++) {
+        lut[i] = rgb555_to_rgb888(i);
+    }
+    return lut;
+}();
 
-    if (red > 31) red = 31;
-    if (green > 63) green = 63;
-    if (blue > 31) blue = 31;
+// Replaces the conversion of final colours, e.g. with one that mimics the GBA's LCD. The table needs
+// COLOR_COUNT entries and must outlive its use, and nullptr goes back to the default.
+void video_set_color_lut(const uint32_t *lut) {
+    gba->color_lut = lut;
+}
 
-    return BIT(green, 0) << 15 | BITS(blue, 0, 4) << 10 | BITS(green, 1, 5) << 5 | BITS(red, 0, 4);
+static const uint32_t *color_lut() {
+    return (gba->color_lut != nullptr ? gba->color_lut : color_lut_default.data());
 }
 
 static void draw_forced_blank(int y) {
     assert(y >= 0 && y < SCREEN_HEIGHT);
 
+    uint32_t white = color_lut()[0x7fff];
     for (int x = 0; x < SCREEN_WIDTH; x++) {
-        screen_pixels[y][x] = 0xffffffff;
+        gba->screen_pixels[y][x] = white;
     }
 }
 
 static void reset_scanline() {
-    std::memset(scanline, 0, sizeof(scanline));
+    std::memset(&gba->scanline, 0, sizeof(gba->scanline));
 }
 
 static void draw_backdrop(int y) {
     assert(y >= 0 && y < SCREEN_HEIGHT);
 
-    uint16_t pixel = *(uint16_t *) &palette_ram[0];
+    uint16_t pixel = *(uint16_t *) &gba->palette_ram[0];
 
     for (int x = 0; x < SCREEN_WIDTH; x++) {
-        scanline[x].top = pixel;
-        scanline[x].bottom = pixel;
-        scanline[x].top_bg = 5;
-        scanline[x].bottom_bg = 5;
+        gba->scanline.top[x] = pixel;
+        gba->scanline.bottom[x] = pixel;
+        gba->scanline.top_bg[x] = 5;
+        gba->scanline.bottom_bg[x] = 5;
 
         WindowRegion window_region = window_find_region(x, y);
         bool enable_blend = window_enable_blend(window_region);
 
         if (enable_blend) {
-            scanline[x].flags |= ScanlineFlags::EnableBlend;
+            gba->scanline.flags[x] |= ScanlineFlags::EnableBlend;
         }
     }
 }
@@ -208,135 +167,146 @@ static void draw_pixel_if_visible(int bg, int x, int y, uint16_t pixel) {
     if (x < 0 || x >= SCREEN_WIDTH) return;
     assert(y >= 0 && y < SCREEN_HEIGHT);
 
-    if (active_compute_sprite_masks) {
-        scanline[x].flags |= ScanlineFlags::SpriteMask;
+    if (gba->active_compute_sprite_masks) {
+        gba->scanline.flags[x] |= ScanlineFlags::SpriteMask;
         return;
     }
 
-    if (active_sprite_transparency) {
-        scanline[x].flags |= ScanlineFlags::SpriteTransparency;
+    if (gba->active_sprite_transparency) {
+        gba->scanline.flags[x] |= ScanlineFlags::SpriteTransparency;
     } else {
-        scanline[x].flags &= ~ScanlineFlags::SpriteTransparency;
+        gba->scanline.flags[x] &= ~ScanlineFlags::SpriteTransparency;
     }
 
-    if (active_sprite_mask) return;
+    if (gba->active_sprite_mask) return;
 
     WindowRegion window_region = window_find_region(x, y);
     bool bg_visible = window_bg_visible(window_region, bg);
     if (!bg_visible) return;
 
-    bool occluding_sprites = (bg == 4 && scanline[x].top_bg == 4);
+    bool occluding_sprites = (bg == 4 && gba->scanline.top_bg[x] == 4);
     if (!occluding_sprites) {
-        scanline[x].bottom = scanline[x].top;
-        scanline[x].bottom_bg = scanline[x].top_bg;
+        gba->scanline.bottom[x] = gba->scanline.top[x];
+        gba->scanline.bottom_bg[x] = gba->scanline.top_bg[x];
     }
 
-    scanline[x].top = pixel;
-    scanline[x].top_bg = bg;
+    gba->scanline.top[x] = pixel;
+    gba->scanline.top_bg[x] = bg;
 }
 
 static void compose_scanline(int y) {
     assert(y >= 0 && y < SCREEN_HEIGHT);
 
-    int blend_top_bgs = BITS(ioreg.bldcnt.w, 0, 5);
-    int blend_mode_default = BITS(ioreg.bldcnt.w, 6, 7);
-    int blend_bottom_bgs = BITS(ioreg.bldcnt.w, 8, 13);
-    double weight_a = fixed1p4_to_double(BITS(ioreg.bldalpha.w, 0, 4));
-    double weight_b = fixed1p4_to_double(BITS(ioreg.bldalpha.w, 8, 12));
-    double weight_y = fixed1p4_to_double(BITS(ioreg.bldy.w, 0, 4));
+    BlendInfo blend;
+    blend.top_bgs = BITS(gba->ioreg.bldcnt.w, 0, 5);
+    blend.mode = BITS(gba->ioreg.bldcnt.w, 6, 7);
+    blend.bottom_bgs = BITS(gba->ioreg.bldcnt.w, 8, 13);
+    blend.eva = BITS(gba->ioreg.bldalpha.w, 0, 4);
+    blend.evb = BITS(gba->ioreg.bldalpha.w, 8, 12);
+    blend.evy = BITS(gba->ioreg.bldy.w, 0, 4);
 
-    if (weight_a > 1.0) weight_a = 1.0;
-    if (weight_b > 1.0) weight_b = 1.0;
-    if (weight_y > 1.0) weight_y = 1.0;
+    if (blend.eva > 16) blend.eva = 16;
+    if (blend.evb > 16) blend.evb = 16;
+    if (blend.evy > 16) blend.evy = 16;
 
-    const uint16_t white = 0xffff;
-    const uint16_t black = 0;
+    video_compose_line(gba->scanline, blend, color_lut(), gba->screen_pixels[y]);
+}
 
-    for (int x = 0; x < SCREEN_WIDTH; x++) {
-        uint16_t top = scanline[x].top;
-        uint16_t bottom = scanline[x].bottom;
-        uint8_t top_bg = scanline[x].top_bg;
-        uint8_t bottom_bg = scanline[x].bottom_bg;
-        bool enable_blend = scanline[x].flags & ScanlineFlags::EnableBlend;
-        bool sprite_transparency = scanline[x].flags & ScanlineFlags::SpriteTransparency;
-
-        bool top_ok = BIT(blend_top_bgs, top_bg);
-        bool bottom_ok = BIT(blend_bottom_bgs, bottom_bg);
-
-        int blend_mode = blend_mode_default;
-        bool valid_blend = enable_blend && top_ok && (bottom_ok || blend_mode != 1);
-
-        if (sprite_transparency) {
-            bool force_alpha_blend = bottom_ok;
-            if (force_alpha_blend) {
-                blend_mode = 1;
-                valid_blend = true;
-            }
-        }
+// Returns the tile at the given VRAM offset with one palette index per byte, decoding it again
+// only if VRAM under it has been written since
+static const uint8_t *tile_decoded(uint32_t tile_address, bool colors_256) {
+    uint32_t slot = tile_address / 32;
+    uint8_t *tile = (colors_256 ? gba->tile_cache_8bpp[slot] : gba->tile_cache_4bpp[slot]);
+    bool &valid = (colors_256 ? gba->tile_valid_8bpp[slot] : gba->tile_valid_4bpp[slot]);
+    if (valid) {
+        gba->tile_cache_hits++;
+        return tile;
+    }
+    gba->tile_cache_misses++;
 
-        uint16_t pixel = top;
-        if (valid_blend) {
-            switch (blend_mode) {
-                case 1:
-                    pixel = rgb565_blend(top, bottom, weight_a, weight_b);
-                    break;
-                case 2:
-                    pixel = rgb565_blend(top, white, 1.0 - weight_y, weight_y);
-                    break;
-                case 3:
-                    pixel = rgb565_blend(top, black, 1.0 - weight_y, weight_y);
-                    break;
-            }
+    if (colors_256) {
+        for (int i = 0; i < 64; i++) {
+            uint32_t address = tile_address + i;
+            if (address >= 0x18000) address -= 0x8000;  // The last OBJ tile wraps around
+            tile[i] = gba->video_ram[address];
         }
-        screen_pixels[y][x] = rgb555_to_rgb888(pixel);
+    } else {
+        for (int i = 0; i < 32; i++) {
+            uint8_t pixel_indexes = gba->video_ram[tile_address + i];
+            tile[i * 2] = pixel_indexes & 0xf;
+            tile[i * 2 + 1] = pixel_indexes >> 4;
+        }
+    }
+    valid = true;
+    return tile;
+}
+
+void video_tile_write(uint32_t offset) {
+    uint32_t slot = offset / 32;
+    gba->tile_valid_4bpp[slot] = false;
+    gba->tile_valid_8bpp[slot] = false;
+    if (slot == 0x10000 / 32) {
+        gba->tile_valid_8bpp[TILE_SLOTS - 1] = false;  // 8bpp tiles cover two slots, and the last OBJ one wraps around
+    } else if (slot != 0) {
+        gba->tile_valid_8bpp[slot - 1] = false;
     }
 }
 
+void video_tile_cache_flush() {
+    std::memset(gba->tile_valid_4bpp, 0, sizeof(gba->tile_valid_4bpp));
+    std::memset(gba->tile_valid_8bpp, 0, sizeof(gba->tile_valid_8bpp));
+}
+
 static bool tile_access(uint32_t tile_address, int x, int y, bool hflip, bool vflip, bool colors_256, uint32_t palette_offset, int palette_no, uint16_t *pixel) {
     assert(x >= 0 && x < 8 && y >= 0 && y < 8);
 
     if (hflip) x = 7 - x;
     if (vflip) y = 7 - y;
 
-    uint8_t *tile = &video_ram[tile_address];
-
-    if (colors_256) {
-        uint32_t tile_offset = y * 8 + x;
-        uint8_t pixel_index = tile[tile_offset];
-        if (pixel_index != 0) {
-            *pixel = *(uint16_t *) &palette_ram[palette_offset + pixel_index * 2];
-            return true;
-        }
-    } else {
-        uint32_t tile_offset = y * 4 + x / 2;
-        uint8_t pixel_indexes = tile[tile_offset];
-        uint8_t pixel_index = (pixel_indexes >> (x % 2 == 1 ? 4 : 0)) & 0xf;
-        if (pixel_index != 0) {
-            *pixel = *(uint16_t *) &palette_ram[palette_offset + palette_no * 32 + pixel_index * 2];
-            return true;
-        }
-    }
-
-    return false;
+    uint8_t pixel_index = tile_decoded(tile_address, colors_256)[y * 8 + x];
+    if (pixel_index == 0) return false;
+    if (!colors_256) palette_offset += palette_no * 32;
+    *pixel = *(uint16_t *) &gba->palette_ram[palette_offset + pixel_index * 2];
+    return true;
 }
 
-static bool bg_regular_access(int x, int y, int w, int h, uint32_t tile_base, uint32_t map_base, uint32_t screen_size, bool colors_256, uint16_t *pixel) {
-    assert(x >= 0 && x < w && y >= 0 && y < h);
-
-    int map_x = (x / 8) % (w / 8);
-    int map_y = (y / 8) % (h / 8);
+// Draws one line of a text BG a tile at a time, reading each screen entry and tile row once.
+// The buffers have 8 spare entries at each end, so the partly visible tiles at the edges can be
+// written in full.
+static void bg_regular_line(int y, int w, int h, int hofs, int vofs, uint32_t tile_base, uint32_t map_base, uint32_t screen_size, bool colors_256, uint16_t *line, bool *opaque) {
+    int j = (y + vofs) & (h - 1);
+    int map_y = j / 8;
+    int tile_y = j % 8;
     int quad_x = 32 * 32;
     int quad_y = 32 * 32 * (screen_size == 3 ? 2 : 1);
-    uint32_t map_index = (map_y / 32) * quad_y + (map_x / 32) * quad_x + (map_y % 32) * 32 + (map_x % 32);
-    uint16_t info = *(uint16_t *) &video_ram[map_base + map_index * 2];
-    int tile_no = BITS(info, 0, 9);
-    bool hflip = BIT(info, 10);
-    bool vflip = BIT(info, 11);
-    int palette_no = BITS(info, 12, 15);
-
-    uint32_t tile_address = tile_base + tile_no * (colors_256 ? 64 : 32);
-    if (tile_address >= 0x10000) return false;
-    return tile_access(tile_address, x % 8, y % 8, hflip, vflip, colors_256, 0, palette_no, pixel);
+    uint32_t row_index = (map_y / 32) * quad_y + (map_y % 32) * 32;
+
+    int i = hofs & (w - 1);
+    int x = -(i % 8);
+    i -= i % 8;
+    for (; x < SCREEN_WIDTH; x += 8, i = (i + 8) & (w - 1)) {
+        int map_x = i / 8;
+        uint32_t map_index = row_index + (map_x / 32) * quad_x + (map_x % 32);
+        uint16_t info = *(uint16_t *) &gba->video_ram[map_base + map_index * 2];
+        int tile_no = BITS(info, 0, 9);
+        bool hflip = BIT(info, 10);
+        bool vflip = BIT(info, 11);
+        int palette_no = BITS(info, 12, 15);
+
+        uint32_t tile_address = tile_base + tile_no * (colors_256 ? 64 : 32);
+        if (tile_address >= 0x10000) {
+            for (int k = 0; k < 8; k++) opaque[x + k] = false;
+            continue;
+        }
+
+        const uint8_t *tile_row = tile_decoded(tile_address, colors_256) + (vflip ? 7 - tile_y : tile_y) * 8;
+        uint16_t *palette = (uint16_t *) &gba->palette_ram[colors_256 ? 0 : palette_no * 32];
+        for (int k = 0; k < 8; k++) {
+            uint8_t pixel_index = tile_row[hflip ? 7 - k : k];
+            line[x + k] = palette[pixel_index];
+            opaque[x + k] = (pixel_index != 0);
+        }
+    }
 }
 
 static bool bg_affine_access(int x, int y, int w, int h, uint32_t tile_base, uint32_t map_base, uint16_t *pixel) {
@@ -345,7 +315,7 @@ static bool bg_affine_access(int x, int y, int w, int h, uint32_t tile_base, uin
     int map_x = (x / 8) % (w / 8);
     int map_y = (y / 8) % (h / 8);
     uint32_t map_index = map_y * (w / 8) + map_x;
-    uint8_t info = video_ram[map_base + map_index];
+    uint8_t info = gba->video_ram[map_base + map_index];
     int tile_no = info;
 
     uint32_t tile_address = tile_base + tile_no * 64;
@@ -359,7 +329,7 @@ static bool sprite_access(int tile_no, int x, int y, int w, int h, bool hflip, b
     if (hflip) x = w - 1 - x;
     if (vflip) y = h - 1 - y;
 
-    bool obj_1d = (ioreg.dispcnt.w & DCNT_OBJ_1D);
+    bool obj_1d = (gba->ioreg.dispcnt.w & DCNT_OBJ_1D);
     int stride = (obj_1d ? (w / 8) : (colors_256 ? 16 : 32));
     int increment = (colors_256 ? 2 : 1);
     int count_y = (y / 8) * stride * increment;
@@ -385,9 +355,9 @@ const int sprite_height_lookup[4][4] = {{8, 16, 32, 64}, {8, 8, 16, 32}, {16, 32
 
 static void draw_sprites(int mode, int pri, int y) {
     for (int n = 127; n >= 0; n--) {
-        uint16_t attr0 = *(uint16_t *) &object_ram[n * 8];
-        uint16_t attr1 = *(uint16_t *) &object_ram[n * 8 + 2];
-        uint16_t attr2 = *(uint16_t *) &object_ram[n * 8 + 4];
+        uint16_t attr0 = *(uint16_t *) &gba->object_ram[n * 8];
+        uint16_t attr1 = *(uint16_t *) &gba->object_ram[n * 8 + 2];
+        uint16_t attr2 = *(uint16_t *) &gba->object_ram[n * 8 + 4];
 
         int sprite_y = BITS(attr0, 0, 7);
         int obj_mode = BITS(attr0, 8, 9);
@@ -396,7 +366,7 @@ static void draw_sprites(int mode, int pri, int y) {
         bool colors_256 = BIT(attr0, 13);
         int shape = BITS(attr0, 14, 15);
 
-        if (active_compute_sprite_masks && gfx_mode != 2) continue;
+        if (gba->active_compute_sprite_masks && gfx_mode != 2) continue;
         if (gfx_mode == 3) gfx_mode = 0;
 
         int sprite_x = BITS(attr1, 0, 8);
@@ -429,44 +399,49 @@ static void draw_sprites(int mode, int pri, int y) {
         int bbox_cx = bbox_width / 2;
         int bbox_cy = bbox_height / 2;
 
-        double pa, pb, pc, pd;
+        int32_t pa, pb, pc, pd;  // 8.8 fixed point
         if (is_affine) {
-            pa = fixed8p8_to_double(*(uint16_t *) &object_ram[affine_index * 32 + 6]);
-            pb = fixed8p8_to_double(*(uint16_t *) &object_ram[affine_index * 32 + 14]);
-            pc = fixed8p8_to_double(*(uint16_t *) &object_ram[affine_index * 32 + 22]);
-            pd = fixed8p8_to_double(*(uint16_t *) &object_ram[affine_index * 32 + 30]);
+            pa = *(int16_t *) &gba->object_ram[affine_index * 32 + 6];
+            pb = *(int16_t *) &gba->object_ram[affine_index * 32 + 14];
+            pc = *(int16_t *) &gba->object_ram[affine_index * 32 + 22];
+            pd = *(int16_t *) &gba->object_ram[affine_index * 32 + 30];
             hflip = false;
             vflip = false;
         } else {
-            pa = pd = 1.0;
-            pb = pc = 0.0;
+            pa = pd = 0x100;
+            pb = pc = 0;
         }
 
-        active_sprite_transparency = (gfx_mode == 1);
-        active_sprite_mask = (gfx_mode == 2);
+        gba->active_sprite_transparency = (gfx_mode == 1);
+        gba->active_sprite_mask = (gfx_mode == 2);
 
+        // Texture coordinates relative to the centre, stepped across the line like the hardware does
         int j = y - sprite_y;
+        int32_t affine_x = pa * -bbox_cx + pb * (j - bbox_cy);
+        int32_t affine_y = pc * -bbox_cx + pd * (j - bbox_cy);
         for (int i = 0; i < bbox_width; i++) {
-            int texture_x = sprite_cx + std::floor(pa * (i - bbox_cx) + pb * (j - bbox_cy));
-            int texture_y = sprite_cy + std::floor(pc * (i - bbox_cx) + pd * (j - bbox_cy));
+            int texture_x = sprite_cx + (affine_x >> 8);
+            int texture_y = sprite_cy + (affine_y >> 8);
             uint16_t pixel;
             bool ok = sprite_access(tile_no, texture_x, texture_y, sprite_width, sprite_height, hflip, vflip, colors_256, palette_no, mode, &pixel);
             if (ok) draw_pixel_if_visible(4, sprite_x + i, y, pixel);
+            affine_x += pa;
+            affine_y += pc;
         }
 
-        active_sprite_transparency = false;
-        active_sprite_mask = false;
+        gba->active_sprite_transparency = false;
+        gba->active_sprite_mask = false;
     }
 }
 
 static void compute_sprite_masks(int mode, int y) {
-    active_compute_sprite_masks = true;
+    gba->active_compute_sprite_masks = true;
 
     for (int pri = 3; pri >= 0; pri--) {
         draw_sprites(mode, pri, y);
     }
 
-    active_compute_sprite_masks = false;
+    gba->active_compute_sprite_masks = false;
 }
 
 const int bg_width_lookup[2][4] = {{256, 512, 256, 512}, {128, 256, 512, 1024}};
@@ -476,9 +451,9 @@ static void draw_tiled_bg(int mode, int bg, int y) {
     if (mode == 1 && bg == 3) return;
     if (mode == 2 && (bg == 0 || bg == 1)) return;
 
-    uint32_t bgcnt = ioreg.bgcnt[bg].w;
-    int hofs = ioreg.bg_text[bg].x.w;
-    int vofs = ioreg.bg_text[bg].y.w;
+    uint32_t bgcnt = gba->ioreg.bgcnt[bg].w;
+    int hofs = gba->ioreg.bg_text[bg].x.w;
+    int vofs = gba->ioreg.bg_text[bg].y.w;
 
     uint32_t tile_base = BITS(bgcnt, 2, 3) * 0x4000;
     uint32_t map_base = BITS(bgcnt, 8, 12) * 0x800;
@@ -487,37 +462,33 @@ static void draw_tiled_bg(int mode, int bg, int y) {
     bool colors_256 = BIT(bgcnt, 7);
 
     bool is_affine = ((mode == 1 && bg == 2) || (mode == 2 && (bg == 2 || bg == 3)));
-    double affine_x, affine_y;
-    double pa, pc;
-    if (is_affine) {
-        affine_x = ioreg.bg_affine[bg - 2].x;
-        affine_y = ioreg.bg_affine[bg - 2].y;
-        pa = fixed8p8_to_double(ioreg.bg_affine[bg - 2].pa.w);
-        pc = fixed8p8_to_double(ioreg.bg_affine[bg - 2].pc.w);
-    } else {
-        affine_x = 0.0;
-        affine_y = 0.0;
-        pa = 0.0;
-        pc = 0.0;
-    }
-
     int bg_width = bg_width_lookup[is_affine][screen_size];
     int bg_height = bg_height_lookup[is_affine][screen_size];
 
+    if (!is_affine) {
+        uint16_t line[8 + SCREEN_WIDTH + 8];
+        bool opaque[8 + SCREEN_WIDTH + 8];
+        bg_regular_line(y, bg_width, bg_height, hofs, vofs, tile_base, map_base, screen_size, colors_256, line + 8, opaque + 8);
+        for (int x = 0; x < SCREEN_WIDTH; x++) {
+            if (opaque[8 + x]) draw_pixel_if_visible(bg, x, y, line[8 + x]);
+        }
+        return;
+    }
+
+    int32_t affine_x = gba->ioreg.bg_affine[bg - 2].x;  // 20.8 fixed point
+    int32_t affine_y = gba->ioreg.bg_affine[bg - 2].y;
+    int32_t pa = (int16_t) gba->ioreg.bg_affine[bg - 2].pa.w;  // 8.8 fixed point
+    int32_t pc = (int16_t) gba->ioreg.bg_affine[bg - 2].pc.w;
+
     for (int x = 0; x < SCREEN_WIDTH; x++) {
-        int i = (is_affine ? std::floor(affine_x) : x + hofs);
-        int j = (is_affine ? std::floor(affine_y) : y + vofs);
-        if (!is_affine || overflow_wraps) {
+        int i = affine_x >> 8;
+        int j = affine_y >> 8;
+        if (overflow_wraps) {
             i &= bg_width - 1;
             j &= bg_height - 1;
         }
         uint16_t pixel;
-        bool ok;
-        if (is_affine) {
-            ok = bg_affine_access(i, j, bg_width, bg_height, tile_base, map_base, &pixel);
-        } else {
-            ok = bg_regular_access(i, j, bg_width, bg_height, tile_base, map_base, screen_size, colors_256, &pixel);
-        }
+        bool ok = bg_affine_access(i, j, bg_width, bg_height, tile_base, map_base, &pixel);
         if (ok) draw_pixel_if_visible(bg, x, y, pixel);
         affine_x += pa;
         affine_y += pc;
@@ -527,15 +498,15 @@ static void draw_tiled_bg(int mode, int bg, int y) {
 static void draw_tiled(int mode, int y) {
     for (int pri = 3; pri >= 0; pri--) {
         for (int bg = 3; bg >= 0; bg--) {
-            bool bg_visible = BIT(ioreg.dispcnt.w, 8 + bg);
-            uint16_t priority = BITS(ioreg.bgcnt[bg].w, 0, 1);
+            bool bg_visible = BIT(gba->ioreg.dispcnt.w, 8 + bg);
+            uint16_t priority = BITS(gba->ioreg.bgcnt[bg].w, 0, 1);
 
             if (bg_visible && priority == pri) {
                 draw_tiled_bg(mode, bg, y);
             }
         }
 
-        bool obj_visible = (ioreg.dispcnt.w & DCNT_OBJ);
+        bool obj_visible = (gba->ioreg.dispcnt.w & DCNT_OBJ);
 
         if (obj_visible) {
             draw_sprites(mode, pri, y);
@@ -550,14 +521,14 @@ static bool bitmap_access(int x, int y, int mode, uint16_t *pixel) {
     if (x < 0 || x >= w || y < 0 || y >= h) return false;
 
     if (mode == 4) {
-        bool page_flip = (ioreg.dispcnt.w & DCNT_PAGE);
-        uint8_t pixel_index = video_ram[(page_flip ? 0xa000 : 0) + y * w + x];
+        bool page_flip = (gba->ioreg.dispcnt.w & DCNT_PAGE);
+        uint8_t pixel_index = gba->video_ram[(page_flip ? 0xa000 : 0) + y * w + x];
         if (pixel_index != 0) {
-            *pixel = *(uint16_t *) &palette_ram[pixel_index * 2];
+            *pixel = *(uint16_t *) &gba->palette_ram[pixel_index * 2];
             return true;
         }
     } else {
-        *pixel = *(uint16_t *) &video_ram[(y * w + x) * 2];
+        *pixel = *(uint16_t *) &gba->video_ram[(y * w + x) * 2];
         return true;
     }
 
@@ -568,18 +539,18 @@ static void draw_bitmap(int mode, int y) {
     for (int pri = 3; pri >= 0; pri--) {
         const int bg = 2;
 
-        bool bg_visible = BIT(ioreg.dispcnt.w, 8 + bg);
-        uint16_t priority = BITS(ioreg.bgcnt[bg].w, 0, 1);
+        bool bg_visible = BIT(gba->ioreg.dispcnt.w, 8 + bg);
+        uint16_t priority = BITS(gba->ioreg.bgcnt[bg].w, 0, 1);
 
         if (bg_visible && priority == pri) {
-            double affine_x = ioreg.bg_affine[bg - 2].x;
-            double affine_y = ioreg.bg_affine[bg - 2].y;
-            double pa = fixed8p8_to_double(ioreg.bg_affine[bg - 2].pa.w);
-            double pc = fixed8p8_to_double(ioreg.bg_affine[bg - 2].pc.w);
+            int32_t affine_x = gba->ioreg.bg_affine[bg - 2].x;
+            int32_t affine_y = gba->ioreg.bg_affine[bg - 2].y;
+            int32_t pa = (int16_t) gba->ioreg.bg_affine[bg - 2].pa.w;
+            int32_t pc = (int16_t) gba->ioreg.bg_affine[bg - 2].pc.w;
 
             for (int x = 0; x < SCREEN_WIDTH; x++) {
-                int i = std::floor(affine_x);
-                int j = std::floor(affine_y);
+                int i = affine_x >> 8;
+                int j = affine_y >> 8;
                 uint16_t pixel;
                 bool ok = bitmap_access(i, j, mode, &pixel);
                 if (ok) draw_pixel_if_visible(bg, x, y, pixel);
@@ -588,7 +559,7 @@ static void draw_bitmap(int mode, int y) {
             }
         }
 
-        bool obj_visible = (ioreg.dispcnt.w & DCNT_OBJ);
+        bool obj_visible = (gba->ioreg.dispcnt.w & DCNT_OBJ);
 
         if (obj_visible) {
             draw_sprites(mode, pri, y);
@@ -597,18 +568,18 @@ static void draw_bitmap(int mode, int y) {
 }
 
 static void video_draw_scanline() {
-    win0.right = ioreg.winh[0].b.b0;
-    win0.left = ioreg.winh[0].b.b1;
-    win0.bottom = ioreg.winv[0].b.b0;
-    win0.top = ioreg.winv[0].b.b1;
-    win1.right = ioreg.winh[1].b.b0;
-    win1.left = ioreg.winh[1].b.b1;
-    win1.bottom = ioreg.winv[1].b.b0;
-    win1.top = ioreg.winv[1].b.b1;
-
-    bool forced_blank = (ioreg.dispcnt.w & DCNT_BLANK);
-    int mode = BITS(ioreg.dispcnt.w, 0, 2);
-    int y = ioreg.vcount.w;
+    gba->win0.right = gba->ioreg.winh[0].b.b0;
+    gba->win0.left = gba->ioreg.winh[0].b.b1;
+    gba->win0.bottom = gba->ioreg.winv[0].b.b0;
+    gba->win0.top = gba->ioreg.winv[0].b.b1;
+    gba->win1.right = gba->ioreg.winh[1].b.b0;
+    gba->win1.left = gba->ioreg.winh[1].b.b1;
+    gba->win1.bottom = gba->ioreg.winv[1].b.b0;
+    gba->win1.top = gba->ioreg.winv[1].b.b1;
+
+    bool forced_blank = (gba->ioreg.dispcnt.w & DCNT_BLANK);
+    int mode = BITS(gba->ioreg.dispcnt.w, 0, 2);
+    int y = gba->ioreg.vcount.w;
 
     if (forced_blank) {
         draw_forced_blank(y);
@@ -643,67 +614,77 @@ static void video_draw_scanline() {
 }
 
 void video_bg_affine_reset(int i) {
-    ioreg.bg_affine[i].x = fixed20p8_to_double(ioreg.bg_affine[i].x0.dw);
-    ioreg.bg_affine[i].y = fixed20p8_to_double(ioreg.bg_affine[i].y0.dw);
+    gba->ioreg.bg_affine[i].x = fixed20p8_sign_extend(gba->ioreg.bg_affine[i].x0.dw);
+    gba->ioreg.bg_affine[i].y = fixed20p8_sign_extend(gba->ioreg.bg_affine[i].y0.dw);
 }
 
 static void video_bg_affine_update() {
     for (int i = 0; i < 2; i++) {
-        ioreg.bg_affine[i].x += fixed8p8_to_double(ioreg.bg_affine[i].pb.w);
-        ioreg.bg_affine[i].y += fixed8p8_to_double(ioreg.bg_affine[i].pd.w);
+        gba->ioreg.bg_affine[i].x += (int16_t) gba->ioreg.bg_affine[i].pb.w;
+        gba->ioreg.bg_affine[i].y += (int16_t) gba->ioreg.bg_affine[i].pd.w;
     }
 }
 
-void video_update(uint32_t cycles) {
-    uint32_t last_frame_cycles = video_cycles;
-    video_cycles = (video_cycles + cycles) % CYCLES_FRAME;
-    uint32_t frame_cycles = video_cycles;
-
-    uint32_t last_line_cycles = last_frame_cycles % CYCLES_SCANLINE;
+void video_init(uint32_t frame_cycles) {
     uint32_t line_cycles = frame_cycles % CYCLES_SCANLINE;
+    gba->ioreg.vcount.w = frame_cycles / CYCLES_SCANLINE;
+    if (line_cycles < CYCLES_HDRAW) {
+        scheduler_add(EVENT_VIDEO, gba->scheduler_cycles + CYCLES_HDRAW - line_cycles);
+    } else {
+        gba->ioreg.dispstat.w |= DSTAT_IN_HBL;
+        scheduler_add(EVENT_VIDEO, gba->scheduler_cycles + CYCLES_SCANLINE - line_cycles);
+    }
+}
 
-    if (line_cycles >= CYCLES_HDRAW && last_line_cycles < CYCLES_HDRAW) {
-        if (ioreg.vcount.w < SCREEN_HEIGHT) {
-            video_draw_scanline();
-            video_bg_affine_update();
-        }
-        ioreg.dispstat.w |= DSTAT_IN_HBL;  // Enter HBlank
-        if (ioreg.dispstat.w & DSTAT_HBL_IRQ) {
-            ioreg.irq.w |= INT_HBLANK;
-        }
-        if (ioreg.vcount.w < SCREEN_HEIGHT) {
-            dma_update(DMA_AT_HBLANK);
-        }
+static void video_hblank_start() {
+    if (gba->ioreg.vcount.w < SCREEN_HEIGHT) {
+        if (!gba->video_skip_render) video_draw_scanline();
+        video_bg_affine_update();
     }
+    gba->ioreg.dispstat.w |= DSTAT_IN_HBL;  // Enter HBlank
+    if (gba->ioreg.dispstat.w & DSTAT_HBL_IRQ) {
+        gba->ioreg.irq.w |= INT_HBLANK;
+    }
+    if (gba->ioreg.vcount.w < SCREEN_HEIGHT) {
+        dma_update(DMA_AT_HBLANK);
+    }
+}
 
-    if (line_cycles < last_line_cycles) {
-        ioreg.dispstat.w &= ~DSTAT_IN_HBL;  // Leave HBlank
-        ioreg.vcount.w = (ioreg.vcount.w + 1) % NUM_SCANLINES;
-        if (ioreg.vcount.w == 0) {
-            video_bg_affine_reset(0);
-            video_bg_affine_reset(1);
-        } else if (ioreg.vcount.w == SCREEN_HEIGHT) {
-            ioreg.dispstat.w |= DSTAT_IN_VBL;  // Enter VBlank
-            dma_update(DMA_AT_VBLANK);
-        } else if (ioreg.vcount.w == SCREEN_HEIGHT + 1) {
-            // FIXME Implement proper IRQ delay
-            if (ioreg.dispstat.w & DSTAT_VBL_IRQ) {
-                ioreg.irq.w |= INT_VBLANK;
-            }
-        } else if (ioreg.vcount.w == NUM_SCANLINES - 1) {
-            ioreg.dispstat.w &= ~DSTAT_IN_VBL;  // Leave VBlank
+static void video_scanline_end() {
+    gba->ioreg.dispstat.w &= ~DSTAT_IN_HBL;  // Leave HBlank
+    gba->ioreg.vcount.w = (gba->ioreg.vcount.w + 1) % NUM_SCANLINES;
+    if (gba->ioreg.vcount.w == 0) {
+        video_bg_affine_reset(0);
+        video_bg_affine_reset(1);
+        gba->video_frame_drawn = true;
+    } else if (gba->ioreg.vcount.w == SCREEN_HEIGHT) {
+        gba->ioreg.dispstat.w |= DSTAT_IN_VBL;  // Enter VBlank
+        dma_update(DMA_AT_VBLANK);
+    } else if (gba->ioreg.vcount.w == SCREEN_HEIGHT + 1) {
+        // FIXME Implement proper IRQ delay
+        if (gba->ioreg.dispstat.w & DSTAT_VBL_IRQ) {
+            gba->ioreg.irq.w |= INT_VBLANK;
         }
-        if (ioreg.vcount.w == ioreg.dispstat.b.b1) {
-            ioreg.dispstat.w |= DSTAT_IN_VCT;  // Enter VCount
-            if (ioreg.dispstat.w & DSTAT_VCT_IRQ) {
-                ioreg.irq.w |= INT_VCOUNT;
-            }
-        } else {
-            ioreg.dispstat.w &= ~DSTAT_IN_VCT;  // Leave VCount
+    } else if (gba->ioreg.vcount.w == NUM_SCANLINES - 1) {
+        gba->ioreg.dispstat.w &= ~DSTAT_IN_VBL;  // Leave VBlank
+    }
+    if (gba->ioreg.vcount.w == gba->ioreg.dispstat.b.b1) {
+        gba->ioreg.dispstat.w |= DSTAT_IN_VCT;  // Enter VCount
+        if (gba->ioreg.dispstat.w & DSTAT_VCT_IRQ) {
+            gba->ioreg.irq.w |= INT_VCOUNT;
         }
+    } else {
+        gba->ioreg.dispstat.w &= ~DSTAT_IN_VCT;  // Leave VCount
     }
+}
 
-    if (frame_cycles < last_frame_cycles) {
-        video_frame_drawn = true;
+void video_event(uint64_t when) {
+    // Reschedule first, since DMA transfers started below can tick the clock
+    if (!(gba->ioreg.dispstat.w & DSTAT_IN_HBL)) {
+        scheduler_add(EVENT_VIDEO, when + CYCLES_HBLANK);
+        video_hblank_start();
+    } else {
+        scheduler_add(EVENT_VIDEO, when + CYCLES_HDRAW);
+        video_scanline_end();
     }
 }
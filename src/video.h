@@ -17,11 +17,8 @@
 #define CYCLES_VBLANK   (CYCLES_SCANLINE * 68)             // 83776
 #define CYCLES_FRAME    (CYCLES_VDRAW + CYCLES_VBLANK)     // 280896
 
-extern uint32_t video_cycles;
-extern bool video_frame_drawn;
-
-extern uint32_t screen_texture;
-extern uint32_t screen_pixels[SCREEN_HEIGHT][SCREEN_WIDTH];
+#define TILE_SLOTS      (0x18000 / 32)  // Decoded tile cache entries, one per 32 bytes of VRAM
+#define COLOR_COUNT     0x8000          // Entries in a colour lookup table, one per BGR555 value
 
 #define DCNT_GB       (1 << 3)
 #define DCNT_PAGE     (1 << 4)
@@ -44,6 +41,45 @@ extern uint32_t screen_pixels[SCREEN_HEIGHT][SCREEN_WIDTH];
 #define DSTAT_HBL_IRQ (1 << 4)
 #define DSTAT_VCT_IRQ (1 << 5)
 
+enum ScanlineFlags {
+    EnableBlend = 1,
+    SpriteTransparency = 2,
+    SpriteMask = 4
+};
+
+// The top two layers at each pixel of the line being drawn, kept as separate arrays so the
+// compositor can load them a vector at a time
+struct ScanlineInfo {
+    uint16_t top[SCREEN_WIDTH];
+    uint16_t bottom[SCREEN_WIDTH];
+    uint8_t top_bg[SCREEN_WIDTH];  // 0-3 for BGs, 4 for sprites, 5 for the backdrop
+    uint8_t bottom_bg[SCREEN_WIDTH];
+    uint8_t flags[SCREEN_WIDTH];
+};
+
+struct BlendInfo {
+    int top_bgs;     // BLDCNT first target layers
+    int bottom_bgs;  // BLDCNT second target layers
+    int mode;        // 0 off, 1 alpha blending, 2 brightness increase, 3 brightness decrease
+    int eva;         // Coefficients in 16ths, clamped to 16
+    int evb;
+    int evy;
+};
+
+struct WindowInfo {
+    int left;
+    int top;
+    int right;
+    int bottom;
+};
+
 bool video_in_bitmap_mode();
+void video_set_color_lut(const uint32_t *lut);
+void video_tile_write(uint32_t offset);
+void video_tile_cache_flush();
 void video_bg_affine_reset(int i);
-void video_update(uint32_t cycles);
+void video_init(uint32_t frame_cycles);
+void video_event(uint64_t when);
+
+// video-compose.cpp
+void video_compose_line(const ScanlineInfo &scanline, const BlendInfo &blend, const uint32_t *lut, uint32_t *out);